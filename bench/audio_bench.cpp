@@ -0,0 +1,119 @@
+// Checks that the SIMD audio kernels this CPU supports produce exactly the
+// scalar output, on the block sizes that leave a tail for the scalar loop,
+// then times them on the mixer's typical workload. A mismatch ends the run
+// with an error.
+//
+// Usage: audio_bench [blocks]
+
+#include "bench_utils.h"
+#include "audio_kernels.h"
+#include <iomanip>
+#include <iostream>
+
+struct kernels_run_t {
+    uint64_t resample_mono_ns_, resample_stereo_ns_, mix_ns_;
+    std::vector<int16_t> out_;
+};
+
+// Loud noise, so the saturation gets exercised too
+static std::vector<int16_t> make_noise(size_t samples, uint32_t &seed)
+{
+    std::vector<int16_t> res(samples);
+    for(auto &cur : res)
+        cur = int16_t((seed = seed * 1103515245 + 12345) >> 16);
+    return res;
+}
+
+// Mixes a block of the 16kHz speech channel into the 48kHz media channel,
+// the way the mixer does it, and times each step
+static kernels_run_t run_kernels(const audio_kernels_t &kernels, uint32_t iterations,
+                                 const std::vector<int16_t> &mono,
+                                 const std::vector<int16_t> &stereo, size_t frames)
+{
+    kernels_run_t res = kernels_run_t();
+    std::vector<int16_t> speech(frames * 2);
+    res.out_.resize(frames * 2);
+    uint32_t step = uint32_t((uint64_t(16000) << 16) / 48000);
+
+    for(uint32_t f = 0; f < iterations; ++f)
+    {
+        uint32_t phase = f * 0x1234 & 0xffff;
+        auto start = std::chrono::steady_clock::now();
+        kernels.resample_(mono.data(), 1, speech.data(), frames, phase, step);
+        auto resampled = std::chrono::steady_clock::now();
+        kernels.resample_(stereo.data(), 2, res.out_.data(), frames, 0, 0x10000);
+        auto copied = std::chrono::steady_clock::now();
+        kernels.mix_(res.out_.data(), speech.data(), frames * 2, AUDIO_UNITY_GAIN / 3);
+        kernels.mix_(res.out_.data(), speech.data(), frames * 2, AUDIO_UNITY_GAIN);
+        auto mixed = std::chrono::steady_clock::now();
+
+        res.resample_mono_ns_ += uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                resampled - start).count());
+        res.resample_stereo_ns_ += uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                copied - resampled).count());
+        res.mix_ns_ += uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                mixed - copied).count());
+    }
+    return res;
+}
+
+// The vector loops handle 4 or 8 frames at once, the odd sizes leave the
+// rest to the tail
+static void check_outputs()
+{
+    static const size_t frame_counts[] = {1, 3, 7, 8, 9, 15, 17, 33, 240};
+    const audio_kernels_t &scalar = scalar_audio_kernels();
+    uint32_t seed = 7;
+    for(size_t frames : frame_counts)
+    {
+        std::vector<int16_t> mono = make_noise(frames / 3 + 2, seed);
+        std::vector<int16_t> stereo = make_noise(frames * 2 + 2, seed);
+        kernels_run_t expected = run_kernels(scalar, 16, mono, stereo, frames);
+        for(const audio_kernels_t *cur : supported_audio_kernels())
+            check(run_kernels(*cur, 16, mono, stereo, frames).out_ == expected.out_,
+                  std::string(cur->name_) + " produces the scalar output for " +
+                  std::to_string(frames) + " frames");
+    }
+}
+
+// Times a 5ms block
+static void bench_kernels(uint32_t iterations)
+{
+    const size_t frames = 240;
+    uint32_t seed = 1;
+    std::vector<int16_t> mono = make_noise(frames / 3 + 2, seed);
+    std::vector<int16_t> stereo = make_noise(frames * 2 + 2, seed);
+
+    std::cout << "Per 5ms block of 48kHz stereo, averaged over " << iterations << " blocks:"
+              << std::endl;
+    kernels_run_t scalar = run_kernels(scalar_audio_kernels(), iterations, mono, stereo, frames);
+    uint64_t scalar_total = scalar.resample_mono_ns_ + scalar.resample_stereo_ns_ + scalar.mix_ns_;
+    for(const audio_kernels_t *cur : supported_audio_kernels())
+    {
+        kernels_run_t run = cur == &scalar_audio_kernels()
+                            ? scalar : run_kernels(*cur, iterations, mono, stereo, frames);
+        uint64_t total = run.resample_mono_ns_ + run.resample_stereo_ns_ + run.mix_ns_;
+        std::cout << std::setw(8) << cur->name_
+                  << ": resample 16kHz mono " << run.resample_mono_ns_ / iterations << "ns"
+                  << ", resample 48kHz stereo " << run.resample_stereo_ns_ / iterations << "ns"
+                  << ", mix " << run.mix_ns_ / iterations << "ns"
+                  << ", " << std::fixed << std::setprecision(2)
+                  << (total ? double(scalar_total) / total : 0) << "x the scalar speed"
+                  << std::endl;
+        check(run.out_ == scalar.out_, std::string(cur->name_) + " produces the scalar output");
+    }
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t iterations = argc > 1 ? uint32_t(std::stoul(argv[1])) : 100000;
+    try {
+        check_outputs();
+        bench_kernels(std::max<uint32_t>(iterations, 1));
+    } catch(const std::exception &ex)
+    {
+        std::cerr << ex.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
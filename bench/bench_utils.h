@@ -0,0 +1,22 @@
+#ifndef AAUTO_BENCH_UTILS_H
+#define AAUTO_BENCH_UTILS_H
+
+#include <chrono>
+#include <stdexcept>
+#include <string>
+
+// Shared by the benchmarks. A failed check ends the run with an error, so
+// ctest sees it.
+inline void check(bool ok, const std::string &what)
+{
+    if (!ok)
+        throw std::runtime_error("Check failed: " + what);
+}
+
+inline double mbps(size_t bytes, std::chrono::steady_clock::duration elapsed)
+{
+    double sec = std::chrono::duration<double>(elapsed).count();
+    return sec > 0 ? bytes / sec / (1024*1024) : 0;
+}
+
+#endif //AAUTO_BENCH_UTILS_H
@@ -0,0 +1,142 @@
+// Measures crypto_context_t against an in-process TLS 1.2 server, per
+// record size, with the reader and the writer running one after the other
+// and then concurrently. Both the SSL records and the direct ones are run.
+// The latencies are the p50/p99 upper bounds from the context's own stats.
+//
+// Usage: crypto_bench [megabytes per run]
+
+#include "bench_utils.h"
+#include "tls_peer.h"
+#include "scope_guard.h"
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+struct run_result_t {
+    double encrypt_mbps_, decrypt_mbps_;
+    // All the size classes together, a run uses one message size
+    crypto_op_stats_t encrypt_, decrypt_;
+};
+
+static crypto_op_stats_t sum_since(const crypto_op_stats_t (&after)[CRYPTO_SIZE_CLASSES],
+                                   const crypto_op_stats_t (&before)[CRYPTO_SIZE_CLASSES])
+{
+    crypto_op_stats_t res = crypto_op_stats_t();
+    for(int f=0; f<CRYPTO_SIZE_CLASSES; ++f)
+    {
+        crypto_op_stats_t cur = after[f].since(before[f]);
+        res.ops_ += cur.ops_;
+        res.bytes_ += cur.bytes_;
+        res.busy_ns_ += cur.busy_ns_;
+        res.lock_wait_ns_ += cur.lock_wait_ns_;
+        for(int b=0; b<crypto_op_stats_t::latency_buckets_; ++b)
+            res.latency_hist_[b] += cur.latency_hist_[b];
+    }
+    return res;
+}
+
+// "p50/p99" in microseconds
+static std::string latency_us(const crypto_op_stats_t &stats)
+{
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(1) << stats.latency_percentile(0.5) / 1e3 << "/"
+        << stats.latency_percentile(0.99) / 1e3;
+    return out.str();
+}
+
+// Encrypts and decrypts count messages of the size, one direction after
+// the other or both at once
+static run_result_t run(crypto_context_t &client, tls_server_t &server, size_t size,
+                        size_t count, bool concurrent)
+{
+    buf_t payload(size);
+    for(size_t f=0; f<size; ++f)
+        payload[f] = u_char(f * 7);
+
+    // The incoming records are prepared up front, the server isn't timed
+    std::vector<buf_t> incoming(count);
+    for(buf_t &cur : incoming)
+        cur = server.encrypt(payload.data(), size);
+
+    crypto_stats_t before = client.get_stats();
+    std::chrono::steady_clock::duration encrypt_time, decrypt_time;
+    auto encrypt_all = [&]{
+        auto start = std::chrono::steady_clock::now();
+        buf_t out;
+        out.reserve(size + 1024);
+        for(size_t f=0; f<count; ++f) {
+            out.clear();
+            client.encrypt_to(payload.data(), size, out);
+        }
+        encrypt_time = std::chrono::steady_clock::now() - start;
+    };
+    auto decrypt_all = [&]{
+        auto start = std::chrono::steady_clock::now();
+        buf_t out;
+        out.reserve(size + 1024);
+        for(const buf_t &cur : incoming) {
+            out.clear();
+            client.decrypt_to(cur.data(), cur.size(), out);
+            if (out.size() != size)
+                throw std::runtime_error("Decrypted a wrong size");
+        }
+        decrypt_time = std::chrono::steady_clock::now() - start;
+    };
+
+    if (concurrent) {
+        std::thread writer(encrypt_all);
+        ON_BLOCK_EXIT([&]{writer.join();});
+        decrypt_all();
+    } else {
+        encrypt_all();
+        decrypt_all();
+    }
+
+    crypto_stats_t after = client.get_stats();
+    run_result_t res;
+    res.encrypt_mbps_ = mbps(size * count, encrypt_time);
+    res.decrypt_mbps_ = mbps(size * count, decrypt_time);
+    res.encrypt_ = sum_since(after.encrypt_, before.encrypt_);
+    res.decrypt_ = sum_since(after.decrypt_, before.decrypt_);
+    return res;
+}
+
+int main(int argc, char **argv)
+{
+    size_t megabytes = argc > 1 ? size_t(std::stoul(argv[1])) : 32;
+    init_crypto();
+
+    std::string cert, pk;
+    make_identity(cert, pk);
+
+    static const size_t sizes[] = {16, 64, 256, 1024, 4096, 16384, 65536};
+    for(bool direct : {false, true})
+    {
+        tls_server_t server(cert, pk);
+        std::shared_ptr<crypto_context_t> client = connect_client(server, cert, pk, direct);
+        std::cout << (direct ? "Direct records" : "SSL records")
+                  << ", MB/s and p50/p99 us:" << std::endl;
+        std::cout << std::setw(8) << "size" << std::setw(12) << "encrypt" << std::setw(12)
+                  << "decrypt" << std::setw(14) << "enc || dec" << std::setw(12) << "dec"
+                  << std::setw(14) << "lock wait ms" << std::setw(14) << "seq enc"
+                  << std::setw(14) << "seq dec" << std::setw(14) << "conc enc"
+                  << std::setw(14) << "conc dec" << std::endl;
+        for(size_t size : sizes)
+        {
+            size_t count = std::max<size_t>(megabytes * 1024 * 1024 / size / 2, 100);
+            run_result_t seq = run(*client, server, size, count, false);
+            run_result_t conc = run(*client, server, size, count, true);
+            std::cout << std::fixed << std::setprecision(1)
+                      << std::setw(8) << size << std::setw(12) << seq.encrypt_mbps_
+                      << std::setw(12) << seq.decrypt_mbps_ << std::setw(14) << conc.encrypt_mbps_
+                      << std::setw(12) << conc.decrypt_mbps_ << std::setw(14)
+                      << (conc.encrypt_.lock_wait_ns_ + conc.decrypt_.lock_wait_ns_) / 1e6
+                      << std::setw(14) << latency_us(seq.encrypt_)
+                      << std::setw(14) << latency_us(seq.decrypt_)
+                      << std::setw(14) << latency_us(conc.encrypt_)
+                      << std::setw(14) << latency_us(conc.decrypt_) << std::endl;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,105 @@
+// Checks that a phone honouring the video ack window never fills the video
+// queue sized the way proto_t sizes it, so the control messages behind a
+// video burst are never held up, and that a phone ignoring the window is
+// reported instead of stalling the reader. Times the control dispatch too.
+
+#include "bench_utils.h"
+#include "dispatcher.h"
+#include "media_flow.h"
+#include <iostream>
+#include <thread>
+
+static packet_ptr_t make_message(u_char chan, u_char msg_type)
+{
+    packet_ptr_t packet = alloc_packet(chan, true, false, 8);
+    packet->content_ = {0, msg_type};
+    return packet;
+}
+
+static void check_honest_phone()
+{
+    notifier_t terminator;
+    dispatcher_t dispatcher(&terminator);
+    media_ack_window_t window(VIDEO_MAX_UNACKED);
+    std::atomic<uint32_t> credit(VIDEO_MAX_UNACKED);
+    std::atomic<uint64_t> control_handled(0);
+
+    // A slow decoder, it acks each frame once it's done with it
+    dispatcher.add_handler(AA_VIDEO_CHANNEL, AA_MEDIA_DATA, WORK_VIDEO,
+                           [&](const packet_ptr_t &) {
+        window.on_received();
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        credit += window.on_consumed(0);
+    });
+    dispatcher.add_handler(AA_VIDEO_CHANNEL, AA_CODEC_DATA, WORK_VIDEO,
+                           [](const packet_ptr_t &) {});
+    dispatcher.add_handler(AA_CONTROL_CHANNEL, AA_NAV_FOCUS_REQUEST, WORK_CONTROL,
+                           [&](const packet_ptr_t &) { control_handled++; });
+    dispatcher.set_queue_capacity(WORK_VIDEO, VIDEO_QUEUE_CAPACITY, true);
+    dispatcher.start();
+
+    const int frames = 300;
+    uint64_t worst_ns = 0;
+    for(int f=0; f<frames; ++f)
+    {
+        // The codec data isn't counted by the window, a restart sends it again
+        if (f % 50 == 0)
+            for(int g=0; g<4; ++g)
+                dispatcher.dispatch(make_message(AA_VIDEO_CHANNEL, AA_CODEC_DATA));
+        while(credit == 0)
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        credit--;
+
+        auto start = std::chrono::steady_clock::now();
+        dispatcher.dispatch(make_message(AA_VIDEO_CHANNEL, AA_MEDIA_DATA));
+        dispatcher.dispatch(make_message(AA_CONTROL_CHANNEL, AA_NAV_FOCUS_REQUEST));
+        worst_ns = std::max<uint64_t>(worst_ns, uint64_t(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - start).count()));
+    }
+    while(control_handled != uint64_t(frames))
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    dispatch_stats_t stats = dispatcher.get_stats();
+    check(stats.full_waits_[WORK_VIDEO] == 0, "the reader never waits for the video queue");
+    check(stats.max_queue_depth_[WORK_VIDEO] < VIDEO_QUEUE_CAPACITY,
+          "the window keeps the video queue from filling up");
+    std::cout << "Honest phone: ok, video queue depth at most "
+              << stats.max_queue_depth_[WORK_VIDEO] << " of " << VIDEO_QUEUE_CAPACITY
+              << ", worst dispatch " << worst_ns / 1000 << "us" << std::endl;
+}
+
+static void check_rogue_phone()
+{
+    notifier_t terminator;
+    dispatcher_t dispatcher(&terminator);
+    dispatcher.add_handler(AA_VIDEO_CHANNEL, AA_MEDIA_DATA, WORK_VIDEO, [](const packet_ptr_t &) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    });
+    dispatcher.set_queue_capacity(WORK_VIDEO, VIDEO_QUEUE_CAPACITY, true);
+    dispatcher.start();
+
+    bool failed = false;
+    try {
+        for(size_t f=0; f<4*VIDEO_QUEUE_CAPACITY; ++f)
+            dispatcher.dispatch(make_message(AA_VIDEO_CHANNEL, AA_MEDIA_DATA));
+    } catch(const std::runtime_error &)
+    {
+        failed = true;
+    }
+    check(failed, "ignoring the window is an error");
+    std::cout << "Rogue phone: ok, the overflow is reported" << std::endl;
+}
+
+int main()
+{
+    try {
+        check_honest_phone();
+        check_rogue_phone();
+    } catch(const std::exception &ex)
+    {
+        std::cerr << ex.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,170 @@
+#include "fake_usb.h"
+#include <libusb.h>
+#include <stdlib.h>
+#include <deque>
+#include <thread>
+
+typedef std::chrono::steady_clock bus_clock_t;
+
+struct libusb_context {
+    std::mutex mutex_;
+    std::condition_variable submitted_cv_, completed_cv_;
+    // The IN transfers waiting for the bus in order, with their submission time
+    std::deque<std::pair<libusb_transfer*, bus_clock_t::time_point>> submitted_;
+    std::deque<libusb_transfer*> completed_;
+    buf_t stream_;
+    size_t stream_offset_;
+    double bytes_per_usec_;
+    std::chrono::microseconds idle_slot_;
+    bus_clock_t::duration idle_;
+    bool closing_;
+    std::thread bus_;
+};
+
+struct libusb_device_handle {
+    libusb_context *ctx_;
+};
+
+// Completes the transfers one after the other on the bus' own schedule, so
+// a late wakeup of this thread doesn't slow the pipe down
+static void run_bus(libusb_context *ctx)
+{
+    std::unique_lock<std::mutex> l(ctx->mutex_);
+    bus_clock_t::time_point bus_free;
+    while(true)
+    {
+        ctx->submitted_cv_.wait(l, [ctx]{
+            return ctx->closing_ || (!ctx->submitted_.empty() &&
+                                     ctx->stream_offset_ != ctx->stream_.size());
+        });
+        if (ctx->closing_)
+            return;
+
+        libusb_transfer *xfer = ctx->submitted_.front().first;
+        bus_clock_t::time_point submitted = ctx->submitted_.front().second;
+        bus_clock_t::time_point start = bus_free;
+        if (bus_free == bus_clock_t::time_point()) {
+            start = submitted;
+        } else if (submitted > bus_free) {
+            // Nothing was queued, the pipe went idle
+            start = submitted + ctx->idle_slot_;
+            ctx->idle_ += start - bus_free;
+        }
+
+        size_t len = std::min(size_t(xfer->length), ctx->stream_.size() - ctx->stream_offset_);
+        bus_free = start + std::chrono::microseconds(uint64_t(len / ctx->bytes_per_usec_));
+        l.unlock();
+        std::this_thread::sleep_until(bus_free);
+        l.lock();
+
+        // Cancelled in the meantime
+        if (ctx->submitted_.empty() || ctx->submitted_.front().first != xfer)
+            continue;
+        ctx->submitted_.pop_front();
+        memcpy(xfer->buffer, &ctx->stream_[ctx->stream_offset_], len);
+        ctx->stream_offset_ += len;
+        xfer->actual_length = int(len);
+        xfer->status = LIBUSB_TRANSFER_COMPLETED;
+        ctx->completed_.push_back(xfer);
+        ctx->completed_cv_.notify_all();
+    }
+}
+
+fake_usb_device_t::fake_usb_device_t(const buf_t &stream, double bus_mbps,
+                                     uint32_t idle_slot_usec) :
+        ctx_(new libusb_context()), handle_(new libusb_device_handle())
+{
+    handle_->ctx_ = ctx_;
+    ctx_->stream_ = stream;
+    ctx_->stream_offset_ = 0;
+    ctx_->bytes_per_usec_ = bus_mbps * 1024 * 1024 / 1e6;
+    ctx_->idle_slot_ = std::chrono::microseconds(idle_slot_usec);
+    ctx_->idle_ = bus_clock_t::duration();
+    ctx_->closing_ = false;
+    ctx_->bus_ = std::thread(&run_bus, ctx_);
+}
+
+fake_usb_device_t::~fake_usb_device_t()
+{
+    {
+        std::unique_lock<std::mutex> l(ctx_->mutex_);
+        ctx_->closing_ = true;
+        ctx_->submitted_cv_.notify_all();
+    }
+    ctx_->bus_.join();
+    delete handle_;
+    delete ctx_;
+}
+
+std::chrono::steady_clock::duration fake_usb_device_t::get_idle_time()
+{
+    std::unique_lock<std::mutex> l(ctx_->mutex_);
+    return ctx_->idle_;
+}
+
+libusb_transfer *libusb_alloc_transfer(int iso_packets)
+{
+    if (iso_packets != 0)
+        return nullptr;
+    return static_cast<libusb_transfer*>(calloc(1, sizeof(libusb_transfer)));
+}
+
+void libusb_free_transfer(libusb_transfer *transfer)
+{
+    free(transfer);
+}
+
+int libusb_submit_transfer(libusb_transfer *transfer)
+{
+    libusb_context *ctx = transfer->dev_handle->ctx_;
+    std::unique_lock<std::mutex> l(ctx->mutex_);
+    if (ctx->closing_)
+        return LIBUSB_ERROR_NO_DEVICE;
+    ctx->submitted_.push_back(std::make_pair(transfer, bus_clock_t::now()));
+    ctx->submitted_cv_.notify_all();
+    return LIBUSB_SUCCESS;
+}
+
+int libusb_cancel_transfer(libusb_transfer *transfer)
+{
+    libusb_context *ctx = transfer->dev_handle->ctx_;
+    std::unique_lock<std::mutex> l(ctx->mutex_);
+    for(auto cur = ctx->submitted_.begin(); cur != ctx->submitted_.end(); ++cur)
+    {
+        if (cur->first != transfer)
+            continue;
+        ctx->submitted_.erase(cur);
+        transfer->actual_length = 0;
+        transfer->status = LIBUSB_TRANSFER_CANCELLED;
+        ctx->completed_.push_back(transfer);
+        ctx->completed_cv_.notify_all();
+        return LIBUSB_SUCCESS;
+    }
+    return LIBUSB_ERROR_NOT_FOUND;
+}
+
+// Delivers the completions on the calling thread, like libusb does
+int libusb_handle_events_timeout_completed(libusb_context *ctx, struct timeval *tv,
+                                           int *completed)
+{
+    std::deque<libusb_transfer*> ready;
+    {
+        std::unique_lock<std::mutex> l(ctx->mutex_);
+        ctx->completed_cv_.wait_for(l, std::chrono::seconds(tv->tv_sec) +
+                                       std::chrono::microseconds(tv->tv_usec),
+                                    [ctx]{ return !ctx->completed_.empty(); });
+        ready.swap(ctx->completed_);
+    }
+    for(libusb_transfer *cur : ready)
+        cur->callback(cur);
+    return LIBUSB_SUCCESS;
+}
+
+const char *libusb_error_name(int errcode)
+{
+    switch(errcode) {
+        case LIBUSB_ERROR_NO_DEVICE: return "LIBUSB_ERROR_NO_DEVICE";
+        case LIBUSB_ERROR_NOT_FOUND: return "LIBUSB_ERROR_NOT_FOUND";
+        default: return "LIBUSB_ERROR_OTHER";
+    }
+}
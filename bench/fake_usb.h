@@ -0,0 +1,31 @@
+#ifndef AAUTO_FAKE_USB_H
+#define AAUTO_FAKE_USB_H
+
+#include "utils.h"
+#include <chrono>
+
+struct libusb_context;
+struct libusb_device_handle;
+
+// A phone on a USB bulk pipe, in process. It implements the libusb transfer
+// calls usb_reader_t makes, so the real reader runs against it without
+// the library or a device. The IN endpoint serves the stream at the pace of
+// the bus: a transfer occupies it for its size over the bandwidth, and one
+// submitted to an idle pipe waits for the next slot of the host controller.
+// Once the stream is over the transfers stay pending until cancelled.
+class fake_usb_device_t {
+    libusb_context *ctx_;
+    libusb_device_handle *handle_;
+public:
+    fake_usb_device_t(const buf_t &stream, double bus_mbps, uint32_t idle_slot_usec);
+    ~fake_usb_device_t();
+
+    // The context to handle the events of, the completions are delivered by
+    // libusb_handle_events_timeout_completed
+    libusb_context *get_context() const { return ctx_; }
+    libusb_device_handle *get_handle() const { return handle_; }
+    // The time the pipe sat idle between the transfers
+    std::chrono::steady_clock::duration get_idle_time();
+};
+
+#endif //AAUTO_FAKE_USB_H
@@ -0,0 +1,278 @@
+// Checks the framing path on the corner cases a phone rarely hits, then
+// times it: the ring wrapping around with split regions, messages
+// reassembled across many IN transfers, the parser throughput and the
+// encrypt-into-transfer send path against the old copying one. A failed
+// check ends the run with an error.
+//
+// Usage: framing_bench [megabytes per run]
+
+#include "bench_utils.h"
+#include "framing.h"
+#include "phone_stream.h"
+#include <deque>
+#include <iomanip>
+#include <iostream>
+
+// Fills and drains a small ring by uneven amounts, so the free space and
+// the data keep straddling the end of the buffer. A deque holds the
+// expected contents.
+static void check_ring_wrap()
+{
+    ring_buffer_t ring(16);
+    std::deque<u_char> expected;
+    u_char next = 0;
+    size_t split_commits = 0;
+    for(size_t round = 0; round < 1000; ++round)
+    {
+        if (round % 2 == 0) {
+            // Filled in place, the way the socket transport's readv() does
+            iovec regions[2];
+            size_t count = ring.free_regions(regions);
+            size_t want = std::min<size_t>(round * 7 % 17, ring.free_space());
+            size_t filled = 0;
+            for(size_t f=0; f<count && filled < want; ++f) {
+                size_t len = std::min(regions[f].iov_len, want - filled);
+                for(size_t g=0; g<len; ++g) {
+                    static_cast<u_char*>(regions[f].iov_base)[g] = next;
+                    expected.push_back(next++);
+                }
+                filled += len;
+            }
+            check(filled == want, "the free regions cover the free space");
+            if (count == 2 && want > regions[0].iov_len)
+                split_commits++;
+            ring.commit(want);
+        } else {
+            u_char data[11];
+            size_t len = round * 3 % sizeof(data);
+            for(size_t f=0; f<len; ++f)
+                data[f] = u_char(next + f);
+            size_t room = ring.free_space();
+            size_t taken = ring.write(data, len);
+            check(taken == std::min(len, room), "write() takes what fits");
+            for(size_t f=0; f<taken; ++f)
+                expected.push_back(next++);
+        }
+
+        check(ring.size() == expected.size(), "the ring keeps every byte");
+        for(size_t f=0; f<ring.size(); ++f)
+            check(ring.at(f) == expected[f], "at() reads across the end");
+        size_t take = std::min<size_t>(round * 5 % 13, ring.size());
+        buf_t copied;
+        ring.copy_to(0, take, copied);
+        check(copied == buf_t(expected.begin(), expected.begin() + take),
+              "copy_to() copies across the end");
+        ring.consume(take);
+        expected.erase(expected.begin(), expected.begin() + take);
+    }
+    check(split_commits != 0, "some commits spanned the end of the ring");
+    std::cout << "Ring wrap-around: ok, " << split_commits << " split commits" << std::endl;
+}
+
+// Feeds the stream in IN transfers of transfer_size, the way transport_t
+// drains its completed transfers: as much as the parser takes, then
+// whatever packets it completes. Returns the number of packets.
+static size_t parse_in_transfers(frame_parser_t &parser, const buf_t &stream,
+                                 size_t transfer_size, std::vector<packet_ptr_t> *out)
+{
+    size_t pos = 0, packets = 0;
+    while(true)
+    {
+        size_t fed = 0;
+        if (pos < stream.size()) {
+            size_t end = std::min((pos / transfer_size + 1) * transfer_size, stream.size());
+            fed = parser.feed(&stream[pos], end - pos);
+            pos += fed;
+        }
+        size_t parsed = 0;
+        while(packet_ptr_t packet = parser.next_packet()) {
+            if (out)
+                out->push_back(packet);
+            parsed++;
+        }
+        packets += parsed;
+        if (pos == stream.size() && parsed == 0)
+            break;
+        check(fed != 0 || parsed != 0, "the parser makes progress");
+    }
+    check(parser.buffered() == 0, "the whole stream is parsed");
+    return packets;
+}
+
+static void check_reassembly(const std::string &cert, const std::string &pk)
+{
+    std::vector<packet_ptr_t> messages = make_messages(2*1024*1024);
+    for(bool encrypted : {false, true})
+    {
+        // Odd transfer sizes split the headers too. The small parser
+        // wraps around all the time.
+        for(size_t transfer_size : {size_t(16384), size_t(1000), size_t(7)})
+        {
+            // The records can only be decrypted once, each run gets its own
+            // session
+            tls_server_t server(cert, pk);
+            std::shared_ptr<crypto_context_t> client;
+            if (encrypted)
+                client = connect_client(server, cert, pk, false);
+            buf_t stream = build_stream(messages, encrypted ? &server : nullptr);
+
+            frame_parser_t parser(32768);
+            parser.set_crypto(client);
+            std::vector<packet_ptr_t> received;
+            parse_in_transfers(parser, stream, transfer_size, &received);
+
+            // Only the order within a channel is defined
+            check(received.size() == messages.size(), "every message arrives");
+            std::vector<size_t> next(AA_MAX_CHANNEL + 1);
+            std::vector<std::vector<const packet_t*>> by_chan(AA_MAX_CHANNEL + 1);
+            for(const packet_ptr_t &cur : messages)
+                by_chan[cur->chan_].push_back(cur.get());
+            for(const packet_ptr_t &cur : received) {
+                check(next[cur->chan_] < by_chan[cur->chan_].size(), "no extra messages");
+                const packet_t *expected = by_chan[cur->chan_][next[cur->chan_]++];
+                check(cur->content_ == expected->content_, "the messages arrive intact");
+                check(cur->encrypted_ == encrypted, "the encryption flag is kept");
+            }
+        }
+        std::cout << "Reassembly across IN transfers" << (encrypted ? ", encrypted" : "")
+                  << ": ok, " << messages.size() << " messages" << std::endl;
+    }
+}
+
+static void bench_parser(const std::string &cert, const std::string &pk, size_t megabytes)
+{
+    std::vector<packet_ptr_t> messages = make_messages(megabytes * 1024 * 1024);
+    for(bool encrypted : {false, true})
+    {
+        tls_server_t server(cert, pk);
+        std::shared_ptr<crypto_context_t> client;
+        if (encrypted)
+            client = connect_client(server, cert, pk, true);
+        buf_t stream = build_stream(messages, encrypted ? &server : nullptr);
+
+        std::cout << "Parser, " << (encrypted ? "direct records" : "plaintext") << ":" << std::endl;
+        for(size_t transfer_size : {size_t(512), size_t(16384), size_t(131072)})
+        {
+            // The records can only be decrypted once
+            if (encrypted && transfer_size != 16384)
+                continue;
+            frame_parser_t parser;
+            parser.set_crypto(client);
+            auto start = std::chrono::steady_clock::now();
+            size_t packets = parse_in_transfers(parser, stream, transfer_size, nullptr);
+            auto elapsed = std::chrono::steady_clock::now() - start;
+            double sec = std::chrono::duration<double>(elapsed).count();
+            std::cout << std::fixed << std::setprecision(1)
+                      << "  " << std::setw(6) << transfer_size << " byte transfers: "
+                      << mbps(stream.size(), elapsed) << " MB/s, "
+                      << (sec > 0 ? packets / sec : 0) << " messages/s" << std::endl;
+        }
+    }
+}
+
+static void check_send_path(crypto_context_t &client, tls_server_t &server)
+{
+    packet_ptr_t packet = alloc_packet(AA_VIDEO_CHANNEL, true, false, 40000);
+    packet->content_.resize(40000);
+    for(size_t f=0; f<packet->content_.size(); ++f)
+        packet->content_[f] = u_char(f * 3);
+
+    buf_t wire;
+    size_t offset = 0;
+    do
+        offset = append_fragment(*packet, offset, wire, &client);
+    while(offset < packet->content_.size());
+
+    buf_t plain;
+    for(size_t pos = 0; pos < wire.size(); )
+    {
+        check(wire.size() - pos >= 4, "the fragment header is complete");
+        size_t len = (size_t(wire[pos+2]) << 8) | wire[pos+3];
+        bool multi_first = (wire[pos+1] & (AA_FIRST_FRAG | AA_LAST_FRAG)) == AA_FIRST_FRAG;
+        size_t header_size = multi_first ? 8 : 4;
+        check(pos + header_size + len <= wire.size(), "the fragment is complete");
+        buf_t records(wire.begin() + pos + header_size, wire.begin() + pos + header_size + len);
+        buf_t part = server.decrypt(records);
+        plain.insert(plain.end(), part.begin(), part.end());
+        pos += header_size + len;
+    }
+    check(plain == packet->content_, "the server reads the framed records");
+}
+
+// The send path before the headroom-aware framing: the message encrypted
+// into a new buffer, swapped into a new packet, then copied behind the
+// fragment header
+static void send_with_copies(crypto_context_t &client, const packet_t &packet, buf_t &out)
+{
+    buf_t encrypted = client.encrypt(packet.content_, 0);
+    packet_ptr_t framed = alloc_packet(packet.chan_, true, packet.control_, encrypted.size());
+    framed->content_.swap(encrypted);
+    out.push_back(packet.chan_);
+    out.push_back(AA_FIRST_FRAG | AA_LAST_FRAG | AA_ENCRYPTED);
+    out.push_back(u_char(framed->content_.size() >> 8));
+    out.push_back(u_char(framed->content_.size()));
+    out.insert(out.end(), framed->content_.begin(), framed->content_.end());
+}
+
+static void bench_send_path(const std::string &cert, const std::string &pk, size_t megabytes)
+{
+    for(bool direct : {false, true})
+    {
+        tls_server_t server(cert, pk);
+        std::shared_ptr<crypto_context_t> client = connect_client(server, cert, pk, direct);
+        check_send_path(*client, server);
+
+        std::cout << "Send path, " << (direct ? "direct records" : "SSL records")
+                  << ", MB/s:" << std::endl;
+        for(size_t size : {size_t(64), size_t(1024), size_t(16384)})
+        {
+            packet_ptr_t packet = alloc_packet(AA_TOUCHSCREEN_CHANNEL, true, false, size);
+            packet->content_.resize(size, u_char(size));
+            size_t count = std::max<size_t>(megabytes * 1024 * 1024 / size / 4, 100);
+            buf_t out;
+            out.reserve(65536);
+
+            auto start = std::chrono::steady_clock::now();
+            for(size_t f=0; f<count; ++f) {
+                if (out.size() > 32768)
+                    out.clear();
+                append_fragment(*packet, 0, out, client.get());
+            }
+            auto direct_time = std::chrono::steady_clock::now() - start;
+
+            out.clear();
+            start = std::chrono::steady_clock::now();
+            for(size_t f=0; f<count; ++f) {
+                if (out.size() > 32768)
+                    out.clear();
+                send_with_copies(*client, *packet, out);
+            }
+            auto copy_time = std::chrono::steady_clock::now() - start;
+
+            std::cout << std::fixed << std::setprecision(1)
+                      << "  " << std::setw(6) << size << " bytes: into the transfer "
+                      << mbps(size * count, direct_time) << ", with copies "
+                      << mbps(size * count, copy_time) << std::endl;
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    size_t megabytes = argc > 1 ? size_t(std::stoul(argv[1])) : 32;
+    init_crypto();
+    std::string cert, pk;
+    make_identity(cert, pk);
+
+    try {
+        check_ring_wrap();
+        check_reassembly(cert, pk);
+        bench_parser(cert, pk, megabytes);
+        bench_send_path(cert, pk, megabytes);
+    } catch(const std::exception &ex)
+    {
+        std::cerr << ex.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,171 @@
+// Drives audio_mixer_t by hand, without a sound card, and checks the
+// jitter buffer: the latency stays bounded when the phone sends faster than
+// the audio plays, the target grows after an underrun and shrinks back once
+// the playback is smooth, and every packet is reported as consumed exactly
+// once, the dropped ones too. Then times the mixing. A failed check ends the
+// run with an error.
+//
+// Usage: mixer_bench [seconds of audio to time]
+
+#include "bench_utils.h"
+#include "audio_mixer.h"
+#include <iostream>
+#include <map>
+
+// Renders only when asked to, so the checks don't depend on the timing
+class manual_output_t : public audio_output_t {
+public:
+    render_t render_;
+
+    explicit manual_output_t(render_t render) : render_(render) {}
+    void start() override {}
+    void stop() override {}
+};
+
+// A mixer with one input in the phone's media format, played 5ms at a time
+class mixer_rig_t {
+    std::shared_ptr<manual_output_t> output_;
+    buf_t block_;
+    std::vector<packet_ptr_t> submitted_;
+public:
+    audio_mixer_t mixer_;
+    audio_sink_ptr_t sink_;
+    // How many times each packet was reported as consumed
+    std::map<const packet_t*, int> consumed_;
+
+    mixer_rig_t() : mixer_([this](const audio_format_t &format, audio_output_t::render_t render) {
+        block_.resize(format.bytes_for_millis(5));
+        output_ = std::make_shared<manual_output_t>(render);
+        return output_;
+    })
+    {
+        sink_ = mixer_.add_input({48000, 2}, AUDIO_DUCK_NONE,
+                                 [this](const packet_ptr_t &pack, uint64_t) {
+            consumed_[pack.get()]++;
+        });
+        mixer_.start_input(sink_);
+    }
+
+    // The packets are kept, so their addresses aren't reused by the pool
+    void submit(uint32_t frames)
+    {
+        packet_ptr_t pack = alloc_packet(AA_AUDIO0_CHANNEL, true, false,
+                                         AA_MEDIA_DATA_OFFSET + frames * 4);
+        pack->content_.assign(AA_MEDIA_DATA_OFFSET + frames * 4, 1);
+        submitted_.push_back(pack);
+        sink_->submit(pack, AA_MEDIA_DATA_OFFSET);
+    }
+
+    void render()
+    {
+        output_->render_(block_.data(), block_.size());
+    }
+
+    void check_consumed_once()
+    {
+        for(const packet_ptr_t &cur : submitted_)
+            check(consumed_[cur.get()] == 1, "every packet is consumed exactly once");
+        check(consumed_.size() == submitted_.size(), "only the submitted packets are consumed");
+    }
+};
+
+// The phone sends twice as much as is played, in packets that don't line up
+// with the blocks
+static void check_latency_bound()
+{
+    mixer_rig_t rig;
+    uint32_t worst_millis = 0;
+    for(int f=0; f<400; ++f)
+    {
+        rig.submit(240 + f % 7 * 20);
+        rig.submit(240 - f % 5 * 20);
+        rig.render();
+        worst_millis = std::max(worst_millis, rig.sink_->get_stats().buffered_millis_);
+        check(worst_millis <= audio_sink_t::max_latency_millis_,
+              "the buffered audio stays within the latency bound");
+    }
+    audio_sink_stats_t stats = rig.sink_->get_stats();
+    check(stats.bytes_dropped_ != 0, "the excess is dropped");
+    check(stats.underruns_ == 0, "dropping keeps the target buffered");
+
+    // Play out the rest until the sink runs dry, stopping it would discard
+    // the rest unreported
+    while(rig.sink_->get_stats().underruns_ == 0)
+        rig.render();
+    // A packet too short for a frame is reported right away
+    rig.submit(0);
+    rig.check_consumed_once();
+    std::cout << "Latency bound: ok, " << stats.bytes_dropped_ << " bytes dropped, at most "
+              << worst_millis << "ms left buffered after a block" << std::endl;
+}
+
+// A packet per block keeps the buffer at the target
+static void check_target_adapts()
+{
+    mixer_rig_t rig;
+    for(int f=0; f<8; ++f)
+        rig.submit(240);
+    for(int f=0; f<200; ++f) {
+        rig.submit(240);
+        rig.render();
+    }
+    audio_sink_stats_t smooth = rig.sink_->get_stats();
+    check(smooth.underruns_ == 0, "a steady stream doesn't underrun");
+
+    // The phone stalls until the buffer runs dry
+    while(rig.sink_->get_stats().underruns_ == 0)
+        rig.render();
+    uint32_t grown = rig.sink_->get_stats().target_millis_;
+    check(grown > smooth.target_millis_, "the target grows after an underrun");
+
+    // A few seconds of smooth playback bring it back
+    for(int f=0; f<2000; ++f) {
+        rig.submit(240);
+        rig.render();
+    }
+    audio_sink_stats_t after = rig.sink_->get_stats();
+    check(after.underruns_ == 1, "the stream plays on smoothly");
+    check(after.target_millis_ < grown, "the target shrinks back");
+    std::cout << "Adaptive target: ok, " << smooth.target_millis_ << "ms, "
+              << grown << "ms after an underrun, " << after.target_millis_ << "ms after 10s"
+              << std::endl;
+}
+
+static void bench_mixer(uint32_t seconds)
+{
+    mixer_rig_t rig;
+    // The guidance channel mixed in, at its own rate
+    audio_sink_ptr_t guidance = rig.mixer_.add_input({16000, 1}, AUDIO_DUCK_GUIDANCE,
+                                                     [](const packet_ptr_t &, uint64_t) {});
+    rig.mixer_.start_input(guidance);
+    for(int f=0; f<8; ++f)
+        rig.submit(240);
+
+    buf_t speech(AA_MEDIA_DATA_OFFSET + 80 * 2, 1);
+    for(uint32_t f=0; f<seconds * 200; ++f) {
+        rig.submit(240);
+        packet_ptr_t pack = alloc_packet(AA_AUDIO1_CHANNEL, true, false, speech.size());
+        pack->content_ = speech;
+        guidance->submit(pack, AA_MEDIA_DATA_OFFSET);
+        rig.render();
+    }
+    audio_mixer_stats_t stats = rig.mixer_.get_stats();
+    std::cout << "Mixing with the " << rig.mixer_.get_kernels_name() << " kernels: "
+              << stats.mix_ns_total_ / std::max<uint64_t>(stats.blocks_, 1) << "ns per 5ms block, "
+              << stats.max_mix_ns_ << "ns at most" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t seconds = argc > 1 ? uint32_t(std::stoul(argv[1])) : 60;
+    try {
+        check_latency_bound();
+        check_target_adapts();
+        bench_mixer(seconds);
+    } catch(const std::exception &ex)
+    {
+        std::cerr << ex.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
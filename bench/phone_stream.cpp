@@ -0,0 +1,72 @@
+#include "phone_stream.h"
+
+buf_t build_stream(const std::vector<packet_ptr_t> &messages, tls_server_t *server)
+{
+    std::vector<std::vector<packet_ptr_t>> by_chan(AA_MAX_CHANNEL + 1);
+    for(const packet_ptr_t &cur : messages)
+        by_chan[cur->chan_].push_back(cur);
+
+    buf_t stream;
+    std::vector<size_t> next_msg(AA_MAX_CHANNEL + 1), offsets(AA_MAX_CHANNEL + 1);
+    bool more = true;
+    while(more)
+    {
+        more = false;
+        for(size_t chan = 0; chan <= AA_MAX_CHANNEL; ++chan)
+        {
+            if (next_msg[chan] == by_chan[chan].size())
+                continue;
+            more = true;
+            const packet_t &packet = *by_chan[chan][next_msg[chan]];
+            size_t offset = offsets[chan], total = packet.content_.size();
+            size_t len = std::min(total - offset, AA_MAX_FRAGMENT_SIZE);
+
+            buf_t payload(packet.content_.begin() + offset, packet.content_.begin() + offset + len);
+            if (server)
+                payload = server->encrypt(payload.data(), payload.size());
+            u_char flags = (offset == 0 ? AA_FIRST_FRAG : 0) |
+                           (offset + len == total ? AA_LAST_FRAG : 0) |
+                           (server ? AA_ENCRYPTED : 0);
+            stream.push_back(packet.chan_);
+            stream.push_back(flags);
+            stream.push_back(u_char(payload.size() >> 8));
+            stream.push_back(u_char(payload.size()));
+            if (offset == 0 && len != total) {
+                stream.push_back(u_char(total >> 24));
+                stream.push_back(u_char(total >> 16));
+                stream.push_back(u_char(total >> 8));
+                stream.push_back(u_char(total));
+            }
+            stream.insert(stream.end(), payload.begin(), payload.end());
+
+            offsets[chan] = offset + len;
+            if (offsets[chan] == total) {
+                offsets[chan] = 0;
+                next_msg[chan]++;
+            }
+        }
+    }
+    return stream;
+}
+
+std::vector<packet_ptr_t> make_messages(size_t bytes)
+{
+    static const u_char chans[] = {AA_VIDEO_CHANNEL, AA_AUDIO0_CHANNEL,
+                                   AA_TOUCHSCREEN_CHANNEL, AA_CONTROL_CHANNEL};
+    static const size_t sizes[] = {70000, 3840, 60, 20};
+    std::vector<packet_ptr_t> res;
+    uint32_t seed = 1;
+    for(size_t total = 0, f = 0; total < bytes; ++f)
+    {
+        size_t kind = f % 4;
+        // Vary the sizes, so the fragment boundaries fall everywhere
+        size_t size = sizes[kind] + (seed = seed * 1103515245 + 12345) % (sizes[kind] / 2 + 1);
+        packet_ptr_t packet = alloc_packet(chans[kind], false, false, size);
+        packet->content_.resize(size);
+        for(size_t g=0; g<size; ++g)
+            packet->content_[g] = u_char(f + g * 13);
+        res.push_back(packet);
+        total += size;
+    }
+    return res;
+}
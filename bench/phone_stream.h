@@ -0,0 +1,14 @@
+#ifndef AAUTO_PHONE_STREAM_H
+#define AAUTO_PHONE_STREAM_H
+
+#include "aa_helpers.h"
+#include "tls_peer.h"
+
+// A mix of video, audio, touch and control messages, about bytes in total
+std::vector<packet_ptr_t> make_messages(size_t bytes);
+// Frames the messages the way the phone does: fragments of at most
+// AA_MAX_FRAGMENT_SIZE, the channels taking turns fragment by fragment.
+// The fragments are encrypted by the server if it's set.
+buf_t build_stream(const std::vector<packet_ptr_t> &messages, tls_server_t *server);
+
+#endif //AAUTO_PHONE_STREAM_H
@@ -0,0 +1,140 @@
+#include "tls_peer.h"
+#include "scope_guard.h"
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+void make_identity(std::string &cert, std::string &pk)
+{
+    EVP_PKEY_CTX *key_ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, nullptr);
+    ON_BLOCK_EXIT([=]{EVP_PKEY_CTX_free(key_ctx);});
+    EVP_PKEY *key = nullptr;
+    if (!key_ctx || EVP_PKEY_keygen_init(key_ctx) != 1 ||
+            EVP_PKEY_CTX_set_rsa_keygen_bits(key_ctx, 2048) != 1 ||
+            EVP_PKEY_keygen(key_ctx, &key) != 1)
+        throw std::runtime_error("Can't generate the key");
+    ON_BLOCK_EXIT([=]{EVP_PKEY_free(key);});
+
+    X509 *x509 = X509_new();
+    if (!x509)
+        throw std::runtime_error("Can't create the certificate");
+    ON_BLOCK_EXIT([=]{X509_free(x509);});
+    X509_set_version(x509, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(x509), 1);
+    X509_gmtime_adj(X509_getm_notBefore(x509), 0);
+    X509_gmtime_adj(X509_getm_notAfter(x509), 24*3600);
+    X509_set_pubkey(x509, key);
+    X509_NAME *name = X509_get_subject_name(x509);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                               reinterpret_cast<const u_char*>("crypto_bench"), -1, -1, 0);
+    X509_set_issuer_name(x509, name);
+    if (X509_sign(x509, key, EVP_sha256()) == 0)
+        throw std::runtime_error("Can't sign the certificate");
+
+    auto to_pem = [](std::function<int(BIO*)> write) {
+        BIO *bio = BIO_new(BIO_s_mem());
+        ON_BLOCK_EXIT([=]{BIO_free(bio);});
+        if (!bio || write(bio) != 1)
+            throw std::runtime_error("Can't write PEM");
+        char *data;
+        long len = BIO_get_mem_data(bio, &data);
+        return std::string(data, size_t(len));
+    };
+    cert = to_pem([=](BIO *bio){return PEM_write_bio_X509(bio, x509);});
+    pk = to_pem([=](BIO *bio){
+        return PEM_write_bio_PrivateKey(bio, key, nullptr, nullptr, 0, nullptr, nullptr);
+    });
+}
+
+tls_server_t::tls_server_t(const std::string &cert, const std::string &pk)
+{
+    ctx_.reset(SSL_CTX_new(TLS_server_method()), [](SSL_CTX *c){SSL_CTX_free(c);});
+    if (!ctx_)
+        throw std::runtime_error("Can't create the server context");
+    BIO *cert_bio = BIO_new_mem_buf(cert.data(), safe_cast<int>(cert.size()));
+    ON_BLOCK_EXIT([=]{BIO_free(cert_bio);});
+    X509 *x509 = PEM_read_bio_X509(cert_bio, nullptr, nullptr, nullptr);
+    ON_BLOCK_EXIT([=]{X509_free(x509);});
+    BIO *pk_bio = BIO_new_mem_buf(pk.data(), safe_cast<int>(pk.size()));
+    ON_BLOCK_EXIT([=]{BIO_free(pk_bio);});
+    EVP_PKEY *key = PEM_read_bio_PrivateKey(pk_bio, nullptr, nullptr, nullptr);
+    ON_BLOCK_EXIT([=]{EVP_PKEY_free(key);});
+    if (SSL_CTX_use_certificate(ctx_.get(), x509) != 1 ||
+            SSL_CTX_use_PrivateKey(ctx_.get(), key) != 1)
+        throw std::runtime_error("Can't set up the server identity");
+
+    ssl_.reset(SSL_new(ctx_.get()), [](SSL *s){SSL_free(s);});
+    read_bio_ = BIO_new(BIO_s_mem());
+    write_bio_ = BIO_new(BIO_s_mem());
+    SSL_set_bio(ssl_.get(), read_bio_, write_bio_);
+    SSL_set_accept_state(ssl_.get());
+}
+
+buf_t tls_server_t::handshake(const buf_t &input)
+{
+    feed(input);
+    SSL_do_handshake(ssl_.get());
+    return drain();
+}
+
+bool tls_server_t::is_handshake_finished()
+{
+    return SSL_is_init_finished(ssl_.get()) != 0;
+}
+
+buf_t tls_server_t::encrypt(const u_char *data, size_t len)
+{
+    if (SSL_write(ssl_.get(), data, safe_cast<int>(len)) != int(len))
+        throw std::runtime_error("Server SSL_write failed");
+    return drain();
+}
+
+buf_t tls_server_t::decrypt(const buf_t &records)
+{
+    feed(records);
+    buf_t res;
+    u_char chunk[16384];
+    int len;
+    while((len = SSL_read(ssl_.get(), chunk, sizeof(chunk))) > 0)
+        res.insert(res.end(), chunk, chunk + len);
+    return res;
+}
+
+void tls_server_t::feed(const buf_t &input)
+{
+    if (!input.empty())
+        BIO_write(read_bio_, input.data(), safe_cast<int>(input.size()));
+}
+
+buf_t tls_server_t::drain()
+{
+    buf_t res(size_t(BIO_pending(write_bio_)));
+    if (!res.empty())
+        BIO_read(write_bio_, res.data(), safe_cast<int>(res.size()));
+    return res;
+}
+
+std::shared_ptr<crypto_context_t> connect_client(tls_server_t &server, const std::string &cert,
+                                                 const std::string &pk, bool direct)
+{
+    auto client = std::make_shared<crypto_context_t>(cert, pk, direct);
+    buf_t out = client->do_handshake(buf_t(), 0);
+    for(int f=0; f<10 && !client->is_handshake_finished(); ++f)
+        out = client->do_handshake(server.handshake(out), 0);
+    server.handshake(out);
+    if (!client->is_handshake_finished() || !server.is_handshake_finished())
+        throw std::runtime_error("The handshake didn't finish");
+
+    // Both directions must round-trip before anything is timed
+    static const u_char hello[] = "hello";
+    buf_t sealed;
+    client->encrypt_to(hello, sizeof(hello), sealed);
+    if (server.decrypt(sealed) != buf_t(hello, hello + sizeof(hello)))
+        throw std::runtime_error("The server can't read the client's records");
+    buf_t opened;
+    buf_t reply = server.encrypt(hello, sizeof(hello));
+    client->decrypt_to(reply.data(), reply.size(), opened);
+    if (opened != buf_t(hello, hello + sizeof(hello)))
+        throw std::runtime_error("The client can't read the server's records");
+    return client;
+}
@@ -0,0 +1,34 @@
+#ifndef AAUTO_TLS_PEER_H
+#define AAUTO_TLS_PEER_H
+
+#include "crypto.h"
+
+// The phone's side of the TLS session for the benchmarks, on memory BIOs
+class tls_server_t {
+    std::shared_ptr<SSL_CTX> ctx_;
+    std::shared_ptr<SSL> ssl_;
+    BIO *read_bio_, *write_bio_;
+public:
+    tls_server_t(const std::string &cert, const std::string &pk);
+
+    buf_t handshake(const buf_t &input);
+    bool is_handshake_finished();
+    // Returns the records of one message
+    buf_t encrypt(const u_char *data, size_t len);
+    // Returns whatever plaintext the records complete
+    buf_t decrypt(const buf_t &records);
+
+private:
+    void feed(const buf_t &input);
+    buf_t drain();
+};
+
+// A throwaway self-signed identity, so the benchmarks need no files
+void make_identity(std::string &cert, std::string &pk);
+
+// Runs the handshake between a new client context and the server and
+// checks that records go through in both directions
+std::shared_ptr<crypto_context_t> connect_client(tls_server_t &server, const std::string &cert,
+                                                 const std::string &pk, bool direct);
+
+#endif //AAUTO_TLS_PEER_H
@@ -0,0 +1,110 @@
+// Runs the USB reader against a fake phone on a USB 2.0 bulk pipe with 1,
+// 4 and 8 IN transfers in flight, and reports the throughput and how long
+// the pipe sat idle waiting for the reader to resubmit. Every run checks
+// that the messages arrive intact. A failed check ends the run with an
+// error.
+//
+// Usage: usb_bench [megabytes per run]
+
+#include "bench_utils.h"
+#include "fake_usb.h"
+#include "phone_stream.h"
+#include "usb_reader.h"
+#include <libusb.h>
+#include <iomanip>
+#include <iostream>
+
+// What a high-speed bulk pipe sustains, and a microframe of the host
+// controller
+static const double bus_mbps = 40;
+static const uint32_t idle_slot_usec = 125;
+// The same as transport_t's, a multiple of the 512-byte packets
+static const size_t transfer_size = 16384;
+static const uint8_t endpoint_in = 0x81;
+
+struct read_result_t {
+    double mbps_;
+    double idle_percent_;
+};
+
+static read_result_t read_stream(const std::vector<packet_ptr_t> &messages, const buf_t &stream,
+                                 size_t transfer_count)
+{
+    std::vector<std::vector<packet_ptr_t>> by_chan(AA_MAX_CHANNEL + 1);
+    for(const packet_ptr_t &cur : messages)
+        by_chan[cur->chan_].push_back(cur);
+    std::vector<size_t> next(AA_MAX_CHANNEL + 1);
+
+    fake_usb_device_t device(stream, bus_mbps, idle_slot_usec);
+    std::string error;
+    usb_reader_t reader(transfer_count, [&](const std::string &err) { error = err; });
+    frame_parser_t parser;
+
+    auto start = std::chrono::steady_clock::now();
+    reader.start(device.get_handle(), endpoint_in, transfer_size);
+    // The transfers can't be freed while the device has them
+    ON_BLOCK_EXIT([&]{
+        reader.cancel();
+        while(reader.get_in_flight() != 0)
+        {
+            timeval tv = {0, 100000};
+            libusb_handle_events_timeout_completed(device.get_context(), &tv, nullptr);
+        }
+        reader.free_transfers();
+    });
+    size_t received = 0;
+    while(received != messages.size())
+    {
+        size_t fed = reader.drain(parser), parsed = 0;
+        while(packet_ptr_t cur = parser.next_packet())
+        {
+            std::vector<packet_ptr_t> &expected = by_chan[cur->chan_];
+            check(next[cur->chan_] < expected.size(), "no extra messages");
+            check(cur->content_ == expected[next[cur->chan_]++]->content_,
+                  "the messages arrive intact");
+            parsed++;
+        }
+        received += parsed;
+        if (fed != 0 || parsed != 0)
+            continue;
+
+        // The phone keeps sending, so a second without data is a stall
+        timeval tv = {1, 0};
+        auto waited = std::chrono::steady_clock::now();
+        libusb_handle_events_timeout_completed(device.get_context(), &tv, nullptr);
+        if (!error.empty())
+            throw std::runtime_error(error);
+        check(std::chrono::steady_clock::now() - waited < std::chrono::seconds(1),
+              "the stream keeps coming");
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+
+    read_result_t res;
+    res.mbps_ = mbps(stream.size(), elapsed);
+    res.idle_percent_ = 100 * std::chrono::duration<double>(device.get_idle_time()).count() /
+                        std::chrono::duration<double>(elapsed).count();
+    return res;
+}
+
+int main(int argc, char **argv)
+{
+    size_t megabytes = argc > 1 ? size_t(std::stoul(argv[1])) : 32;
+    try {
+        std::vector<packet_ptr_t> messages = make_messages(megabytes * 1024 * 1024);
+        buf_t stream = build_stream(messages, nullptr);
+        std::cout << "Reading " << stream.size() / 1024 << "KB over a " << bus_mbps
+                  << " MB/s bulk pipe in " << transfer_size << "-byte transfers:" << std::endl;
+        for(size_t transfers : {1, 4, 8})
+        {
+            read_result_t res = read_stream(messages, stream, transfers);
+            std::cout << std::setw(4) << transfers << " in flight: " << std::fixed
+                      << std::setprecision(1) << res.mbps_ << " MB/s, the pipe idle "
+                      << res.idle_percent_ << "% of the time" << std::endl;
+        }
+    } catch(const std::exception &ex)
+    {
+        std::cerr << ex.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -3,3 +3,73 @@
 //
 
 #include "aa_helpers.h"
+
+packet_pool_t& packet_pool_t::instance()
+{
+    // Never destroyed, packets can outlive static destructors
+    static packet_pool_t *pool = new packet_pool_t();
+    return *pool;
+}
+
+packet_pool_t::~packet_pool_t()
+{
+    for(auto &cls : free_)
+        for(packet_t *p : cls)
+            delete p;
+}
+
+packet_ptr_t packet_pool_t::acquire(size_t hint)
+{
+    int cls = 0;
+    while(cls < size_classes_ && (min_class_size_ << cls) < hint)
+        cls++;
+
+    packet_t *res = nullptr;
+    {
+        std::lock_guard<std::mutex> l(mutex_);
+        for(int f=cls; f<size_classes_ && !res; ++f) {
+            if (!free_[f].empty()) {
+                res = free_[f].back();
+                free_[f].pop_back();
+            }
+        }
+        if (res)
+            stats_.reuses_++;
+        else
+            stats_.allocations_++;
+    }
+
+    if (!res) {
+        res = new packet_t();
+        // Round up to the class size, so the buffer is reusable
+        if (cls < size_classes_)
+            hint = min_class_size_ << cls;
+    }
+    res->content_.reserve(hint);
+    return packet_ptr_t(res);
+}
+
+void packet_pool_t::release(packet_t *p)
+{
+    p->content_.clear();
+    size_t capacity = p->content_.capacity();
+
+    int cls = 0;
+    while(cls+1 < size_classes_ && (min_class_size_ << (cls+1)) <= capacity)
+        cls++;
+
+    if (capacity <= (min_class_size_ << (size_classes_-1))) {
+        std::lock_guard<std::mutex> l(mutex_);
+        if (free_[cls].size() < max_free_per_class_) {
+            free_[cls].push_back(p);
+            return;
+        }
+    }
+    delete p;
+}
+
+packet_pool_stats_t packet_pool_t::get_stats()
+{
+    std::lock_guard<std::mutex> l(mutex_);
+    return stats_;
+}
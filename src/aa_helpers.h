@@ -6,6 +6,8 @@
 #define AAUTO_AA_HELPER_H
 
 #include "utils.h"
+#include "intrusive_ptr.h"
+#include <atomic>
 
 // The minimum size of the AA packet: channel + flags + 2 byte len + 2 byte msg type
 static const int AA_PACKET_HEADER_SIZE = 6;
@@ -14,13 +16,89 @@ static const int AA_PACKET_HEADER_SIZE = 6;
 // and some space just in case
 static const int MAX_AA_PACKET = 65536+8;
 
+// Outgoing messages larger than this are split into several fragments,
+// it's also the largest TLS record so each fragment is encrypted as one record
+static const size_t AA_MAX_FRAGMENT_SIZE = 16384;
+// Upper bound of the TLS record overhead added to an encrypted fragment
+static const size_t AA_MAX_RECORD_OVERHEAD = 256;
+// Spare capacity of the received packets. Decryption can briefly overshoot
+// the plaintext size by a record overhead, and the decoder appends its
+// input padding in place, so neither has to reallocate the content.
+static const size_t AA_PACKET_TAILROOM = AA_MAX_RECORD_OVERHEAD;
+
+// The media data messages start with the type and an 8 byte timestamp
+static const size_t AA_MEDIA_DATA_OFFSET = 2 + 8;
+
 struct packet_t
 {
     u_char chan_;
     bool encrypted_, control_;
     buf_t content_;
+
+    packet_t() : chan_(), encrypted_(), control_(), refs_(0) {}
+    packet_t(const packet_t &) = delete;
+    void operator = (const packet_t &) = delete;
+private:
+    friend void intrusive_add_ref(packet_t *p);
+    friend void intrusive_release(packet_t *p);
+    std::atomic<unsigned> refs_;
+};
+typedef intrusive_ptr_t<packet_t> packet_ptr_t;
+
+struct packet_pool_stats_t
+{
+    uint64_t allocations_, reuses_;
+};
+
+// Recycles packets together with their content buffers. Free packets are
+// kept in power-of-two size classes by the capacity of their buffer.
+class packet_pool_t
+{
+    static const size_t min_class_size_ = 64;
+    static const int size_classes_ = 15; // 64 bytes up to 1 MB
+    static const size_t max_free_per_class_ = 32;
+
+    std::mutex mutex_;
+    std::vector<packet_t*> free_[size_classes_];
+    packet_pool_stats_t stats_;
+public:
+    packet_pool_t() : stats_() {}
+    ~packet_pool_t();
+
+    static packet_pool_t& instance();
+
+    // Returns a blank packet with room for at least hint bytes of content
+    packet_ptr_t acquire(size_t hint);
+    void release(packet_t *p);
+    packet_pool_stats_t get_stats();
+};
+
+inline void intrusive_add_ref(packet_t *p)
+{
+    p->refs_.fetch_add(1, std::memory_order_relaxed);
+}
+
+inline void intrusive_release(packet_t *p)
+{
+    if (p->refs_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        packet_pool_t::instance().release(p);
+}
+
+inline packet_ptr_t alloc_packet(u_char chan, bool encrypted, bool control, size_t hint)
+{
+    packet_ptr_t res = packet_pool_t::instance().acquire(hint);
+    res->chan_ = chan;
+    res->encrypted_ = encrypted;
+    res->control_ = control;
+    return res;
+}
+
+enum aa_packet_flags {
+    AA_ENCRYPTED = 0b1000,
+    AA_LAST_FRAG = 0b0010,
+    AA_FIRST_FRAG = 0b0001,
+    AA_CONTROL_FLAG = 0b0100,
 };
-typedef std::shared_ptr<packet_t> packet_ptr_t;
 
 enum aa_message_types {
     AA_RE
@@ -37,6 +115,7 @@ enum aa_channels {
     AA_MIC_CHANNEL = 7,
     AA_MAX_CHANNEL = 7,
 };
+static const int AA_AUDIO_CHANNEL_COUNT = AA_AUDIO2_CHANNEL - AA_AUDIO0_CHANNEL + 1;
 
 enum aa_message_type {
     AA_VERSION_REQ = 1,
@@ -52,12 +131,20 @@ enum aa_message_type {
 
     AA_NAV_FOCUS_REQUEST = 13,
     AA_NAV_FOCUS_NOTIFY = 14,
+    AA_AUDIO_FOCUS_REQUEST = 18,
+    AA_AUDIO_FOCUS_NOTIFY = 19,
 
     AA_MEDIA_SETUP = 0x8000,
     AA_MEDIA_START_REQUEST = 0x8001,
     AA_SENSOR_START = 0x8002,
+    // Shares the type with the sensor start, on the media channels
+    AA_MEDIA_STOP_REQUEST = 0x8002,
     AA_SENSOR_DATA = 0x8003,
+    // The reply to the media setup shares the type with the sensor data
+    AA_MEDIA_CONFIG = 0x8003,
     AA_VID_ACK = 0x8004,
+    AA_MIC_REQUEST = 0x8005,
+    AA_MIC_RESPONSE = 0x8006,
     AA_VIDEO_FOCUS_GAINED = 0x8008,
 
     AA_MEDIA_DATA = 0,
@@ -69,18 +156,19 @@ enum aa_message_type {
 enum aa_input_actions {
     AA_INPUT_ACTION_MOUSEUP = 1,
     AA_INPUT_ACTION_MOUSEDOWN = 0,
-    AA_INPUT_ACTION_CANCEL = 1,
+    // The gesture is aborted, like Android's ACTION_CANCEL
+    AA_INPUT_ACTION_CANCEL = 3,
     AA_INPUT_ACTION_MOVE = 2,
+    // A pointer other than the first one goes down or up
+    AA_INPUT_ACTION_POINTER_DOWN = 5,
+    AA_INPUT_ACTION_POINTER_UP = 6,
 };
 
 
 inline packet_ptr_t make_packet_common(u_char chan, uint16_t msg_type, bool encrypted,
                                        size_t hint = 0) {
-    packet_ptr_t res(new packet_t());
-    res->chan_ = chan;
-    res->encrypted_ = encrypted;
-    res->control_ = msg_type <= 0xFF && chan != AA_CONTROL_CHANNEL;
-    res->content_.reserve(hint+4);
+    packet_ptr_t res = alloc_packet(chan, encrypted,
+                                    msg_type <= 0xFF && chan != AA_CONTROL_CHANNEL, hint+4);
     res->content_.push_back(safe_cast<u_char>(msg_type / 256));
     res->content_.push_back(safe_cast<u_char>(msg_type % 256));
     return res;
@@ -144,7 +232,7 @@ inline std::string lookup_name(uint16_t id, bool control_channel=true)
         case 0x8002: return "Sensor_Start_Request";
         case 0x8004: return "Codec/Media_Data_Ack";
         case 0x8005: return "Mic_Start/Stop_Request";
-        case 0x8006: return "k3_6_?";
+        case 0x8006: return "Mic_Start/Stop_Response";
         case 0x8007: return "Media_Video_?_Request";
         case 0x8008: return "Video_Focus_Notification";
         case 0xFFFF: return "Framing_Error_Notification";
@@ -165,21 +253,43 @@ inline std::string desc(const packet_ptr_t &pack)
     return p;
 }
 
+// The longest varint, a 64-bit value takes 10 bytes
+static const size_t AA_MAX_VARINT_SIZE = 10;
+
+// Writes the value as a base-128 varint, returns the number of bytes
+inline size_t encode_varint(uint64_t val, u_char *out)
+{
+    size_t len = 0;
+    while(val >= 0x80) {
+        out[len++] = u_char(val) | 0x80;
+        val >>= 7;
+    }
+    out[len++] = u_char(val);
+    return len;
+}
+
+inline size_t varint_size(uint64_t val)
+{
+    size_t len = 1;
+    while(val >= 0x80) {
+        val >>= 7;
+        len++;
+    }
+    return len;
+}
+
 inline void encode_varint_to(int64_t val, buf_t &target)
 {
     if (val >= 0x7fffffffffffffffL)
         throw std::out_of_range("Value is too big");
 
-    uint64_t left = val;
-
-    for(int idx2=0; idx2<9; ++idx2) {
-        target.push_back((u_char)(0x7f & left));
-        left >>= 7;
-        if (left == 0)
-            return;
-        if (idx2 < 9 - 1)
-            target.back() |= 0x80;
+    if (uint64_t(val) < 0x80) {
+        target.push_back(u_char(val));
+        return;
     }
+    u_char tmp[AA_MAX_VARINT_SIZE];
+    size_t len = encode_varint(uint64_t(val), tmp);
+    target.insert(target.end(), tmp, tmp + len);
 }
 
 #endif //AAUTO_AA_HELPER_H
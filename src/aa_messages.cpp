@@ -0,0 +1,127 @@
+#include "aa_messages.h"
+
+channel_open_request_t parse_channel_open_request(const packet_t &packet)
+{
+    channel_open_request_t res = channel_open_request_t();
+    wire_reader_t reader(packet);
+    while(reader.next())
+    {
+        switch(reader.key())
+        {
+            case channel_open_request_msg_t::priority::key_:
+                res.priority_ = int32_t(reader.varint());
+                break;
+            case channel_open_request_msg_t::service_id::key_:
+                res.service_id_ = uint32_t(reader.varint());
+                break;
+            default:
+                reader.skip();
+        }
+    }
+    return res;
+}
+
+media_setup_request_t parse_media_setup_request(const packet_t &packet)
+{
+    media_setup_request_t res = media_setup_request_t();
+    wire_reader_t reader(packet);
+    while(reader.next())
+    {
+        if (reader.key() == media_setup_request_msg_t::codec_type::key_)
+            res.codec_type_ = uint32_t(reader.varint());
+        else
+            reader.skip();
+    }
+    return res;
+}
+
+media_start_request_t parse_media_start_request(const packet_t &packet)
+{
+    media_start_request_t res = media_start_request_t();
+    wire_reader_t reader(packet);
+    while(reader.next())
+    {
+        switch(reader.key())
+        {
+            case media_start_request_msg_t::session::key_:
+                res.session_ = uint32_t(reader.varint());
+                break;
+            case media_start_request_msg_t::config_index::key_:
+                res.config_index_ = uint32_t(reader.varint());
+                break;
+            default:
+                reader.skip();
+        }
+    }
+    return res;
+}
+
+media_ack_t parse_media_ack(const packet_t &packet)
+{
+    media_ack_t res = media_ack_t();
+    wire_reader_t reader(packet);
+    while(reader.next())
+    {
+        switch(reader.key())
+        {
+            case media_ack_msg_t::session::key_:
+                res.session_ = uint32_t(reader.varint());
+                break;
+            case media_ack_msg_t::ack_count::key_:
+                res.ack_count_ = uint32_t(reader.varint());
+                break;
+            default:
+                reader.skip();
+        }
+    }
+    return res;
+}
+
+mic_request_t parse_mic_request(const packet_t &packet)
+{
+    mic_request_t res = mic_request_t();
+    wire_reader_t reader(packet);
+    while(reader.next())
+    {
+        switch(reader.key())
+        {
+            case mic_request_msg_t::open::key_:
+                res.open_ = reader.boolean();
+                break;
+            case mic_request_msg_t::max_unacked::key_:
+                res.max_unacked_ = uint32_t(reader.varint());
+                break;
+            default:
+                reader.skip();
+        }
+    }
+    return res;
+}
+
+audio_focus_request_t parse_audio_focus_request(const packet_t &packet)
+{
+    audio_focus_request_t res = audio_focus_request_t();
+    wire_reader_t reader(packet);
+    while(reader.next())
+    {
+        if (reader.key() == audio_focus_msg_t::focus_type::key_)
+            res.focus_type_ = uint32_t(reader.varint());
+        else
+            reader.skip();
+    }
+    return res;
+}
+
+nav_focus_request_t parse_nav_focus_request(const packet_t &packet)
+{
+    nav_focus_request_t res = nav_focus_request_t();
+    wire_reader_t reader(packet);
+    while(reader.next())
+    {
+        if (reader.key() == nav_focus_msg_t::focus_type::key_)
+            res.focus_type_ = uint32_t(reader.varint());
+        else
+            reader.skip();
+    }
+    return res;
+}
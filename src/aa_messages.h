@@ -0,0 +1,224 @@
+#ifndef AAUTO_AA_MESSAGES_H
+#define AAUTO_AA_MESSAGES_H
+
+#include "wire.h"
+
+// Field layouts of the AA messages we build or parse
+
+struct discovery_response_msg_t {
+    typedef wire_field_t<1, WIRE_BYTES> service;
+    typedef wire_field_t<2, WIRE_BYTES> car_make;
+    typedef wire_field_t<3, WIRE_BYTES> car_model;
+    typedef wire_field_t<4, WIRE_BYTES> car_year;
+    typedef wire_field_t<5, WIRE_BYTES> car_serial;
+    typedef wire_field_t<6, WIRE_VARINT> driver_position;
+    typedef wire_field_t<7, WIRE_BYTES> hu_make;
+    typedef wire_field_t<8, WIRE_BYTES> hu_model;
+    typedef wire_field_t<9, WIRE_BYTES> hu_build;
+    typedef wire_field_t<10, WIRE_BYTES> hu_version;
+    typedef wire_field_t<11, WIRE_VARINT> native_media_during_vr;
+    typedef wire_field_t<12, WIRE_VARINT> hide_clock;
+};
+
+struct service_msg_t {
+    typedef wire_field_t<1, WIRE_VARINT> id;
+    typedef wire_field_t<2, WIRE_BYTES> sensor_source;
+    typedef wire_field_t<3, WIRE_BYTES> media_sink;
+    typedef wire_field_t<4, WIRE_BYTES> input_source;
+    typedef wire_field_t<5, WIRE_BYTES> media_source;
+};
+
+struct sensor_source_msg_t {
+    typedef wire_field_t<1, WIRE_BYTES> sensor;
+    // Inside the sensor
+    typedef wire_field_t<1, WIRE_VARINT> sensor_type;
+};
+
+enum aa_sensor_type_t {
+    AA_SENSOR_TYPE_GEAR = 7,
+    AA_SENSOR_TYPE_DRIVING_STATUS = 11,
+};
+
+struct media_sink_msg_t {
+    typedef wire_field_t<1, WIRE_VARINT> codec_type;
+    typedef wire_field_t<2, WIRE_VARINT> audio_type;
+    typedef wire_field_t<3, WIRE_BYTES> audio_config;
+    typedef wire_field_t<4, WIRE_BYTES> video_config;
+};
+
+enum aa_codec_type_t {
+    AA_CODEC_AUDIO_PCM = 1,
+    AA_CODEC_VIDEO_H264 = 3,
+};
+
+enum aa_audio_type_t {
+    AA_AUDIO_TYPE_SPEECH = 1, // Navigation guidance and the assistant
+    AA_AUDIO_TYPE_SYSTEM = 2,
+    AA_AUDIO_TYPE_MEDIA = 3,
+};
+
+struct audio_config_msg_t {
+    typedef wire_field_t<1, WIRE_VARINT> sample_rate;
+    typedef wire_field_t<2, WIRE_VARINT> bits;
+    typedef wire_field_t<3, WIRE_VARINT> channels;
+};
+
+// The microphone
+struct media_source_msg_t {
+    typedef wire_field_t<1, WIRE_VARINT> codec_type;
+    typedef wire_field_t<2, WIRE_BYTES> audio_config;
+};
+
+struct video_config_msg_t {
+    typedef wire_field_t<1, WIRE_VARINT> resolution;
+    typedef wire_field_t<2, WIRE_VARINT> frame_rate;
+    typedef wire_field_t<3, WIRE_VARINT> width_margin;
+    typedef wire_field_t<4, WIRE_VARINT> height_margin;
+    typedef wire_field_t<5, WIRE_VARINT> dpi;
+};
+
+enum aa_video_resolution_t {
+    AA_VIDEO_800x480 = 1,
+    // Higher resolutions don't seem to work as of June 10, 2015 release of AA
+    AA_VIDEO_1280x720 = 2,
+    AA_VIDEO_1920x1080 = 3,
+};
+
+enum aa_video_fps_t {
+    AA_VIDEO_FPS_30 = 1,
+    // Makes little difference
+    AA_VIDEO_FPS_60 = 2,
+};
+
+struct input_source_msg_t {
+    typedef wire_field_t<2, WIRE_BYTES> touchscreen;
+    // Inside the touchscreen
+    typedef wire_field_t<1, WIRE_VARINT> width;
+    typedef wire_field_t<2, WIRE_VARINT> height;
+};
+
+struct touch_event_msg_t {
+    typedef wire_field_t<1, WIRE_VARINT> timestamp_ns;
+    typedef wire_field_t<3, WIRE_BYTES> touch;
+    // Inside the touch
+    typedef wire_field_t<1, WIRE_BYTES> pointer;
+    typedef wire_field_t<2, WIRE_VARINT> action_index;
+    typedef wire_field_t<3, WIRE_VARINT> action;
+    // Inside the pointer
+    typedef wire_field_t<1, WIRE_VARINT> x;
+    typedef wire_field_t<2, WIRE_VARINT> y;
+    typedef wire_field_t<3, WIRE_VARINT> pointer_id;
+};
+
+struct channel_open_request_msg_t {
+    typedef wire_field_t<1, WIRE_VARINT> priority;
+    typedef wire_field_t<2, WIRE_VARINT> service_id;
+};
+
+struct media_setup_request_msg_t {
+    typedef wire_field_t<1, WIRE_VARINT> codec_type;
+};
+
+struct media_start_request_msg_t {
+    typedef wire_field_t<1, WIRE_VARINT> session;
+    typedef wire_field_t<2, WIRE_VARINT> config_index;
+};
+
+struct media_config_msg_t {
+    typedef wire_field_t<1, WIRE_VARINT> status;
+    // The phone stops sending once this many frames are waiting for an ack
+    typedef wire_field_t<2, WIRE_VARINT> max_unacked;
+    typedef wire_field_t<3, WIRE_VARINT> config_index;
+};
+
+enum aa_media_config_status_t {
+    AA_MEDIA_CONFIG_READY = 2,
+};
+
+struct media_ack_msg_t {
+    typedef wire_field_t<1, WIRE_VARINT> session;
+    typedef wire_field_t<2, WIRE_VARINT> ack_count;
+};
+
+struct mic_request_msg_t {
+    typedef wire_field_t<1, WIRE_VARINT> open;
+    typedef wire_field_t<2, WIRE_VARINT> anc_enabled;
+    typedef wire_field_t<3, WIRE_VARINT> ec_enabled;
+    // The phone acks the chunks, no more than this many may be unacked
+    typedef wire_field_t<4, WIRE_VARINT> max_unacked;
+};
+
+struct mic_response_msg_t {
+    typedef wire_field_t<1, WIRE_VARINT> session;
+    // Zero if the microphone is open
+    typedef wire_field_t<2, WIRE_VARINT> status;
+};
+
+struct nav_focus_msg_t {
+    typedef wire_field_t<1, WIRE_VARINT> focus_type;
+};
+
+struct audio_focus_msg_t {
+    typedef wire_field_t<1, WIRE_VARINT> focus_type;
+};
+
+enum aa_audio_focus_request_t {
+    AA_AUDIO_FOCUS_REQUEST_GAIN = 1,
+    AA_AUDIO_FOCUS_REQUEST_GAIN_TRANSIENT = 2,
+    AA_AUDIO_FOCUS_REQUEST_GAIN_NAVI = 3,
+    AA_AUDIO_FOCUS_REQUEST_RELEASE = 4,
+};
+
+enum aa_audio_focus_state_t {
+    AA_AUDIO_FOCUS_STATE_GAIN = 1,
+    AA_AUDIO_FOCUS_STATE_GAIN_TRANSIENT = 2,
+    AA_AUDIO_FOCUS_STATE_LOSS = 3,
+};
+
+enum aa_nav_focus_t {
+    AA_NAV_FOCUS_NATIVE = 1,
+    AA_NAV_FOCUS_PROJECTED = 2,
+};
+
+// The incoming messages, parsed straight from the packet content
+
+struct channel_open_request_t {
+    int32_t priority_;
+    uint32_t service_id_;
+};
+channel_open_request_t parse_channel_open_request(const packet_t &packet);
+
+struct media_setup_request_t {
+    uint32_t codec_type_;
+};
+media_setup_request_t parse_media_setup_request(const packet_t &packet);
+
+struct media_start_request_t {
+    uint32_t session_;
+    uint32_t config_index_;
+};
+media_start_request_t parse_media_start_request(const packet_t &packet);
+
+struct media_ack_t {
+    uint32_t session_;
+    uint32_t ack_count_;
+};
+media_ack_t parse_media_ack(const packet_t &packet);
+
+struct mic_request_t {
+    bool open_;
+    uint32_t max_unacked_;
+};
+mic_request_t parse_mic_request(const packet_t &packet);
+
+struct audio_focus_request_t {
+    uint32_t focus_type_;
+};
+audio_focus_request_t parse_audio_focus_request(const packet_t &packet);
+
+struct nav_focus_request_t {
+    uint32_t focus_type_;
+};
+nav_focus_request_t parse_nav_focus_request(const packet_t &packet);
+
+#endif //AAUTO_AA_MESSAGES_H
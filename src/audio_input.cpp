@@ -0,0 +1,37 @@
+#include "audio_input.h"
+#include <fstream>
+
+file_audio_input_t::file_audio_input_t(const audio_format_t &format, capture_t capture,
+                                       const std::string &path) :
+        capture_(capture), pos_(), period_(format.bytes_for_millis(period_millis_)),
+        worker_(period_millis_, [this]{ capture_period(); })
+{
+    if (!path.empty()) {
+        std::ifstream in(path.c_str(), std::ios::binary);
+        pcm_.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        pcm_.resize(pcm_.size() - pcm_.size() % format.frame_bytes());
+        if (pcm_.empty()) {
+            str_out_t p;
+            p << "Can't read the microphone audio from " << path;
+            throw std::runtime_error(p);
+        }
+    }
+}
+
+// A period is ready once it has been "recorded"
+void file_audio_input_t::capture_period()
+{
+    if (pcm_.empty()) {
+        memset(period_.data(), 0, period_.size());
+        capture_(period_.data(), period_.size());
+        return;
+    }
+    for(size_t done = 0; done < period_.size(); )
+    {
+        size_t chunk = std::min(period_.size() - done, pcm_.size() - pos_);
+        memcpy(period_.data() + done, pcm_.data() + pos_, chunk);
+        done += chunk;
+        pos_ = (pos_ + chunk) % pcm_.size();
+    }
+    capture_(period_.data(), period_.size());
+}
@@ -0,0 +1,47 @@
+#ifndef AAUTO_AUDIO_INPUT_H
+#define AAUTO_AUDIO_INPUT_H
+
+#include "audio_output.h"
+
+// Where the microphone audio comes from. While started, the input calls the
+// capture callback from its own thread with whole frames, as soon as they
+// are captured.
+class audio_input_t {
+public:
+    typedef std::function<void(const u_char *data, size_t len)> capture_t;
+
+    virtual ~audio_input_t() {}
+    virtual void start() = 0;
+    // The capture callback isn't running anymore once this returns
+    virtual void stop() = 0;
+};
+
+typedef std::shared_ptr<audio_input_t> audio_input_ptr_t;
+typedef std::function<audio_input_ptr_t(const audio_format_t &format,
+                                        audio_input_t::capture_t capture)> audio_input_factory_t;
+
+// Stands in for the microphone, for the tests and the headless sessions.
+// Plays raw PCM from a file in the input's format at the capture pace, over
+// and over, or silence if there's no file.
+class file_audio_input_t : public audio_input_t {
+    capture_t capture_;
+    buf_t pcm_;
+    size_t pos_;
+    buf_t period_;
+    // Last, it calls capture_
+    paced_worker_t worker_;
+
+    static const uint32_t period_millis_ = 5;
+public:
+    // Throws if the file can't be read
+    file_audio_input_t(const audio_format_t &format, capture_t capture,
+                       const std::string &path);
+
+    void start() override { worker_.start(); }
+    void stop() override { worker_.stop(); }
+
+private:
+    void capture_period();
+};
+
+#endif //AAUTO_AUDIO_INPUT_H
@@ -0,0 +1,273 @@
+#include "audio_kernels.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define AUDIO_KERNELS_X86
+#include <immintrin.h>
+#endif
+
+// All the versions compute exactly the same thing, so their output can be
+// compared bit for bit:
+//  mix: acc + ((src * gain + 0x4000) >> 15), saturated to 16 bits
+//  resample: (a * (0x4000 - f) + b * f + 0x2000) >> 14, where f is the
+//  fraction of the position between the frames a and b, in 14 bits
+
+static inline int16_t saturate16(int32_t val)
+{
+    if (val > INT16_MAX)
+        return INT16_MAX;
+    if (val < INT16_MIN)
+        return INT16_MIN;
+    return int16_t(val);
+}
+
+static inline int32_t clamp_gain(int32_t gain)
+{
+    return gain < 0 ? 0 : gain > AUDIO_UNITY_GAIN ? AUDIO_UNITY_GAIN : gain;
+}
+
+static void mix_scalar(int16_t *acc, const int16_t *src, size_t samples, int32_t gain)
+{
+    gain = clamp_gain(gain);
+    for(size_t f = 0; f < samples; ++f)
+        acc[f] = saturate16(acc[f] + ((src[f] * gain + 0x4000) >> 15));
+}
+
+static inline int16_t interpolate(int32_t a, int32_t b, uint32_t pos)
+{
+    int32_t f = int32_t((pos & 0xffff) >> 2);
+    return int16_t((a * (0x4000 - f) + b * f + 0x2000) >> 14);
+}
+
+static void resample_tail(const int16_t *in, uint32_t in_channels, int16_t *out,
+                          size_t from, size_t frames, uint32_t phase, uint32_t step)
+{
+    for(size_t f = from; f < frames; ++f)
+    {
+        uint32_t pos = phase + uint32_t(f) * step;
+        const int16_t *cur = in + (pos >> 16) * in_channels;
+        if (in_channels == 1) {
+            out[f * 2] = out[f * 2 + 1] = interpolate(cur[0], cur[1], pos);
+        } else {
+            out[f * 2] = interpolate(cur[0], cur[2], pos);
+            out[f * 2 + 1] = interpolate(cur[1], cur[3], pos);
+        }
+    }
+}
+
+static void resample_scalar(const int16_t *in, uint32_t in_channels, int16_t *out,
+                            size_t frames, uint32_t phase, uint32_t step)
+{
+    resample_tail(in, in_channels, out, 0, frames, phase, step);
+}
+
+static const audio_kernels_t scalar_kernels = {"scalar", &mix_scalar, &resample_scalar};
+
+#ifdef AUDIO_KERNELS_X86
+
+static inline uint32_t load_pair(const int16_t *at)
+{
+    uint32_t res;
+    memcpy(&res, at, sizeof(res));
+    return res;
+}
+
+// The 32-bit lanes of the weights are (0x4000 - f, f) pairs, for madd
+// against the (a, b) pairs of samples
+__attribute__((target("sse2")))
+static inline __m128i weights_sse2(__m128i pos)
+{
+    __m128i f = _mm_srli_epi32(_mm_and_si128(pos, _mm_set1_epi32(0xffff)), 2);
+    return _mm_or_si128(_mm_slli_epi32(f, 16), _mm_sub_epi32(_mm_set1_epi32(0x4000), f));
+}
+
+__attribute__((target("sse2")))
+static inline __m128i interpolate_sse2(__m128i pairs, __m128i weights)
+{
+    __m128i res = _mm_add_epi32(_mm_madd_epi16(pairs, weights), _mm_set1_epi32(0x2000));
+    return _mm_srai_epi32(res, 14);
+}
+
+__attribute__((target("sse2")))
+static void mix_sse2(int16_t *acc, const int16_t *src, size_t samples, int32_t gain)
+{
+    size_t f = 0;
+    if (gain >= AUDIO_UNITY_GAIN) {
+        for(; f + 8 <= samples; f += 8)
+        {
+            __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(acc + f));
+            __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + f));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(acc + f), _mm_adds_epi16(a, s));
+        }
+    } else {
+        // (sample, 1) pairs times (gain, rounding) pairs
+        __m128i one = _mm_set1_epi16(1);
+        __m128i g = _mm_set1_epi32(int32_t(0x4000u << 16 | uint16_t(clamp_gain(gain))));
+        for(; f + 8 <= samples; f += 8)
+        {
+            __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(acc + f));
+            __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + f));
+            __m128i lo = _mm_srai_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(s, one), g), 15);
+            __m128i hi = _mm_srai_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(s, one), g), 15);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(acc + f),
+                             _mm_adds_epi16(a, _mm_packs_epi32(lo, hi)));
+        }
+    }
+    mix_scalar(acc + f, src + f, samples - f, gain);
+}
+
+__attribute__((target("sse2")))
+static void resample_sse2(const int16_t *in, uint32_t in_channels, int16_t *out,
+                          size_t frames, uint32_t phase, uint32_t step)
+{
+    size_t f = 0;
+    // No 32-bit multiply in SSE2, the positions are stepped instead
+    __m128i pos = _mm_set_epi32(int32_t(phase + 3 * step), int32_t(phase + 2 * step),
+                                int32_t(phase + step), int32_t(phase));
+    __m128i pos_step = _mm_set1_epi32(int32_t(4 * step));
+    uint32_t idx[4];
+
+    for(; f + 4 <= frames; f += 4, pos = _mm_add_epi32(pos, pos_step))
+    {
+        __m128i w = weights_sse2(pos);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(idx), _mm_srli_epi32(pos, 16));
+        __m128i res;
+        if (in_channels == 1) {
+            // A 32-bit load at the frame gets both samples to interpolate
+            __m128i pairs = _mm_set_epi32(int32_t(load_pair(in + idx[3])), int32_t(load_pair(in + idx[2])),
+                                          int32_t(load_pair(in + idx[1])), int32_t(load_pair(in + idx[0])));
+            __m128i mono = interpolate_sse2(pairs, w);
+            mono = _mm_packs_epi32(mono, mono);
+            res = _mm_unpacklo_epi16(mono, mono);
+        } else {
+            // (La, Ra, Lb, Rb) of two frames, reordered into (La, Lb, Ra, Rb)
+            __m128i lo = _mm_unpacklo_epi64(
+                    _mm_loadl_epi64(reinterpret_cast<const __m128i*>(in + idx[0] * 2)),
+                    _mm_loadl_epi64(reinterpret_cast<const __m128i*>(in + idx[1] * 2)));
+            __m128i hi = _mm_unpacklo_epi64(
+                    _mm_loadl_epi64(reinterpret_cast<const __m128i*>(in + idx[2] * 2)),
+                    _mm_loadl_epi64(reinterpret_cast<const __m128i*>(in + idx[3] * 2)));
+            lo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, 0xd8), 0xd8);
+            hi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, 0xd8), 0xd8);
+            res = _mm_packs_epi32(interpolate_sse2(lo, _mm_unpacklo_epi32(w, w)),
+                                  interpolate_sse2(hi, _mm_unpackhi_epi32(w, w)));
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + f * 2), res);
+    }
+    resample_tail(in, in_channels, out, f, frames, phase, step);
+}
+
+static const audio_kernels_t sse2_kernels = {"sse2", &mix_sse2, &resample_sse2};
+
+__attribute__((target("avx2")))
+static inline __m256i weights_avx2(__m256i pos)
+{
+    __m256i f = _mm256_srli_epi32(_mm256_and_si256(pos, _mm256_set1_epi32(0xffff)), 2);
+    return _mm256_or_si256(_mm256_slli_epi32(f, 16),
+                           _mm256_sub_epi32(_mm256_set1_epi32(0x4000), f));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i interpolate_avx2(__m256i pairs, __m256i weights)
+{
+    __m256i res = _mm256_add_epi32(_mm256_madd_epi16(pairs, weights), _mm256_set1_epi32(0x2000));
+    return _mm256_srai_epi32(res, 14);
+}
+
+__attribute__((target("avx2")))
+static void mix_avx2(int16_t *acc, const int16_t *src, size_t samples, int32_t gain)
+{
+    size_t f = 0;
+    if (gain >= AUDIO_UNITY_GAIN) {
+        for(; f + 16 <= samples; f += 16)
+        {
+            __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(acc + f));
+            __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + f));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(acc + f), _mm256_adds_epi16(a, s));
+        }
+    } else {
+        // The unpacks and the pack work within the 128-bit lanes, so the
+        // order of the samples is preserved
+        __m256i one = _mm256_set1_epi16(1);
+        __m256i g = _mm256_set1_epi32(int32_t(0x4000u << 16 | uint16_t(clamp_gain(gain))));
+        for(; f + 16 <= samples; f += 16)
+        {
+            __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(acc + f));
+            __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + f));
+            __m256i lo = _mm256_srai_epi32(_mm256_madd_epi16(_mm256_unpacklo_epi16(s, one), g), 15);
+            __m256i hi = _mm256_srai_epi32(_mm256_madd_epi16(_mm256_unpackhi_epi16(s, one), g), 15);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(acc + f),
+                                _mm256_adds_epi16(a, _mm256_packs_epi32(lo, hi)));
+        }
+    }
+    mix_sse2(acc + f, src + f, samples - f, gain);
+}
+
+__attribute__((target("avx2")))
+static void resample_avx2(const int16_t *in, uint32_t in_channels, int16_t *out,
+                          size_t frames, uint32_t phase, uint32_t step)
+{
+    size_t f = 0;
+    __m256i pos = _mm256_add_epi32(_mm256_set1_epi32(int32_t(phase)),
+                                   _mm256_mullo_epi32(_mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0),
+                                                      _mm256_set1_epi32(int32_t(step))));
+    __m256i pos_step = _mm256_set1_epi32(int32_t(8 * step));
+
+    for(; f + 8 <= frames; f += 8, pos = _mm256_add_epi32(pos, pos_step))
+    {
+        __m256i w = weights_avx2(pos);
+        __m256i idx = _mm256_srli_epi32(pos, 16);
+        __m256i res;
+        if (in_channels == 1) {
+            // Gathering 32 bits at each frame gets both samples to interpolate
+            __m256i pairs = _mm256_i32gather_epi32(reinterpret_cast<const int*>(in), idx, 2);
+            __m256i mono = interpolate_avx2(pairs, w);
+            mono = _mm256_packs_epi32(mono, mono);
+            res = _mm256_unpacklo_epi16(mono, mono);
+        } else {
+            // (La, Ra, Lb, Rb) of four frames, reordered into (La, Lb, Ra, Rb)
+            const long long *base = reinterpret_cast<const long long*>(in);
+            __m256i lo = _mm256_i32gather_epi64(base, _mm256_castsi256_si128(idx), 4);
+            __m256i hi = _mm256_i32gather_epi64(base, _mm256_extracti128_si256(idx, 1), 4);
+            lo = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(lo, 0xd8), 0xd8);
+            hi = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(hi, 0xd8), 0xd8);
+            // Both channels of a frame share its weights
+            __m256i w_lo = _mm256_permutevar8x32_epi32(w, _mm256_set_epi32(3, 3, 2, 2, 1, 1, 0, 0));
+            __m256i w_hi = _mm256_permutevar8x32_epi32(w, _mm256_set_epi32(7, 7, 6, 6, 5, 5, 4, 4));
+            res = _mm256_packs_epi32(interpolate_avx2(lo, w_lo), interpolate_avx2(hi, w_hi));
+            // The pack interleaves the 128-bit lanes of its arguments
+            res = _mm256_permute4x64_epi64(res, 0xd8);
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + f * 2), res);
+    }
+    resample_tail(in, in_channels, out, f, frames, phase, step);
+}
+
+static const audio_kernels_t avx2_kernels = {"avx2", &mix_avx2, &resample_avx2};
+
+#endif //AUDIO_KERNELS_X86
+
+const audio_kernels_t &scalar_audio_kernels()
+{
+    return scalar_kernels;
+}
+
+std::vector<const audio_kernels_t*> supported_audio_kernels()
+{
+    std::vector<const audio_kernels_t*> res;
+    res.push_back(&scalar_kernels);
+#ifdef AUDIO_KERNELS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        res.push_back(&sse2_kernels);
+    if (__builtin_cpu_supports("sse2") && __builtin_cpu_supports("avx2"))
+        res.push_back(&avx2_kernels);
+#endif
+    return res;
+}
+
+const audio_kernels_t &best_audio_kernels()
+{
+    static const audio_kernels_t *best = supported_audio_kernels().back();
+    return *best;
+}
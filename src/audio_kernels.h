@@ -0,0 +1,32 @@
+#ifndef AAUTO_AUDIO_KERNELS_H
+#define AAUTO_AUDIO_KERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// Gains are Q15 fixed point, AUDIO_UNITY_GAIN passes the samples unchanged
+static const int32_t AUDIO_UNITY_GAIN = 0x8000;
+
+// The inner loops of the mixer over signed 16-bit PCM. There's a portable
+// scalar version of each, and SSE2/AVX2 versions on x86 picked at runtime.
+struct audio_kernels_t {
+    const char *name_;
+
+    // acc[i] = saturate(acc[i] + src[i] * gain)
+    void (*mix_)(int16_t *acc, const int16_t *src, size_t samples, int32_t gain);
+
+    // Linear interpolation into interleaved stereo. Output frame i is taken
+    // at the input position phase + i*step, in 16.16 fixed point. The input
+    // has in_channels interleaved channels, mono is duplicated into both
+    // outputs. The input must extend one frame past the last position.
+    void (*resample_)(const int16_t *in, uint32_t in_channels, int16_t *out, size_t frames,
+                      uint32_t phase, uint32_t step);
+};
+
+const audio_kernels_t &scalar_audio_kernels();
+// The kernels this CPU can run, the scalar ones first and the fastest last
+std::vector<const audio_kernels_t*> supported_audio_kernels();
+const audio_kernels_t &best_audio_kernels();
+
+#endif //AAUTO_AUDIO_KERNELS_H
@@ -0,0 +1,187 @@
+#include "audio_mixer.h"
+
+audio_mixer_t::audio_mixer_t(audio_output_factory_t output_factory) :
+        kernels_(best_audio_kernels()), format_({48000, 2}), stats_(), output_started_(false)
+{
+    output_ = output_factory(format_, [this](u_char *out, size_t len) { render(out, len); });
+    TA_DEBUG() << "Mixing the audio with the " << kernels_.name_ << " kernels";
+}
+
+audio_mixer_t::~audio_mixer_t()
+{
+    output_->stop();
+}
+
+void audio_mixer_t::start_input(const audio_sink_ptr_t &sink)
+{
+    std::lock_guard<std::mutex> ol(output_mutex_);
+    sink->start();
+    if (!output_started_) {
+        TA_DEBUG() << "Audio output starts";
+        output_->start();
+        output_started_ = true;
+    }
+}
+
+void audio_mixer_t::stop_input(const audio_sink_ptr_t &sink)
+{
+    std::lock_guard<std::mutex> ol(output_mutex_);
+    sink->stop();
+    bool any_started = false;
+    {
+        std::lock_guard<std::mutex> l(mutex_);
+        for(input_t &cur : inputs_) {
+            // The output might stop before render() notices the input is
+            // gone, so don't leave that to it
+            if (cur.sink_ == sink)
+                deactivate(cur);
+            any_started = any_started || cur.sink_->is_started();
+        }
+    }
+    if (!any_started && output_started_) {
+        TA_DEBUG() << "Audio output stops";
+        output_->stop();
+        output_started_ = false;
+    }
+}
+
+audio_sink_ptr_t audio_mixer_t::add_input(const audio_format_t &format, audio_duck_t duck,
+                                          audio_sink_t::consumed_callback_t on_consumed)
+{
+    if (format.channels_ != 1 && format.channels_ != 2)
+        throw std::runtime_error("Only mono and stereo audio can be mixed");
+
+    input_t input;
+    input.sink_ = std::make_shared<audio_sink_t>(format, on_consumed);
+    input.duck_ = duck;
+    input.step_ = uint32_t((uint64_t(format.sample_rate_) << 16) / format_.sample_rate_);
+    input.phase_ = 0;
+    input.remainder_ = 0;
+    input.active_ = false;
+    input.gain_ = AUDIO_UNITY_GAIN;
+    input.silent_frames_ = 0;
+
+    std::lock_guard<std::mutex> l(mutex_);
+    inputs_.push_back(input);
+    return input.sink_;
+}
+
+audio_mixer_stats_t audio_mixer_t::get_stats()
+{
+    std::lock_guard<std::mutex> l(mutex_);
+    return stats_;
+}
+
+void audio_mixer_t::render(u_char *out, size_t len)
+{
+    auto start = std::chrono::steady_clock::now();
+    size_t frames = len / format_.frame_bytes();
+    int16_t *acc = reinterpret_cast<int16_t*>(out);
+    memset(out, 0, len);
+
+    std::lock_guard<std::mutex> l(mutex_);
+    uint64_t hold_frames = uint64_t(format_.sample_rate_) * duck_hold_millis_ / 1000;
+    bool guidance = false;
+    for(const input_t &cur : inputs_)
+        if (cur.duck_ == AUDIO_DUCK_GUIDANCE && cur.active_ && cur.silent_frames_ < hold_frames)
+            guidance = true;
+
+    converted_.resize(frames * 2);
+    for(input_t &cur : inputs_)
+    {
+        if (!cur.sink_->is_started()) {
+            deactivate(cur);
+            continue;
+        }
+
+        int32_t target = cur.duck_ == AUDIO_DUCK_MEDIA && guidance ? int32_t(duck_gain_)
+                                                                 : AUDIO_UNITY_GAIN;
+        if (!cur.active_) {
+            cur.active_ = true;
+            cur.gain_ = target;
+            cur.silent_frames_ = hold_frames;
+            cur.in_.assign(carried_frames_ * cur.sink_->get_format().channels_, 0);
+        }
+        if (convert(cur, frames))
+            cur.silent_frames_ = 0;
+        else
+            cur.silent_frames_ += frames;
+
+        // Move towards the target gain at the ramp's pace
+        uint32_t ramp_millis = target < cur.gain_ ? uint32_t(duck_attack_millis_)
+                                                   : uint32_t(duck_release_millis_);
+        int32_t max_change = int32_t(uint64_t(AUDIO_UNITY_GAIN) * frames * 1000
+                                     / (uint64_t(format_.sample_rate_) * ramp_millis));
+        int32_t gain = target;
+        if (target < cur.gain_ - max_change)
+            gain = cur.gain_ - max_change;
+        else if (target > cur.gain_ + max_change)
+            gain = cur.gain_ + max_change;
+        mix_ramped(acc, frames, cur.gain_, gain);
+        cur.gain_ = gain;
+    }
+
+    uint64_t mix_ns = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count());
+    stats_.blocks_++;
+    stats_.frames_ += frames;
+    if (guidance)
+        stats_.ducked_blocks_++;
+    stats_.mix_ns_total_ += mix_ns;
+    stats_.max_mix_ns_ = std::max(stats_.max_mix_ns_, mix_ns);
+}
+
+// Must be called with mutex_ held. The input starts from silence the next
+// time it's played.
+void audio_mixer_t::deactivate(input_t &input)
+{
+    if (!input.active_)
+        return;
+    input.active_ = false;
+    input.phase_ = 0;
+    input.remainder_ = 0;
+    input.in_.clear();
+}
+
+// Pulls the input's audio for a block and converts it into converted_.
+// Returns whether the input had any audio for the block.
+bool audio_mixer_t::convert(input_t &input, size_t frames)
+{
+    uint32_t channels = input.sink_->get_format().channels_;
+    // The block ends at the exact position, the rounded down step is only
+    // used within it
+    uint64_t advance = uint64_t(frames) * (uint64_t(input.sink_->get_format().sample_rate_) << 16)
+                       + input.remainder_;
+    input.remainder_ = uint32_t(advance % format_.sample_rate_);
+    uint64_t end = input.phase_ + advance / format_.sample_rate_;
+    size_t consumed = size_t(end >> 16);
+    size_t needed = consumed + carried_frames_;
+
+    input.in_.resize(needed * channels);
+    int16_t *pulled = &input.in_[carried_frames_ * channels];
+    size_t audio = input.sink_->pull(reinterpret_cast<u_char*>(pulled),
+                                     (needed - carried_frames_) * channels * 2);
+
+    kernels_.resample_(input.in_.data(), channels, converted_.data(), frames,
+                       input.phase_, input.step_);
+    memmove(input.in_.data(), &input.in_[consumed * channels],
+            carried_frames_ * channels * sizeof(int16_t));
+    input.phase_ = uint32_t(end & 0xffff);
+    return audio != 0;
+}
+
+// Mixes converted_ into the block, with the gain going from one value to the
+// other over the block
+void audio_mixer_t::mix_ramped(int16_t *acc, size_t frames, int32_t from, int32_t to)
+{
+    if (from == to) {
+        kernels_.mix_(acc, converted_.data(), frames * 2, to);
+        return;
+    }
+    for(size_t f = 0; f < frames; f += ramp_frames_)
+    {
+        size_t chunk = std::min(size_t(ramp_frames_), frames - f);
+        int32_t gain = from + int32_t(int64_t(to - from) * int64_t(f + chunk) / int64_t(frames));
+        kernels_.mix_(acc + f * 2, converted_.data() + f * 2, chunk * 2, gain);
+    }
+}
@@ -0,0 +1,89 @@
+#ifndef AAUTO_AUDIO_MIXER_H
+#define AAUTO_AUDIO_MIXER_H
+
+#include "audio_sink.h"
+#include "audio_kernels.h"
+
+// How an input takes part in the ducking
+enum audio_duck_t {
+    AUDIO_DUCK_NONE,
+    // Turned down while a guidance input is audible
+    AUDIO_DUCK_MEDIA,
+    // Turns the media inputs down while it's audible
+    AUDIO_DUCK_GUIDANCE,
+};
+
+struct audio_mixer_stats_t {
+    uint64_t blocks_, frames_;
+    // Blocks with the media turned down
+    uint64_t ducked_blocks_;
+    uint64_t mix_ns_total_, max_mix_ns_;
+};
+
+// Mixes the audio channels into one output at 48kHz stereo. Each input is
+// a jitter buffer in its own format, the mixer pulls it at the pace of the
+// output and converts it to the output rate with linear interpolation.
+// The media inputs are ducked while guidance is audible, with a gain ramp
+// instead of a step so there are no clicks.
+class audio_mixer_t {
+    struct input_t {
+        audio_sink_ptr_t sink_;
+        audio_duck_t duck_;
+        // The input frames per output frame, rounded down, and the position
+        // between the first two carried frames, in 16.16 fixed point
+        uint32_t step_, phase_;
+        // What the rounding left of the position, in 1/output rate units of
+        // the fixed point. Carried over, so the input is consumed at exactly
+        // its rate.
+        uint32_t remainder_;
+        bool active_;
+        int32_t gain_;
+        uint64_t silent_frames_;
+        // The carried frames followed by the frames pulled for the block
+        std::vector<int16_t> in_;
+    };
+
+    const audio_kernels_t &kernels_;
+    const audio_format_t format_;
+    std::mutex mutex_;
+    std::vector<input_t> inputs_;
+    std::vector<int16_t> converted_;
+    audio_mixer_stats_t stats_;
+    // Stopped first, it calls render()
+    audio_output_ptr_t output_;
+    // Taken before mutex_, the output stops only once render() can't run
+    std::mutex output_mutex_;
+    bool output_started_;
+
+    // Carried over between blocks, the interpolation looks a frame ahead
+    static const size_t carried_frames_ = 2;
+    static const int32_t duck_gain_ = AUDIO_UNITY_GAIN / 4;
+    static const uint32_t duck_attack_millis_ = 50;
+    static const uint32_t duck_release_millis_ = 300;
+    // Guidance keeps the media ducked through the pauses between phrases
+    static const uint32_t duck_hold_millis_ = 500;
+    // The gain ramps in steps of this many frames
+    static const size_t ramp_frames_ = 32;
+public:
+    explicit audio_mixer_t(audio_output_factory_t output_factory);
+    ~audio_mixer_t();
+
+    // The returned sink is played while it's started with start_input
+    audio_sink_ptr_t add_input(const audio_format_t &format, audio_duck_t duck,
+                               audio_sink_t::consumed_callback_t on_consumed);
+    // The output only runs while at least one input is started, an idle
+    // mixer doesn't render silence
+    void start_input(const audio_sink_ptr_t &sink);
+    void stop_input(const audio_sink_ptr_t &sink);
+    audio_mixer_stats_t get_stats();
+    const char *get_kernels_name() const { return kernels_.name_; }
+    const audio_format_t &get_format() const { return format_; }
+
+private:
+    void render(u_char *out, size_t len);
+    void deactivate(input_t &input);
+    bool convert(input_t &input, size_t frames);
+    void mix_ramped(int16_t *acc, size_t frames, int32_t from, int32_t to);
+};
+
+#endif //AAUTO_AUDIO_MIXER_H
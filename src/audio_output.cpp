@@ -0,0 +1,7 @@
+#include "audio_output.h"
+
+null_audio_output_t::null_audio_output_t(const audio_format_t &format, render_t render) :
+        render_(render), period_(format.bytes_for_millis(period_millis_)),
+        worker_(period_millis_, [this]{ render_(period_.data(), period_.size()); })
+{
+}
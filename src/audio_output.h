@@ -0,0 +1,52 @@
+#ifndef AAUTO_AUDIO_OUTPUT_H
+#define AAUTO_AUDIO_OUTPUT_H
+
+#include "utils.h"
+#include "paced_worker.h"
+#include <functional>
+
+// Signed 16-bit little-endian PCM, interleaved
+struct audio_format_t {
+    uint32_t sample_rate_;
+    uint32_t channels_;
+
+    size_t frame_bytes() const { return channels_ * 2; }
+    size_t bytes_for_millis(uint32_t millis) const {
+        return size_t(sample_rate_) * millis / 1000 * frame_bytes();
+    }
+};
+
+// Where the mixed audio goes. While started, the output calls the render
+// callback from its own thread at the playback pace, to fill its buffer
+// with whole frames.
+class audio_output_t {
+public:
+    typedef std::function<void(u_char *out, size_t len)> render_t;
+
+    virtual ~audio_output_t() {}
+    virtual void start() = 0;
+    // The render callback isn't running anymore once this returns
+    virtual void stop() = 0;
+};
+
+typedef std::shared_ptr<audio_output_t> audio_output_ptr_t;
+typedef std::function<audio_output_ptr_t(const audio_format_t &format,
+                                         audio_output_t::render_t render)> audio_output_factory_t;
+
+// Consumes the audio at the playback pace without a sound card, for the
+// headless sessions and for profiling
+class null_audio_output_t : public audio_output_t {
+    render_t render_;
+    buf_t period_;
+    // Last, it calls render_
+    paced_worker_t worker_;
+
+    static const uint32_t period_millis_ = 5;
+public:
+    null_audio_output_t(const audio_format_t &format, render_t render);
+
+    void start() override { worker_.start(); }
+    void stop() override { worker_.stop(); }
+};
+
+#endif //AAUTO_AUDIO_OUTPUT_H
@@ -0,0 +1,149 @@
+#include "audio_sink.h"
+
+audio_sink_t::audio_sink_t(const audio_format_t &format, consumed_callback_t on_consumed) :
+        buffered_(), prebuffering_(true), started_(false),
+        target_millis_(initial_target_millis_), smooth_bytes_(), stats_(),
+        on_consumed_(on_consumed), format_(format)
+{
+    if (format_.sample_rate_ == 0 || format_.channels_ == 0)
+        throw std::runtime_error("Bad audio format");
+}
+
+uint32_t audio_sink_t::millis_for(size_t bytes) const
+{
+    return uint32_t(uint64_t(bytes) * 1000 / format_.frame_bytes() / format_.sample_rate_);
+}
+
+void audio_sink_t::submit(const packet_ptr_t &packet, size_t offset)
+{
+    size_t len = packet->content_.size() > offset ? packet->content_.size() - offset : 0;
+    // Only whole frames are played
+    len -= len % format_.frame_bytes();
+
+    std::unique_lock<std::mutex> l(mutex_);
+    if (len == 0) {
+        l.unlock();
+        on_consumed_(packet, 0);
+        return;
+    }
+    queue_.push_back(queued_t{packet, offset, std::chrono::steady_clock::now()});
+    buffered_ += len;
+    stats_.max_buffered_millis_ = std::max(stats_.max_buffered_millis_, millis_for(buffered_));
+}
+
+void audio_sink_t::start()
+{
+    std::lock_guard<std::mutex> l(mutex_);
+    if (started_)
+        return;
+    started_ = true;
+    prebuffering_ = true;
+}
+
+void audio_sink_t::stop()
+{
+    std::lock_guard<std::mutex> l(mutex_);
+    started_ = false;
+    queue_.clear();
+    buffered_ = 0;
+}
+
+bool audio_sink_t::is_started()
+{
+    std::lock_guard<std::mutex> l(mutex_);
+    return started_;
+}
+
+audio_sink_stats_t audio_sink_t::get_stats()
+{
+    std::lock_guard<std::mutex> l(mutex_);
+    audio_sink_stats_t res = stats_;
+    res.target_millis_ = target_millis_;
+    res.buffered_millis_ = millis_for(buffered_);
+    return res;
+}
+
+// Must be called with mutex_ held, returns the number of bytes dropped
+size_t audio_sink_t::drop_front(size_t len)
+{
+    size_t dropped = 0;
+    while(dropped < len && !queue_.empty())
+    {
+        queued_t &cur = queue_.front();
+        size_t avail = cur.packet_->content_.size() - cur.offset_;
+        avail -= avail % format_.frame_bytes();
+        size_t chunk = std::min(avail, len - dropped);
+        cur.offset_ += chunk;
+        dropped += chunk;
+        if (chunk == avail)
+            finish_front();
+    }
+    buffered_ -= dropped;
+    return dropped;
+}
+
+// Must be called with mutex_ held
+void audio_sink_t::finish_front()
+{
+    const queued_t &cur = queue_.front();
+    uint64_t queue_ns = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - cur.queued_).count());
+    consumed_.push_back(std::make_pair(cur.packet_, queue_ns));
+    queue_.pop_front();
+}
+
+size_t audio_sink_t::pull(u_char *out, size_t len)
+{
+    size_t written = 0;
+    {
+        std::lock_guard<std::mutex> l(mutex_);
+        if (started_ && prebuffering_ && buffered_ >= format_.bytes_for_millis(target_millis_))
+            prebuffering_ = false;
+
+        if (started_ && !prebuffering_) {
+            // Catch up if the phone got ahead of us, keeping the target
+            size_t target_bytes = format_.bytes_for_millis(target_millis_);
+            if (buffered_ > format_.bytes_for_millis(max_latency_millis_))
+                stats_.bytes_dropped_ += drop_front(buffered_ - target_bytes);
+
+            while(written < len && !queue_.empty())
+            {
+                queued_t &cur = queue_.front();
+                size_t avail = cur.packet_->content_.size() - cur.offset_;
+                avail -= avail % format_.frame_bytes();
+                size_t chunk = std::min(avail, len - written);
+                memcpy(out + written, &cur.packet_->content_[cur.offset_], chunk);
+                cur.offset_ += chunk;
+                written += chunk;
+                buffered_ -= chunk;
+                if (chunk == avail) {
+                    finish_front();
+                    stats_.packets_played_++;
+                }
+            }
+            stats_.bytes_played_ += written;
+
+            if (written < len) {
+                // Ran dry, buffer more before playing on
+                stats_.underruns_++;
+                prebuffering_ = true;
+                smooth_bytes_ = 0;
+                target_millis_ = std::min<uint32_t>(target_millis_ + target_step_millis_,
+                                                    uint32_t(max_latency_millis_));
+            } else {
+                smooth_bytes_ += written;
+                if (smooth_bytes_ >= format_.bytes_for_millis(target_decay_millis_)) {
+                    smooth_bytes_ = 0;
+                    target_millis_ = std::max<uint32_t>(target_millis_ - 1, uint32_t(min_target_millis_));
+                }
+            }
+        }
+    }
+    memset(out + written, 0, len - written);
+
+    // Only one thread pulls, so consumed_ is ours here
+    for(const auto &cur : consumed_)
+        on_consumed_(cur.first, cur.second);
+    consumed_.clear();
+    return written;
+}
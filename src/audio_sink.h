@@ -0,0 +1,85 @@
+#ifndef AAUTO_AUDIO_SINK_H
+#define AAUTO_AUDIO_SINK_H
+
+#include "utils.h"
+#include "aa_helpers.h"
+#include "audio_output.h"
+#include <chrono>
+#include <deque>
+#include <functional>
+
+struct audio_sink_stats_t {
+    uint64_t packets_played_, bytes_played_;
+    uint64_t underruns_, bytes_dropped_;
+    // The current jitter buffer target and the audio buffered right now
+    uint32_t target_millis_, buffered_millis_, max_buffered_millis_;
+};
+
+// Plays the PCM of an audio channel through an adaptive jitter buffer. The
+// buffer aims to hold target_millis of audio before the output: the target
+// grows after an underrun and slowly shrinks back while the playback is
+// smooth, and it never exceeds max_latency_millis_ - anything beyond that
+// is dropped. A packet is reported as consumed once its last sample has
+// been handed to the output. The mixer pulls the audio at the playback pace.
+class audio_sink_t {
+public:
+    // Called with the time the packet spent in the jitter buffer. It runs on
+    // the real-time audio thread, so it must hand the work off rather than
+    // do any I/O.
+    typedef std::function<void(const packet_ptr_t &packet, uint64_t queue_ns)> consumed_callback_t;
+
+private:
+    struct queued_t {
+        packet_ptr_t packet_;
+        size_t offset_;
+        std::chrono::steady_clock::time_point queued_;
+    };
+
+    std::mutex mutex_;
+    std::deque<queued_t> queue_;
+    size_t buffered_;
+    // Waiting for the target to fill up before (re)starting the playback
+    bool prebuffering_;
+    bool started_;
+    uint32_t target_millis_;
+    uint64_t smooth_bytes_;
+    audio_sink_stats_t stats_;
+    consumed_callback_t on_consumed_;
+    // Packets consumed by the current pull, reported outside the lock
+    std::vector<std::pair<packet_ptr_t, uint64_t>> consumed_;
+
+    static const uint32_t min_target_millis_ = 10;
+    static const uint32_t initial_target_millis_ = 20;
+    static const uint32_t target_step_millis_ = 5;
+    // The target shrinks by a millisecond after this much smooth playback
+    static const uint32_t target_decay_millis_ = 1000;
+
+    const audio_format_t format_;
+
+public:
+    static const uint32_t max_latency_millis_ = 50;
+
+    audio_sink_t(const audio_format_t &format, consumed_callback_t on_consumed);
+
+    // Queues the PCM of the packet starting at the offset
+    void submit(const packet_ptr_t &packet, size_t offset);
+    void start();
+    // Discards the queued audio, the packets are not reported as consumed
+    void stop();
+    bool is_started();
+    audio_sink_stats_t get_stats();
+    const audio_format_t &get_format() const { return format_; }
+
+    // Fills the output with the buffered audio, or silence if there's none.
+    // Returns the number of bytes of actual audio. Only one thread may pull.
+    size_t pull(u_char *out, size_t len);
+
+private:
+    size_t drop_front(size_t len);
+    void finish_front();
+    uint32_t millis_for(size_t bytes) const;
+};
+
+typedef std::shared_ptr<audio_sink_t> audio_sink_ptr_t;
+
+#endif //AAUTO_AUDIO_SINK_H
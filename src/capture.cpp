@@ -0,0 +1,88 @@
+#include "capture.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+capture_t::capture_t(const std::string &path) : start_(std::chrono::steady_clock::now())
+{
+    fd_ = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd_ < 0) {
+        str_out_t p;
+        p << "Can't open the capture file " << path << ": " << strerror(errno);
+        throw std::runtime_error(p);
+    }
+
+    // Appending to an existing capture keeps its header, the session
+    // record tells the replay where our timestamps start
+    struct stat st;
+    if (fstat(fd_, &st) == 0 && st.st_size == 0)
+        pending_.insert(pending_.end(), CAPTURE_MAGIC, CAPTURE_MAGIC + sizeof(CAPTURE_MAGIC));
+    record(CAPTURE_SESSION, 0, 0, nullptr, 0);
+    TA_INFO() << "Capturing the traffic to " << path;
+}
+
+capture_t::~capture_t()
+{
+    try {
+        flush();
+    } catch(const std::exception &ex)
+    {
+        TA_INFO() << "Failed to finish the capture: " << ex.what();
+    }
+    close(fd_);
+}
+
+void capture_t::record(capture_kind_t kind, u_char chan, u_char flags,
+                       const u_char *data, size_t len)
+{
+    capture_record_t rec = capture_record_t();
+    rec.timestamp_ns_ = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start_).count());
+    rec.size_ = safe_cast<uint32_t>(len);
+    rec.kind_ = uint8_t(kind);
+    rec.chan_ = chan;
+    rec.flags_ = flags;
+
+    std::lock_guard<std::mutex> l(mutex_);
+    const u_char *header = reinterpret_cast<const u_char*>(&rec);
+    pending_.insert(pending_.end(), header, header + sizeof(rec));
+    pending_.insert(pending_.end(), data, data + len);
+    if (pending_.size() >= flush_threshold_)
+        write_pending();
+}
+
+void capture_t::record_packet(capture_kind_t kind, const packet_t &packet)
+{
+    u_char flags = 0;
+    if (packet.encrypted_)
+        flags |= AA_ENCRYPTED;
+    if (packet.control_)
+        flags |= AA_CONTROL_FLAG;
+    record(kind, packet.chan_, flags, packet.content_.data(), packet.content_.size());
+}
+
+void capture_t::flush()
+{
+    std::lock_guard<std::mutex> l(mutex_);
+    write_pending();
+}
+
+// Must be called with mutex_ held
+void capture_t::write_pending()
+{
+    size_t pos = 0;
+    while(pos < pending_.size())
+    {
+        ssize_t res = write(fd_, &pending_[pos], pending_.size() - pos);
+        if (res < 0) {
+            if (errno == EINTR)
+                continue;
+            pending_.clear();
+            str_out_t p;
+            p << "Failed to write the capture: " << strerror(errno);
+            throw std::runtime_error(p);
+        }
+        pos += res;
+    }
+    pending_.clear();
+}
@@ -0,0 +1,54 @@
+#ifndef AAUTO_CAPTURE_H
+#define AAUTO_CAPTURE_H
+
+#include "utils.h"
+#include "aa_helpers.h"
+#include <chrono>
+
+// A capture file starts with the magic, followed by records. Each record
+// is a capture_record_t header in the host byte order and its payload.
+// Every capture_t appends a CAPTURE_SESSION record first, the timestamps
+// restart from zero after it.
+static const char CAPTURE_MAGIC[8] = {'A', 'A', 'C', 'A', 'P', '0', '0', '1'};
+
+enum capture_kind_t {
+    CAPTURE_RAW_IN,    // An incoming fragment as it was on the wire
+    CAPTURE_RAW_OUT,   // An outgoing fragment as it was on the wire
+    CAPTURE_PLAIN_IN,  // A reassembled and decrypted incoming message
+    CAPTURE_PLAIN_OUT, // An outgoing message before framing
+    CAPTURE_SESSION,   // Empty, starts the records of one capture_t
+};
+
+struct capture_record_t {
+    uint64_t timestamp_ns_; // Since the last CAPTURE_SESSION record
+    uint32_t size_;
+    uint8_t kind_, chan_;
+    uint8_t flags_; // AA fragment flags, only the ENCRYPTED and CONTROL bits for messages
+    uint8_t reserved_;
+};
+static_assert(sizeof(capture_record_t) == 16, "Capture record header must be packed");
+
+// Appends the session traffic to a file. Records are buffered and written
+// in large chunks, so capturing doesn't slow down the transport much.
+class capture_t {
+    int fd_;
+    std::mutex mutex_;
+    buf_t pending_;
+    std::chrono::steady_clock::time_point start_;
+
+    static const size_t flush_threshold_ = 256*1024;
+public:
+    explicit capture_t(const std::string &path);
+    ~capture_t();
+
+    void record(capture_kind_t kind, u_char chan, u_char flags,
+                const u_char *data, size_t len);
+    void record_packet(capture_kind_t kind, const packet_t &packet);
+    void flush();
+private:
+    void write_pending();
+};
+
+typedef std::shared_ptr<capture_t> capture_ptr_t;
+
+#endif //AAUTO_CAPTURE_H
@@ -4,7 +4,15 @@
 #include "crypto.h"
 #include <openssl/ssl.h>
 #include <openssl/rand.h>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <algorithm>
 
+#if OPENSSL_VERSION_NUMBER < 0x10101000L
+#error "OpenSSL 1.1.1 or newer is required"
+#endif
 
 void init_crypto() {
     int ret = SSL_library_init();
@@ -22,7 +30,127 @@ void init_crypto() {
         throw std::runtime_error("OpenSSL doesn't have an entropy source");
 }
 
-crypto_context_t::crypto_context_t(const std::string &cert, const std::string &pk) {
+static void put_be64(uint64_t val, u_char *out)
+{
+    for(int f=7; f>=0; --f) {
+        out[f] = u_char(val);
+        val >>= 8;
+    }
+}
+
+record_cipher_t::record_cipher_t(const EVP_CIPHER *cipher, const u_char *key,
+                                 const u_char *fixed_iv, uint64_t seq, bool encrypt) :
+        seq_(seq)
+{
+    ctx_.reset(EVP_CIPHER_CTX_new(), [](EVP_CIPHER_CTX *c){EVP_CIPHER_CTX_free(c);});
+    if (!ctx_ || EVP_CipherInit_ex(ctx_.get(), cipher, nullptr, key, nullptr, encrypt) != 1)
+        throw std::runtime_error("Can't initialize the record cipher");
+    memcpy(fixed_iv_, fixed_iv, sizeof(fixed_iv_));
+}
+
+size_t record_cipher_t::seal(const u_char *data, size_t len, u_char *out)
+{
+    assert(len <= SSL3_RT_MAX_PLAIN_LENGTH);
+    size_t record_len = explicit_nonce_size_ + len + tag_size_;
+    out[0] = SSL3_RT_APPLICATION_DATA;
+    out[1] = TLS1_2_VERSION >> 8;
+    out[2] = TLS1_2_VERSION & 0xFF;
+    out[3] = u_char(record_len >> 8);
+    out[4] = u_char(record_len);
+
+    // The explicit part of the nonce is the sequence number, same as OpenSSL
+    u_char nonce[12];
+    memcpy(nonce, fixed_iv_, sizeof(fixed_iv_));
+    put_be64(seq_, nonce + sizeof(fixed_iv_));
+    memcpy(out + header_size_, nonce + sizeof(fixed_iv_), explicit_nonce_size_);
+
+    u_char aad[13];
+    put_be64(seq_, aad);
+    memcpy(aad + 8, out, 3);
+    aad[11] = u_char(len >> 8);
+    aad[12] = u_char(len);
+
+    EVP_CIPHER_CTX *ctx = ctx_.get();
+    u_char *cipher_text = out + header_size_ + explicit_nonce_size_;
+    int out_len = 0, final_len = 0;
+    if (EVP_EncryptInit_ex(ctx, nullptr, nullptr, nullptr, nonce) != 1 ||
+            EVP_EncryptUpdate(ctx, nullptr, &out_len, aad, sizeof(aad)) != 1 ||
+            EVP_EncryptUpdate(ctx, cipher_text, &out_len, data, safe_cast<int>(len)) != 1 ||
+            EVP_EncryptFinal_ex(ctx, cipher_text + out_len, &final_len) != 1 ||
+            EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, tag_size_, cipher_text + len) != 1)
+        throw std::runtime_error("Failed to encrypt a record");
+
+    seq_++;
+    return header_size_ + record_len;
+}
+
+size_t record_cipher_t::open(const u_char *data, size_t len, buf_t &target)
+{
+    if (len < header_size_)
+        throw std::runtime_error("Truncated TLS record");
+    if (data[0] != SSL3_RT_APPLICATION_DATA) {
+        str_out_t p;
+        p << "Unexpected TLS record type " << (int)data[0];
+        throw std::runtime_error(p);
+    }
+    size_t record_len = (size_t(data[3]) << 8) | data[4];
+    if (record_len < explicit_nonce_size_ + tag_size_ || header_size_ + record_len > len)
+        throw std::runtime_error("Truncated TLS record");
+    size_t plain_len = record_len - explicit_nonce_size_ - tag_size_;
+
+    u_char nonce[12];
+    memcpy(nonce, fixed_iv_, sizeof(fixed_iv_));
+    memcpy(nonce + sizeof(fixed_iv_), data + header_size_, explicit_nonce_size_);
+
+    u_char aad[13];
+    put_be64(seq_, aad);
+    memcpy(aad + 8, data, 3);
+    aad[11] = u_char(plain_len >> 8);
+    aad[12] = u_char(plain_len);
+
+    EVP_CIPHER_CTX *ctx = ctx_.get();
+    const u_char *cipher_text = data + header_size_ + explicit_nonce_size_;
+    u_char *tag = const_cast<u_char*>(cipher_text + plain_len);
+    size_t start = target.size();
+    target.resize(start + plain_len);
+    u_char final_block[16];
+    int out_len = 0, final_len = 0;
+    if (EVP_DecryptInit_ex(ctx, nullptr, nullptr, nullptr, nonce) != 1 ||
+            EVP_DecryptUpdate(ctx, nullptr, &out_len, aad, sizeof(aad)) != 1 ||
+            EVP_DecryptUpdate(ctx, target.data() + start, &out_len,
+                              cipher_text, safe_cast<int>(plain_len)) != 1 ||
+            EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, tag_size_, tag) != 1 ||
+            EVP_DecryptFinal_ex(ctx, final_block, &final_len) != 1) {
+        target.resize(start);
+        throw std::runtime_error("TLS record authentication failed");
+    }
+
+    seq_++;
+    return header_size_ + record_len;
+}
+
+// The TLS 1.2 PRF, RFC 5246 section 5
+static buf_t tls12_prf(const EVP_MD *md, const u_char *secret, size_t secret_len,
+                       const std::string &label, const u_char *seed, size_t seed_len,
+                       size_t out_len)
+{
+    std::shared_ptr<EVP_PKEY_CTX> pctx(EVP_PKEY_CTX_new_id(EVP_PKEY_TLS1_PRF, nullptr),
+                                       [](EVP_PKEY_CTX *c){EVP_PKEY_CTX_free(c);});
+    buf_t res(out_len);
+    if (!pctx || EVP_PKEY_derive_init(pctx.get()) <= 0 ||
+            EVP_PKEY_CTX_set_tls1_prf_md(pctx.get(), md) <= 0 ||
+            EVP_PKEY_CTX_set1_tls1_prf_secret(pctx.get(), secret, safe_cast<int>(secret_len)) <= 0 ||
+            EVP_PKEY_CTX_add1_tls1_prf_seed(pctx.get(), (const u_char*)label.data(),
+                                            safe_cast<int>(label.size())) <= 0 ||
+            EVP_PKEY_CTX_add1_tls1_prf_seed(pctx.get(), seed, safe_cast<int>(seed_len)) <= 0 ||
+            EVP_PKEY_derive(pctx.get(), res.data(), &out_len) <= 0)
+        throw std::runtime_error("Failed to derive the record keys");
+    return res;
+}
+
+// Parses the certificate and the key into a new SSL context
+static std::shared_ptr<SSL_CTX> make_ssl_ctx(const std::string &cert, const std::string &pk)
+{
     // Convert certificate to BIO
     std::shared_ptr<BIO> cert_bio(BIO_new_mem_buf((void*)&cert.at(0), safe_cast<int>(cert.size())),
                                   [](BIO* bio){BIO_free(bio);});
@@ -54,6 +182,22 @@ crypto_context_t::crypto_context_t(const std::string &cert, const std::string &p
     if (SSL_CTX_use_PrivateKey (ssl_ctx.get(), priv_key.get()) != 1)
         throw std::runtime_error("Can't use private key for SSL");
 
+    // We remember the sessions ourselves, per phone
+    SSL_CTX_set_session_cache_mode(ssl_ctx.get(), SSL_SESS_CACHE_OFF);
+    return ssl_ctx;
+}
+
+crypto_context_t::crypto_context_t(const std::string &cert, const std::string &pk,
+                                   bool allow_direct_records) :
+        crypto_context_t(make_ssl_ctx(cert, pk), std::shared_ptr<SSL_SESSION>(),
+                         allow_direct_records) {
+}
+
+crypto_context_t::crypto_context_t(const std::shared_ptr<SSL_CTX> &ssl_ctx,
+                                   const std::shared_ptr<SSL_SESSION> &session,
+                                   bool allow_direct_records) :
+        allow_direct_records_(allow_direct_records), direct_records_(false),
+        handshake_started_(false), handshake_reported_(false) {
     BIO* read_bio = BIO_new(BIO_s_mem());
     scope_guard_t read_bio_guard([=](){BIO_free(read_bio);});
     BIO* write_bio = BIO_new(BIO_s_mem());
@@ -75,6 +219,9 @@ crypto_context_t::crypto_context_t(const std::string &cert, const std::string &p
     //TODO: verify Google's cert?
     SSL_set_verify(ssl_conn.get(), SSL_VERIFY_NONE, NULL);
     SSL_set_connect_state(ssl_conn.get());
+    // Offer the previous session for an abbreviated handshake
+    if (session && SSL_set_session(ssl_conn.get(), session.get()) != 1)
+        TA_INFO() << "Can't resume the previous SSL session";
 
     this->read_bio_ = read_bio;
     this->write_bio_ = write_bio;
@@ -85,6 +232,10 @@ crypto_context_t::crypto_context_t(const std::string &cert, const std::string &p
 buf_t crypto_context_t::do_handshake(const buf_t &input, size_t pos) {
     std::lock_guard<std::mutex> l(this->mutex_);
     ensure_handshake_state(false);
+    if (!handshake_started_) {
+        handshake_started_ = true;
+        handshake_start_ = std::chrono::steady_clock::now();
+    }
 
     buf_t res_buf;
     size_t in_pos = pos;
@@ -125,33 +276,162 @@ buf_t crypto_context_t::do_handshake(const buf_t &input, size_t pos) {
         }
     }
 
+    if (SSL_is_init_finished(this->ssl_.get()))
+        finish_handshake();
     return std::move(res_buf);
 }
 
+// Must be called with mutex_ held
+void crypto_context_t::finish_handshake()
+{
+    if (handshake_reported_)
+        return;
+    handshake_reported_ = true;
+
+    SSL *ssl = this->ssl_.get();
+    double millis = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - handshake_start_).count();
+    TA_INFO() << (SSL_session_reused(ssl) ? "Resumed" : "Full") << " SSL handshake took "
+              << millis << "ms";
+
+    if (on_session_) {
+        std::shared_ptr<SSL_SESSION> session(SSL_get1_session(ssl),
+                                             [](SSL_SESSION *s){SSL_SESSION_free(s);});
+        if (session && SSL_SESSION_is_resumable(session.get()))
+            on_session_(session);
+    }
+
+    if (allow_direct_records_)
+        start_direct_records();
+}
+
+// Must be called with mutex_ held
+void crypto_context_t::start_direct_records()
+{
+    SSL *ssl = this->ssl_.get();
+    const SSL_CIPHER *cipher = SSL_get_current_cipher(ssl);
+    const EVP_CIPHER *evp_cipher = nullptr;
+    switch(SSL_CIPHER_get_cipher_nid(cipher))
+    {
+        case NID_aes_128_gcm:
+            evp_cipher = EVP_aes_128_gcm();
+            break;
+        case NID_aes_256_gcm:
+            evp_cipher = EVP_aes_256_gcm();
+            break;
+    }
+    if (!evp_cipher || SSL_version(ssl) != TLS1_2_VERSION) {
+        TA_INFO() << "Keeping " << SSL_CIPHER_get_name(cipher) << " records on SSL";
+        return;
+    }
+    // Records that SSL has already buffered would be lost
+    if (BIO_pending(this->read_bio_) != 0 || SSL_pending(ssl) != 0) {
+        TA_INFO() << "SSL has pending records, keeping them on SSL";
+        return;
+    }
+
+    u_char master[SSL_MAX_MASTER_KEY_LENGTH];
+    size_t master_len = SSL_SESSION_get_master_key(SSL_get_session(ssl), master, sizeof(master));
+    ON_BLOCK_EXIT([&]{OPENSSL_cleanse(master, sizeof(master));});
+    u_char randoms[2*SSL3_RANDOM_SIZE];
+    SSL_get_server_random(ssl, randoms, SSL3_RANDOM_SIZE);
+    SSL_get_client_random(ssl, randoms + SSL3_RANDOM_SIZE, SSL3_RANDOM_SIZE);
+
+    // AEAD suites have no MAC keys: client key, server key, client IV, server IV
+    size_t key_len = safe_cast<size_t>(EVP_CIPHER_key_length(evp_cipher));
+    buf_t block = tls12_prf(SSL_CIPHER_get_handshake_digest(cipher), master, master_len,
+                            "key expansion", randoms, sizeof(randoms), 2*key_len + 8);
+    ON_BLOCK_EXIT([&]{OPENSSL_cleanse(block.data(), block.size());});
+
+    // We're the client. The Finished messages were the first records
+    // under the new keys in both directions.
+    std::lock_guard<std::mutex> rl(this->read_mutex_);
+    std::lock_guard<std::mutex> wl(this->write_mutex_);
+    write_cipher_.reset(new record_cipher_t(evp_cipher, &block[0], &block[2*key_len], 1, true));
+    read_cipher_.reset(new record_cipher_t(evp_cipher, &block[key_len], &block[2*key_len + 4],
+                                           1, false));
+    direct_records_ = true;
+    TA_DEBUG() << "Using direct " << SSL_CIPHER_get_name(cipher) << " records";
+}
+
 bool crypto_context_t::is_handshake_finished() const {
     std::lock_guard<std::mutex> l(this->mutex_);
     return SSL_is_init_finished(this->ssl_.get());
 }
 
 buf_t crypto_context_t::encrypt(const buf_t &input, size_t pos) {
-    std::lock_guard<std::mutex> l(this->mutex_);
-    ensure_handshake_state(true);
-
     buf_t res_buf;
+    encrypt_to(&input.at(pos), input.size()-pos, res_buf);
+    return std::move(res_buf);
+}
+
+// Locks the mutex, measuring the time spent waiting for it
+static std::unique_lock<std::mutex> lock_timed(std::mutex &mutex, uint64_t &wait_ns)
+{
+    std::unique_lock<std::mutex> l(mutex, std::try_to_lock);
+    if (l.owns_lock()) {
+        wait_ns = 0;
+        return l;
+    }
+    auto start = std::chrono::steady_clock::now();
+    l.lock();
+    wait_ns = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count());
+    return l;
+}
+
+size_t crypto_context_t::encrypt_to(const u_char *data, size_t len, buf_t &target) {
+    auto start = std::chrono::steady_clock::now();
+    uint64_t wait_ns;
+    size_t res;
+    if (direct_records_) {
+        std::unique_lock<std::mutex> l = lock_timed(this->write_mutex_, wait_ns);
+        res = seal_records(data, len, target);
+    } else {
+        std::unique_lock<std::mutex> l = lock_timed(this->mutex_, wait_ns);
+        res = ssl_encrypt(data, len, target);
+    }
+    record_timing(encrypt_counters_, len, start, wait_ns);
+    return res;
+}
+
+// Must be called with write_mutex_ held
+size_t crypto_context_t::seal_records(const u_char *data, size_t len, buf_t &target) {
+    size_t start = target.size();
+    for(size_t pos = 0; pos < len; )
+    {
+        size_t chunk = std::min<size_t>(len - pos, SSL3_RT_MAX_PLAIN_LENGTH);
+        size_t record_start = target.size();
+        target.resize(record_start + chunk + record_cipher_t::overhead());
+        size_t written = write_cipher_->seal(data + pos, chunk, &target[record_start]);
+        target.resize(record_start + written);
+        pos += chunk;
+    }
+    return target.size() - start;
+}
+
+// Must be called with mutex_ held
+size_t crypto_context_t::ssl_encrypt(const u_char *data, size_t len, buf_t &target) {
+    ensure_handshake_state(true);
+    if (len == 0)
+        return 0;
 
     //We are using memory BIOs which can expand indefinitely, so SSL_write
     //must always succeed.
-    int ret = SSL_write(this->ssl_.get(), &input.at(pos), safe_cast<int>(input.size()-pos));
-    if (ret != input.size()) {
+    int in_len = safe_cast<int>(len);
+    int ret = SSL_write(this->ssl_.get(), data, in_len);
+    if (ret != in_len) {
         str_out_t p;
-        p << "Failed to encrypt " << input.size() << " bytes";
+        p << "Failed to encrypt " << len << " bytes";
         throw std::runtime_error(p);
     }
 
+    //Read the records straight into the tail of the target
     int pending = BIO_pending(this->write_bio_);
     if (pending != 0) {
-        res_buf.resize(res_buf.size() + pending);
-        int res = BIO_read(this->write_bio_, &res_buf.at(res_buf.size()-pending), pending);
+        size_t start = target.size();
+        target.resize(start + pending);
+        int res = BIO_read(this->write_bio_, &target.at(start), pending);
         if (res != pending) {
             str_out_t p;
             p << "Pending bytes: " << pending << " differ from read: " << res;
@@ -159,47 +439,162 @@ buf_t crypto_context_t::encrypt(const buf_t &input, size_t pos) {
         }
     }
 
-    return std::move(res_buf);
+    return safe_cast<size_t>(pending);
 }
 
 buf_t crypto_context_t::decrypt(const buf_t &input, size_t pos) {
-    std::lock_guard<std::mutex> l(this->mutex_);
+    buf_t res_buf;
+    decrypt_to(&input.at(pos), input.size()-pos, res_buf);
+    return std::move(res_buf);
+}
+
+size_t crypto_context_t::decrypt_to(const u_char *data, size_t len, buf_t &target) {
+    auto start = std::chrono::steady_clock::now();
+    uint64_t wait_ns;
+    size_t res;
+    if (direct_records_) {
+        std::unique_lock<std::mutex> l = lock_timed(this->read_mutex_, wait_ns);
+        res = open_records(data, len, target);
+    } else {
+        std::unique_lock<std::mutex> l = lock_timed(this->mutex_, wait_ns);
+        res = ssl_decrypt(data, len, target);
+    }
+    record_timing(decrypt_counters_, len, start, wait_ns);
+    return res;
+}
+
+// Must be called with read_mutex_ held
+size_t crypto_context_t::open_records(const u_char *data, size_t len, buf_t &target) {
+    size_t start = target.size();
+    for(size_t pos = 0; pos < len; )
+        pos += read_cipher_->open(data + pos, len - pos, target);
+    return target.size() - start;
+}
+
+// Must be called with mutex_ held
+size_t crypto_context_t::ssl_decrypt(const u_char *data, size_t len, buf_t &target) {
+    size_t start = target.size();
     ensure_handshake_state(true);
 
     //BIO write is guaranteed to succeed, since we're using memory-based
     //BIOs that can expand to any size
-    int res = BIO_write(this->read_bio_, &input.at(pos), safe_cast<int>(input.size()-pos));
-    if (res != input.size()) {
+    int in_len = safe_cast<int>(len);
+    int res = BIO_write(this->read_bio_, data, in_len);
+    if (res != in_len) {
         str_out_t p;
-        p << "Input bytes: " << input.size() << " differ from written: " << res;
+        p << "Input bytes: " << len << " differ from written: " << res;
         throw std::runtime_error(p);
     }
 
-    int size_step = safe_cast<int>(input.size());
-    buf_t res_buf;
+    int size_step = in_len;
     while(true)
     {
-        size_t pos = res_buf.size();
+        size_t pos = target.size();
         //Reserve some space (might be excessive)
-        res_buf.resize(res_buf.size() + size_step);
-        int ret = SSL_read(this->ssl_.get(), &res_buf.at(pos), size_step);
-        if (SSL_get_error(this->ssl_.get(), ret) == SSL_ERROR_WANT_READ)
+        target.resize(pos + size_step);
+        int ret = SSL_read(this->ssl_.get(), &target.at(pos), size_step);
+        if (SSL_get_error(this->ssl_.get(), ret) == SSL_ERROR_WANT_READ) {
+            target.resize(pos);
             break;
+        }
         if (ret <= 0) {
+            target.resize(pos);
             str_out_t p;
             p << "SSL read failed, error=" << ret;
             throw std::runtime_error(p);
         }
 
         //Snap our buffer back to real size
-        res_buf.resize(pos+ret);
-        //Get the size of the next step (the pending bytes in the buffer)
-        //size_step = SSL_pending(this->ssl_.get());
-        //if (size_step==0)
-        //    break;
+        target.resize(pos+ret);
+        //Don't grow the target again just to learn that there's nothing left
+        if (BIO_pending(this->read_bio_) == 0 && SSL_pending(this->ssl_.get()) == 0)
+            break;
     }
 
-    return std::move(res_buf);
+    return target.size() - start;
+}
+
+void crypto_context_t::record_timing(crypto_op_counters_t *counters, size_t len,
+                                     std::chrono::steady_clock::time_point start,
+                                     uint64_t wait_ns)
+{
+    uint64_t total_ns = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count());
+    uint64_t busy_ns = total_ns > wait_ns ? total_ns - wait_ns : 0;
+
+    int size_class = len <= 256 ? CRYPTO_SIZE_SMALL :
+                     len <= 4096 ? CRYPTO_SIZE_MEDIUM : CRYPTO_SIZE_LARGE;
+    int bucket = 0;
+    while(bucket + 1 < crypto_op_stats_t::latency_buckets_ && (uint64_t(1) << bucket) < total_ns)
+        bucket++;
+    counters[size_class].add(len, busy_ns, wait_ns, bucket);
+}
+
+crypto_stats_t crypto_context_t::get_stats()
+{
+    crypto_stats_t res;
+    for(int f=0; f<CRYPTO_SIZE_CLASSES; ++f) {
+        res.encrypt_[f] = encrypt_counters_[f].load();
+        res.decrypt_[f] = decrypt_counters_[f].load();
+    }
+    return res;
+}
+
+crypto_op_counters_t::crypto_op_counters_t() :
+        ops_(0), bytes_(0), busy_ns_(0), lock_wait_ns_(0)
+{
+    for(int f=0; f<crypto_op_stats_t::latency_buckets_; ++f)
+        latency_hist_[f] = 0;
+}
+
+void crypto_op_counters_t::add(size_t len, uint64_t busy_ns, uint64_t wait_ns, int bucket)
+{
+    ops_.fetch_add(1, std::memory_order_relaxed);
+    bytes_.fetch_add(len, std::memory_order_relaxed);
+    busy_ns_.fetch_add(busy_ns, std::memory_order_relaxed);
+    lock_wait_ns_.fetch_add(wait_ns, std::memory_order_relaxed);
+    latency_hist_[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+crypto_op_stats_t crypto_op_counters_t::load() const
+{
+    crypto_op_stats_t res;
+    res.ops_ = ops_.load(std::memory_order_relaxed);
+    res.bytes_ = bytes_.load(std::memory_order_relaxed);
+    res.busy_ns_ = busy_ns_.load(std::memory_order_relaxed);
+    res.lock_wait_ns_ = lock_wait_ns_.load(std::memory_order_relaxed);
+    for(int f=0; f<crypto_op_stats_t::latency_buckets_; ++f)
+        res.latency_hist_[f] = latency_hist_[f].load(std::memory_order_relaxed);
+    return res;
+}
+
+crypto_op_stats_t crypto_op_stats_t::since(const crypto_op_stats_t &prev) const
+{
+    crypto_op_stats_t res = *this;
+    res.ops_ -= prev.ops_;
+    res.bytes_ -= prev.bytes_;
+    res.busy_ns_ -= prev.busy_ns_;
+    res.lock_wait_ns_ -= prev.lock_wait_ns_;
+    for(int f=0; f<latency_buckets_; ++f)
+        res.latency_hist_[f] -= prev.latency_hist_[f];
+    return res;
+}
+
+uint64_t crypto_op_stats_t::latency_percentile(double fraction) const
+{
+    uint64_t seen = 0;
+    for(int f=0; f<latency_buckets_; ++f) {
+        seen += latency_hist_[f];
+        if (seen != 0 && seen >= fraction * ops_)
+            return uint64_t(1) << f;
+    }
+    return 0;
+}
+
+void crypto_context_t::set_session_callback(const session_callback_t &callback)
+{
+    std::lock_guard<std::mutex> l(this->mutex_);
+    on_session_ = callback;
 }
 
 void crypto_context_t::ensure_handshake_state(bool expect_finished) {
@@ -207,3 +602,85 @@ void crypto_context_t::ensure_handshake_state(bool expect_finished) {
     if (is_finished != expect_finished)
         throw std::runtime_error("Unexpected handshake state");
 }
+
+crypto_factory_t::crypto_factory_t(const std::string &cert, const std::string &pk,
+                                   const std::string &session_dir, bool allow_direct_records) :
+        ssl_ctx_(make_ssl_ctx(cert, pk)), session_dir_(session_dir),
+        allow_direct_records_(allow_direct_records)
+{
+}
+
+std::shared_ptr<crypto_context_t> crypto_factory_t::create_context(const std::string &peer_id)
+{
+    std::shared_ptr<crypto_context_t> res(new crypto_context_t(ssl_ctx_, find_session(peer_id),
+                                                               allow_direct_records_));
+    if (!peer_id.empty()) {
+        std::weak_ptr<crypto_factory_t> self = shared_from_this();
+        res->set_session_callback([self, peer_id](const std::shared_ptr<SSL_SESSION> &session){
+            std::shared_ptr<crypto_factory_t> factory = self.lock();
+            if (factory)
+                factory->store_session(peer_id, session);
+        });
+    }
+    return res;
+}
+
+std::string crypto_factory_t::session_path(const std::string &peer_id) const
+{
+    std::string name = peer_id;
+    std::replace_if(name.begin(), name.end(), [](char c){return !isalnum(c);}, '_');
+    return session_dir_ + "/" + name + ".session";
+}
+
+std::shared_ptr<SSL_SESSION> crypto_factory_t::find_session(const std::string &peer_id)
+{
+    if (peer_id.empty())
+        return std::shared_ptr<SSL_SESSION>();
+
+    std::lock_guard<std::mutex> l(this->mutex_);
+    auto found = sessions_.find(peer_id);
+    if (found != sessions_.end())
+        return found->second;
+    if (session_dir_.empty())
+        return std::shared_ptr<SSL_SESSION>();
+
+    std::shared_ptr<BIO> bio(BIO_new_file(session_path(peer_id).c_str(), "rb"),
+                             [](BIO *b){BIO_free(b);});
+    if (!bio)
+        return std::shared_ptr<SSL_SESSION>();
+    std::shared_ptr<SSL_SESSION> session(d2i_SSL_SESSION_bio(bio.get(), nullptr),
+                                         [](SSL_SESSION *s){SSL_SESSION_free(s);});
+    if (!session) {
+        TA_INFO() << "Ignoring the damaged SSL session of " << peer_id;
+        return session;
+    }
+    sessions_[peer_id] = session;
+    return session;
+}
+
+void crypto_factory_t::store_session(const std::string &peer_id,
+                                     const std::shared_ptr<SSL_SESSION> &session)
+{
+    std::lock_guard<std::mutex> l(this->mutex_);
+    sessions_[peer_id] = session;
+    if (session_dir_.empty())
+        return;
+
+    int len = i2d_SSL_SESSION(session.get(), nullptr);
+    if (len <= 0)
+        return;
+    buf_t data(len);
+    u_char *out = data.data();
+    i2d_SSL_SESSION(session.get(), &out);
+
+    // The session holds the master secret, keep it private
+    std::string path = session_path(peer_id);
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        TA_INFO() << "Can't save the SSL session to " << path;
+        return;
+    }
+    ON_BLOCK_EXIT([=]{close(fd);});
+    if (write(fd, data.data(), data.size()) != len)
+        TA_INFO() << "Can't save the SSL session to " << path;
+}
@@ -6,29 +6,169 @@
 #define AAUTO_CRYPTO_H
 
 #include "utils.h"
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <map>
 
 typedef struct ssl_st SSL;
 typedef struct bio_st BIO;
 typedef struct ssl_ctx_st SSL_CTX;
+typedef struct ssl_session_st SSL_SESSION;
+typedef struct evp_cipher_st EVP_CIPHER;
+typedef struct evp_cipher_ctx_st EVP_CIPHER_CTX;
+
+// TLS 1.2 AES-GCM record protection for one direction, run straight
+// through EVP with the keys established by the handshake
+class record_cipher_t {
+    std::shared_ptr<EVP_CIPHER_CTX> ctx_;
+    u_char fixed_iv_[4];
+    uint64_t seq_;
+public:
+    static const size_t header_size_ = 5;
+    static const size_t explicit_nonce_size_ = 8;
+    static const size_t tag_size_ = 16;
+
+    record_cipher_t(const EVP_CIPHER *cipher, const u_char *key, const u_char *fixed_iv,
+                    uint64_t seq, bool encrypt);
+
+    // Writes one record for the data to out, which must have room for
+    // len + overhead() bytes. Returns the record size.
+    size_t seal(const u_char *data, size_t len, u_char *out);
+    // Decrypts the record at the start of the data and appends the
+    // plaintext to the target. Returns the record size.
+    size_t open(const u_char *data, size_t len, buf_t &target);
+
+    static size_t overhead() { return header_size_ + explicit_nonce_size_ + tag_size_; }
+};
+
+enum crypto_size_class_t {
+    CRYPTO_SIZE_SMALL,  // Up to 256 bytes: input events, acks, control
+    CRYPTO_SIZE_MEDIUM, // Up to 4K
+    CRYPTO_SIZE_LARGE,  // Video and audio fragments
+    CRYPTO_SIZE_CLASSES
+};
+
+// Timing of the record operations of one size class
+struct crypto_op_stats_t {
+    static const int latency_buckets_ = 32;
+    uint64_t ops_, bytes_;
+    // Time spent encrypting or decrypting, and waiting for the locks
+    uint64_t busy_ns_, lock_wait_ns_;
+    // Bucket N counts the operations that took at most 2^N ns in total
+    uint64_t latency_hist_[latency_buckets_];
+
+    crypto_op_stats_t since(const crypto_op_stats_t &prev) const;
+    // The upper bound of the latency percentile, in nanoseconds
+    uint64_t latency_percentile(double fraction) const;
+};
+
+struct crypto_stats_t {
+    crypto_op_stats_t encrypt_[CRYPTO_SIZE_CLASSES];
+    crypto_op_stats_t decrypt_[CRYPTO_SIZE_CLASSES];
+};
+
+// The live counters behind crypto_op_stats_t. They're updated with relaxed
+// atomics, so the timing adds no lock to the record path and a snapshot
+// is only consistent per counter.
+struct crypto_op_counters_t {
+    std::atomic<uint64_t> ops_, bytes_, busy_ns_, lock_wait_ns_;
+    std::atomic<uint64_t> latency_hist_[crypto_op_stats_t::latency_buckets_];
+
+    crypto_op_counters_t();
+    void add(size_t len, uint64_t busy_ns, uint64_t wait_ns, int bucket);
+    crypto_op_stats_t load() const;
+};
 
 class crypto_context_t {
+public:
+    typedef std::function<void(const std::shared_ptr<SSL_SESSION>&)> session_callback_t;
+private:
     std::shared_ptr<SSL> ssl_;
     std::shared_ptr<SSL_CTX> ssl_ctx_;
     //Raw pointer, as BIOs are managed by SSL
     BIO *read_bio_, *write_bio_;
     mutable std::mutex mutex_;
 
+    // Once the handshake is done the records can bypass SSL. Each
+    // direction then has its own state and lock, so the reader and the
+    // writer don't wait for each other.
+    bool allow_direct_records_;
+    std::atomic<bool> direct_records_;
+    std::unique_ptr<record_cipher_t> read_cipher_, write_cipher_;
+    std::mutex read_mutex_, write_mutex_;
+
+    bool handshake_started_, handshake_reported_;
+    std::chrono::steady_clock::time_point handshake_start_;
+    session_callback_t on_session_;
+
+    // One set per direction, padded apart so the reader and the writer
+    // don't share a cache line
+    crypto_op_counters_t encrypt_counters_[CRYPTO_SIZE_CLASSES];
+    u_char counters_padding_[64];
+    crypto_op_counters_t decrypt_counters_[CRYPTO_SIZE_CLASSES];
+
 public:
-    crypto_context_t(const std::string &cert, const std::string &pk);
+    // With allow_direct_records, the AES-GCM suites switch to the direct
+    // EVP record protection as soon as the handshake finishes. Other
+    // suites stay with SSL.
+    crypto_context_t(const std::string &cert, const std::string &pk,
+                     bool allow_direct_records = false);
+    // Shares an SSL context and offers the session for resumption, if set
+    crypto_context_t(const std::shared_ptr<SSL_CTX> &ssl_ctx,
+                     const std::shared_ptr<SSL_SESSION> &session,
+                     bool allow_direct_records);
+
+    // Receives the session once the handshake finishes
+    void set_session_callback(const session_callback_t &callback);
 
     bool is_handshake_finished() const;
     buf_t do_handshake(const buf_t &input, size_t pos);
 
     buf_t encrypt(const buf_t &input, size_t pos);
+    // Appends the encrypted data to the target, returns the number of bytes added
+    size_t encrypt_to(const u_char *data, size_t len, buf_t &target);
     buf_t decrypt(const buf_t &input, size_t pos);
+    // Appends the decrypted data to the target, returns the number of bytes added
+    size_t decrypt_to(const u_char *data, size_t len, buf_t &target);
+
+    crypto_stats_t get_stats();
 
 private:
     void ensure_handshake_state(bool expect_finished);
+    void finish_handshake();
+    void start_direct_records();
+
+    size_t seal_records(const u_char *data, size_t len, buf_t &target);
+    size_t ssl_encrypt(const u_char *data, size_t len, buf_t &target);
+    size_t open_records(const u_char *data, size_t len, buf_t &target);
+    size_t ssl_decrypt(const u_char *data, size_t len, buf_t &target);
+    void record_timing(crypto_op_counters_t *counters, size_t len,
+                       std::chrono::steady_clock::time_point start, uint64_t wait_ns);
+};
+
+// Lives across the reconnects. Keeps the certificate and the key parsed in
+// one SSL context, and remembers the sessions of the phones in memory and
+// optionally in a directory, so a reconnect needs only an abbreviated
+// handshake.
+class crypto_factory_t : public std::enable_shared_from_this<crypto_factory_t> {
+    std::shared_ptr<SSL_CTX> ssl_ctx_;
+    std::string session_dir_;
+    bool allow_direct_records_;
+
+    std::mutex mutex_;
+    std::map<std::string, std::shared_ptr<SSL_SESSION>> sessions_;
+public:
+    crypto_factory_t(const std::string &cert, const std::string &pk,
+                     const std::string &session_dir, bool allow_direct_records);
+
+    // The sessions are only cached for a non-empty peer id
+    std::shared_ptr<crypto_context_t> create_context(const std::string &peer_id);
+
+private:
+    std::shared_ptr<SSL_SESSION> find_session(const std::string &peer_id);
+    void store_session(const std::string &peer_id, const std::shared_ptr<SSL_SESSION> &session);
+    std::string session_path(const std::string &peer_id) const;
 };
 
 void init_crypto();
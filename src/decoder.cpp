@@ -3,6 +3,7 @@
 //
 
 #include "decoder.h"
+#include <tuple>
 
 extern "C" {
     #include <libavcodec/avcodec.h>
@@ -10,6 +11,9 @@ extern "C" {
     #include <libavutil/imgutils.h>
 };
 
+static_assert(AA_PACKET_TAILROOM >= FF_INPUT_BUFFER_PADDING_SIZE,
+              "Packets must have room for the decoder's input padding");
+
 void decoder_t::init_codecs() {
     avcodec_register_all();
 }
@@ -56,11 +60,12 @@ void decoder_t::run_loop() {
         while(!terminating_)
         {
             packet_ptr_t cur_packet;
+            std::chrono::steady_clock::time_point queued;
             {
                 std::unique_lock<std::mutex> l(queue_lock_);
                 if (!this->packets_.empty())
                 {
-                    cur_packet = this->packets_.front();
+                    std::tie(cur_packet, queued) = this->packets_.front();
                     this->packets_.pop();
                 } else
                     have_something_.wait(l);
@@ -68,7 +73,13 @@ void decoder_t::run_loop() {
             if (!cur_packet)
                 continue;
 
+            uint64_t queue_ns = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - queued).count());
             decode_frame(cur_packet);
+
+            std::unique_lock<std::mutex> l(callback_lock_);
+            if (consumed_callback_)
+                consumed_callback_(cur_packet, queue_ns);
         }
     } catch(const std::exception &ex)
     {
@@ -84,13 +95,16 @@ void decoder_t::run_loop() {
 void decoder_t::decode_frame(packet_ptr_t packet) {
     std::unique_lock<std::mutex> l(queue_lock_);
 
-    std::vector<u_char> padded;
-    padded.resize(packet->content_.size() - 2 + FF_INPUT_BUFFER_PADDING_SIZE);
-    std::copy(packet->content_.begin()+2, packet->content_.end(), padded.begin());
+    // The parser leaves enough room behind the content for the padding, so
+    // the frame is decoded in place without being copied
+    buf_t &content = packet->content_;
+    size_t size = content.size();
+    content.resize(size + FF_INPUT_BUFFER_PADDING_SIZE);
+    ON_BLOCK_EXIT([&]{content.resize(size);});
 
     int got_picture;
-    av_packet_->data = &padded.at(0);
-    av_packet_->size = (int) (packet->content_.size() - 2);
+    av_packet_->data = &content.at(2);
+    av_packet_->size = (int) (size - 2);
 
     int res = avcodec_decode_video2(codec_context_.get(), av_picture_.get(), &got_picture,
                               av_packet_.get());
@@ -112,10 +126,15 @@ void decoder_t::decode_frame(packet_ptr_t packet) {
 
 void decoder_t::submit_packet(packet_ptr_t packet) {
     std::unique_lock<std::mutex> l(queue_lock_);
-    this->packets_.push(packet);
+    this->packets_.push(std::make_pair(packet, std::chrono::steady_clock::now()));
     this->have_something_.notify_all();
 }
 
+void decoder_t::set_consumed_callback(consumed_callback_t callback) {
+    std::unique_lock<std::mutex> l(callback_lock_);
+    consumed_callback_ = callback;
+}
+
 buf_t decoder_t::get_frame(int tgt_width, int tgt_height) {
     std::unique_lock<std::mutex> l(queue_lock_);
     //std::unique_lock<std::mutex> sl(scaler_mutex_);
@@ -8,6 +8,8 @@
 #include "utils.h"
 #include <queue>
 #include <thread>
+#include <chrono>
+#include <functional>
 #include "aa_helpers.h"
 
 struct AVCodec;
@@ -25,6 +27,11 @@ typedef std::shared_ptr<frame_t> frame_ptr_t;
 
 
 class decoder_t {
+public:
+    // Called once the packet has been decoded, with the time it spent queued
+    typedef std::function<void(const packet_ptr_t &packet, uint64_t queue_ns)> consumed_callback_t;
+
+private:
     AVCodec* codec_;
     std::shared_ptr<AVPacket> av_packet_;
     std::shared_ptr<AVFrame> av_picture_;
@@ -35,7 +42,9 @@ class decoder_t {
 
     std::mutex queue_lock_;
     std::condition_variable have_something_;
-    std::queue<packet_ptr_t> packets_;
+    std::queue<std::pair<packet_ptr_t, std::chrono::steady_clock::time_point>> packets_;
+    std::mutex callback_lock_;
+    consumed_callback_t consumed_callback_;
     std::shared_ptr<AVFrame> last_frame_;
 
     std::thread decoder_thread_;
@@ -50,6 +59,8 @@ public:
     std::pair<size_t, size_t> get_dimensions();
     buf_t get_frame(int tgt_width, int tgt_height);
     void submit_packet(packet_ptr_t packet);
+    // Once this returns the previous callback is no longer running
+    void set_consumed_callback(consumed_callback_t callback);
     void check_for_errors();
 
     static void init_codecs();
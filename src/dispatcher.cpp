@@ -0,0 +1,194 @@
+#include "dispatcher.h"
+#include <chrono>
+
+const char *work_class_name(work_class_t work_class)
+{
+    static const char *names[WORK_CLASS_COUNT] = {"control", "video", "audio", "sensors"};
+    return names[work_class];
+}
+
+dispatcher_t::dispatcher_t(const notifier_t *terminator) :
+        terminator_(terminator), started_(false), stopping_(false), stats_()
+{
+    for(int f=0; f<WORK_CLASS_COUNT; ++f) {
+        workers_[f].capacity_ = 64;
+        workers_[f].overflow_fails_ = false;
+    }
+}
+
+dispatcher_t::~dispatcher_t()
+{
+    stopping_ = true;
+    for(int f=0; f<WORK_CLASS_COUNT; ++f) {
+        worker_t &worker = workers_[f];
+        {
+            std::unique_lock<std::mutex> l(worker.mutex_);
+            worker.not_empty_.notify_all();
+            worker.not_full_.notify_all();
+        }
+        if (worker.thread_.joinable())
+            worker.thread_.join();
+    }
+}
+
+void dispatcher_t::add_handler(u_char chan, uint16_t msg_type, work_class_t work_class,
+                               packet_handler_t handler)
+{
+    if (started_)
+        throw std::logic_error("The dispatcher is already running");
+    if (chan > AA_MAX_CHANNEL)
+        throw std::out_of_range("Bad channel");
+    routes_[chan][msg_type] = route_t{work_class, handler};
+}
+
+void dispatcher_t::set_queue_capacity(work_class_t work_class, size_t capacity,
+                                      bool overflow_fails)
+{
+    if (started_)
+        throw std::logic_error("The dispatcher is already running");
+    workers_[work_class].capacity_ = std::max<size_t>(capacity, 1);
+    workers_[work_class].overflow_fails_ = overflow_fails;
+}
+
+void dispatcher_t::set_error_callback(std::function<void()> on_error)
+{
+    std::lock_guard<std::mutex> l(stats_mutex_);
+    on_error_ = on_error;
+}
+
+void dispatcher_t::start()
+{
+    if (started_)
+        return;
+    started_ = true;
+
+    // Only the classes that have handlers get a thread
+    bool used[WORK_CLASS_COUNT] = {false};
+    for(const auto &chan_routes : routes_)
+        for(const auto &route : chan_routes)
+            used[route.second.work_class_] = true;
+
+    for(int f=0; f<WORK_CLASS_COUNT; ++f)
+        if (used[f])
+            workers_[f].thread_ = std::thread([](dispatcher_t *that, work_class_t cls) {
+                that->run_worker(cls);
+            }, this, work_class_t(f));
+}
+
+bool dispatcher_t::dispatch(const packet_ptr_t &packet)
+{
+    if (packet->chan_ > AA_MAX_CHANNEL)
+        return false;
+    const std::map<uint16_t, route_t> &chan_routes = routes_[packet->chan_];
+    auto iter = chan_routes.find(get_msg_type(packet->content_));
+    if (iter == chan_routes.end())
+        return false;
+
+    const route_t *route = &iter->second;
+    work_class_t cls = route->work_class_;
+    worker_t &worker = workers_[cls];
+
+    std::unique_lock<std::mutex> l(worker.mutex_);
+    if (worker.queue_.size() >= worker.capacity_) {
+        if (worker.overflow_fails_) {
+            str_out_t p;
+            p << "The peer has overrun the " << work_class_name(cls) << " queue of "
+              << worker.capacity_ << " messages";
+            throw std::runtime_error(p);
+        }
+        // Stall the reader rather than drop the message, the order of the
+        // messages matters to every handler
+        auto start = std::chrono::steady_clock::now();
+        while(worker.queue_.size() >= worker.capacity_) {
+            l.unlock();
+            terminator_->check_termination();
+            check_for_errors();
+            l.lock();
+            worker.not_full_.wait_for(l, std::chrono::milliseconds(int(full_poll_millis_)));
+        }
+        uint64_t waited = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count());
+
+        std::lock_guard<std::mutex> sl(stats_mutex_);
+        stats_.full_waits_[cls]++;
+        stats_.full_wait_ns_[cls] += waited;
+    }
+
+    worker.queue_.push_back(std::make_pair(packet, route));
+    size_t depth = worker.queue_.size();
+    worker.not_empty_.notify_one();
+    l.unlock();
+
+    std::lock_guard<std::mutex> sl(stats_mutex_);
+    stats_.max_queue_depth_[cls] = std::max(stats_.max_queue_depth_[cls], depth);
+    return true;
+}
+
+void dispatcher_t::run_worker(work_class_t work_class)
+{
+    TA_DEBUG() << "Dispatch worker for " << work_class_name(work_class) << " starts";
+    worker_t &worker = workers_[work_class];
+    try {
+        while(true)
+        {
+            std::pair<packet_ptr_t, const route_t*> item;
+            {
+                std::unique_lock<std::mutex> l(worker.mutex_);
+                while(worker.queue_.empty() && !stopping_)
+                    worker.not_empty_.wait(l);
+                if (stopping_)
+                    break;
+                item = worker.queue_.front();
+                worker.queue_.pop_front();
+                worker.not_full_.notify_one();
+            }
+
+            item.second->handler_(item.first);
+
+            std::lock_guard<std::mutex> sl(stats_mutex_);
+            stats_.handled_[work_class]++;
+        }
+    } catch(const std::exception &ex)
+    {
+        set_error(ex.what());
+    } catch(...)
+    {
+        set_error("Unknown error in dispatch worker");
+    }
+    TA_DEBUG() << "Dispatch worker for " << work_class_name(work_class) << " ends";
+}
+
+void dispatcher_t::set_error(const std::string &error)
+{
+    std::function<void()> on_error;
+    {
+        std::lock_guard<std::mutex> l(stats_mutex_);
+        if (error_.empty())
+            error_ = error;
+        on_error = on_error_;
+    }
+    if (on_error)
+        on_error();
+}
+
+void dispatcher_t::check_for_errors()
+{
+    std::lock_guard<std::mutex> l(stats_mutex_);
+    if (!error_.empty())
+        throw std::runtime_error(error_);
+}
+
+dispatch_stats_t dispatcher_t::get_stats()
+{
+    size_t depths[WORK_CLASS_COUNT];
+    for(int f=0; f<WORK_CLASS_COUNT; ++f) {
+        std::lock_guard<std::mutex> l(workers_[f].mutex_);
+        depths[f] = workers_[f].queue_.size();
+    }
+
+    std::lock_guard<std::mutex> l(stats_mutex_);
+    dispatch_stats_t res = stats_;
+    for(int f=0; f<WORK_CLASS_COUNT; ++f)
+        res.queue_depth_[f] = depths[f];
+    return res;
+}
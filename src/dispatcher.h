@@ -0,0 +1,98 @@
+#ifndef AAUTO_DISPATCHER_H
+#define AAUTO_DISPATCHER_H
+
+#include "utils.h"
+#include "aa_helpers.h"
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <map>
+#include <thread>
+
+// Each class of work runs on its own thread, so a slow video decoder or
+// audio sink doesn't hold back the control replies
+enum work_class_t {
+    WORK_CONTROL, // Channel setup, focus and the rest of the control protocol
+    WORK_VIDEO,
+    WORK_AUDIO,
+    WORK_SENSORS,
+    WORK_CLASS_COUNT
+};
+const char *work_class_name(work_class_t work_class);
+
+struct dispatch_stats_t {
+    uint64_t handled_[WORK_CLASS_COUNT];
+    size_t queue_depth_[WORK_CLASS_COUNT];
+    size_t max_queue_depth_[WORK_CLASS_COUNT];
+    // The reader had to wait for a full queue this many times
+    uint64_t full_waits_[WORK_CLASS_COUNT];
+    uint64_t full_wait_ns_[WORK_CLASS_COUNT];
+};
+
+// Routes the decrypted messages to the handlers registered for their
+// channel and message type. The messages are queued in the order they were
+// decrypted, and each class is handled by one worker, so the messages of
+// one class are handled in order.
+class dispatcher_t {
+public:
+    typedef std::function<void(const packet_ptr_t &packet)> packet_handler_t;
+
+private:
+    struct route_t {
+        work_class_t work_class_;
+        packet_handler_t handler_;
+    };
+
+    struct worker_t {
+        size_t capacity_;
+        bool overflow_fails_;
+        std::mutex mutex_;
+        std::condition_variable not_empty_, not_full_;
+        std::deque<std::pair<packet_ptr_t, const route_t*>> queue_;
+        std::thread thread_;
+    };
+
+    const notifier_t *terminator_;
+    // Handlers by message type for each channel
+    std::map<uint16_t, route_t> routes_[AA_MAX_CHANNEL + 1];
+    worker_t workers_[WORK_CLASS_COUNT];
+    bool started_;
+    std::atomic<bool> stopping_;
+
+    std::mutex stats_mutex_;
+    dispatch_stats_t stats_;
+    std::string error_;
+    std::function<void()> on_error_;
+
+    // The queue is checked for space this often while the reader is blocked
+    static const int full_poll_millis_ = 100;
+public:
+    explicit dispatcher_t(const notifier_t *terminator);
+    ~dispatcher_t();
+
+    // The handlers must be added before the dispatcher is started
+    void add_handler(u_char chan, uint16_t msg_type, work_class_t work_class,
+                     packet_handler_t handler);
+    // Bounds the number of messages waiting for the class's worker. A full
+    // queue stalls the reader, and with it every other class. For the flow
+    // controlled classes, where the peer can never fill the queue legally,
+    // overflow_fails makes it a protocol error instead.
+    void set_queue_capacity(work_class_t work_class, size_t capacity,
+                            bool overflow_fails = false);
+    // Called from the failed worker, the error is reported by check_for_errors
+    void set_error_callback(std::function<void()> on_error);
+    void start();
+
+    // Queues the packet for its handler, returns false if there's no
+    // handler. Blocks while the handler's queue is full, or throws if the
+    // class's overflow fails.
+    bool dispatch(const packet_ptr_t &packet);
+    void check_for_errors();
+    dispatch_stats_t get_stats();
+
+private:
+    void run_worker(work_class_t work_class);
+    void set_error(const std::string &error);
+};
+
+#endif //AAUTO_DISPATCHER_H
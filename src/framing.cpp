@@ -0,0 +1,212 @@
+#include "framing.h"
+
+ring_buffer_t::ring_buffer_t(size_t capacity) : mask_(capacity-1), head_(), tail_()
+{
+    if (capacity == 0 || (capacity & mask_) != 0)
+        throw std::invalid_argument("Ring buffer capacity must be a power of two");
+    data_.resize(capacity);
+}
+
+size_t ring_buffer_t::write(const u_char *data, size_t len)
+{
+    len = std::min(len, free_space());
+    size_t start = tail_ & mask_;
+    size_t first = std::min(len, capacity() - start);
+    memcpy(&data_[start], data, first);
+    memcpy(&data_[0], data + first, len - first);
+    tail_ += len;
+    return len;
+}
+
+size_t ring_buffer_t::free_regions(iovec regions[2])
+{
+    size_t len = free_space();
+    size_t start = tail_ & mask_;
+    size_t first = std::min(len, capacity() - start);
+    size_t res = 0;
+    if (first) {
+        regions[res].iov_base = &data_[start];
+        regions[res++].iov_len = first;
+    }
+    if (len != first) {
+        regions[res].iov_base = &data_[0];
+        regions[res++].iov_len = len - first;
+    }
+    return res;
+}
+
+void ring_buffer_t::commit(size_t len)
+{
+    assert(len <= free_space());
+    tail_ += len;
+}
+
+void ring_buffer_t::copy_to(size_t offset, size_t len, buf_t &target) const
+{
+    assert(offset + len <= size());
+    size_t start = (head_ + offset) & mask_;
+    size_t first = std::min(len, capacity() - start);
+    target.insert(target.end(), data_.begin() + start, data_.begin() + start + first);
+    target.insert(target.end(), data_.begin(), data_.begin() + (len - first));
+}
+
+void ring_buffer_t::consume(size_t len)
+{
+    assert(len <= size());
+    head_ += len;
+}
+
+packet_ptr_t frame_parser_t::next_packet()
+{
+    while(true)
+    {
+        // Channel + flags + 2 bytes of the fragment length
+        if (ring_.size() < 4)
+            return packet_ptr_t();
+
+        u_char chan = ring_.at(0);
+        u_char flags = ring_.at(1);
+        size_t packet_size = ring_.at(2) * 256 + ring_.at(3);
+
+        // The first fragment of a multi-packet series also carries the
+        // 32-bit size of the whole message
+        bool multi_first = (flags & AA_LAST_FRAG) == 0 && (flags & AA_FIRST_FRAG);
+        size_t header_size = multi_first ? 8 : 4;
+        if (ring_.size() < header_size + packet_size)
+            return packet_ptr_t();
+
+        if (chan > AA_MAX_CHANNEL) {
+            str_out_t p;
+            p << "Packet for unknown channel " << (uint)chan;
+            throw std::runtime_error(p);
+        }
+
+        packet_ptr_t &multi_packet = this->multi_packets_[chan];
+        packet_ptr_t cur_packet;
+        if (multi_first)
+        {
+            if (multi_packet)
+                throw std::runtime_error("Interleaved multi-packet: first fragment");
+
+            uint32_t full_size = (uint32_t(ring_.at(4)) << 24) | (uint32_t(ring_.at(5)) << 16) |
+                    (uint32_t(ring_.at(6)) << 8) | ring_.at(7);
+            // Don't trust the announced size before reserving memory for it.
+            // It counts plaintext bytes, so an encrypted fragment can be larger.
+            bool encrypted = (flags & AA_ENCRYPTED) != 0;
+            if ((!encrypted && full_size < packet_size) || full_size > max_message_size_) {
+                str_out_t p;
+                p << "Bad multi-packet size " << full_size << " on channel " << (uint)chan;
+                throw std::runtime_error(p);
+            }
+
+            cur_packet = alloc_packet(chan, flags & AA_ENCRYPTED, flags & AA_CONTROL_FLAG,
+                                      full_size + AA_PACKET_TAILROOM);
+            multi_packet = cur_packet;
+            multi_sizes_[chan] = full_size;
+        } else if (multi_packet)
+        {
+            cur_packet = multi_packet;
+        } else if ((flags & AA_FIRST_FRAG) == 0)
+        {
+            // A continuation of a message we've never seen the start of
+            TA_DEBUG() << "Dropping orphan fragment on channel " << (uint)chan;
+            ring_.consume(header_size + packet_size);
+            continue;
+        } else {
+            cur_packet = alloc_packet(chan, flags & AA_ENCRYPTED, flags & AA_CONTROL_FLAG,
+                                      packet_size + AA_PACKET_TAILROOM);
+        }
+
+        if (capture_) {
+            scratch_.clear();
+            ring_.copy_to(0, header_size + packet_size, scratch_);
+            capture_->record(CAPTURE_RAW_IN, chan, flags, scratch_.data(), scratch_.size());
+        }
+
+        if ((flags & AA_ENCRYPTED) && crypto_)
+        {
+            // Fragments of different channels can be interleaved, so they
+            // have to be decrypted in the order they arrive. The plaintext
+            // goes straight into the packet, within its reserved capacity.
+            scratch_.clear();
+            ring_.copy_to(header_size, packet_size, scratch_);
+            crypto_->decrypt_to(scratch_.data(), scratch_.size(), cur_packet->content_);
+        } else
+            ring_.copy_to(header_size, packet_size, cur_packet->content_);
+        ring_.consume(header_size + packet_size);
+
+        if (cur_packet == multi_packet && cur_packet->content_.size() > multi_sizes_[chan]) {
+            str_out_t p;
+            p << "Multi-packet on channel " << (uint)chan << " exceeds its announced size";
+            throw std::runtime_error(p);
+        }
+
+        if (flags & AA_LAST_FRAG) {
+            multi_packet = packet_ptr_t();
+            return cur_packet;
+        }
+    }
+}
+
+size_t fragment_wire_size(const packet_t &packet, size_t offset, size_t max_fragment)
+{
+    size_t total = packet.content_.size();
+    size_t len = std::min(total - offset, max_fragment);
+    bool multi_first = offset == 0 && len != total;
+    if (packet.encrypted_)
+        len += AA_MAX_RECORD_OVERHEAD;
+    return len + (multi_first ? 8 : 4);
+}
+
+size_t next_fragment_offset(const packet_t &packet, size_t offset, size_t max_fragment)
+{
+    return offset + std::min(packet.content_.size() - offset, max_fragment);
+}
+
+size_t append_fragment(const packet_t &packet, size_t offset, buf_t &target,
+                       crypto_context_t *crypto, size_t max_fragment)
+{
+    assert(max_fragment > 0 && max_fragment <= 0xFFFF - AA_MAX_RECORD_OVERHEAD);
+    size_t total = packet.content_.size();
+    size_t len = std::min(total - offset, max_fragment);
+
+    u_char flags = 0;
+    if (offset == 0)
+        flags |= AA_FIRST_FRAG;
+    if (offset + len == total)
+        flags |= AA_LAST_FRAG;
+    if (packet.encrypted_)
+        flags |= AA_ENCRYPTED;
+    if (packet.control_)
+        flags |= AA_CONTROL_FLAG;
+
+    size_t header_pos = target.size();
+    target.push_back(packet.chan_);
+    target.push_back(flags);
+    // The fragment length (big endian) is filled in once the data is written
+    target.push_back(0);
+    target.push_back(0);
+
+    // The first fragment of a series also carries the full message size,
+    // it always counts the plaintext bytes
+    if ((flags & AA_FIRST_FRAG) && !(flags & AA_LAST_FRAG)) {
+        uint32_t full_size = safe_cast<uint32_t>(total);
+        target.push_back(u_char(full_size >> 24));
+        target.push_back(u_char(full_size >> 16));
+        target.push_back(u_char(full_size >> 8));
+        target.push_back(u_char(full_size));
+    }
+
+    size_t data_len = len;
+    if (packet.encrypted_) {
+        if (!crypto)
+            throw std::logic_error("No crypto context for an encrypted packet");
+        data_len = crypto->encrypt_to(packet.content_.data() + offset, len, target);
+    } else
+        target.insert(target.end(), packet.content_.begin() + offset,
+                      packet.content_.begin() + offset + len);
+
+    target.at(header_pos+2) = safe_cast<u_char>(data_len / 256);
+    target.at(header_pos+3) = safe_cast<u_char>(data_len % 256);
+    return offset + len;
+}
@@ -0,0 +1,95 @@
+#ifndef AAUTO_FRAMING_H
+#define AAUTO_FRAMING_H
+
+#include "utils.h"
+#include "aa_helpers.h"
+#include "crypto.h"
+#include "capture.h"
+#include <assert.h>
+#include <sys/uio.h>
+
+// Fixed-capacity byte ring. Indices only ever grow, so consuming data never
+// moves any bytes around. Capacity must be a power of two.
+class ring_buffer_t {
+    buf_t data_;
+    size_t mask_, head_, tail_;
+public:
+    explicit ring_buffer_t(size_t capacity);
+
+    size_t size() const { return tail_ - head_; }
+    size_t capacity() const { return data_.size(); }
+    size_t free_space() const { return capacity() - size(); }
+
+    u_char at(size_t offset) const
+    {
+        assert(offset < size());
+        return data_[(head_ + offset) & mask_];
+    }
+
+    // Append as much of the data as fits, returns the number of bytes taken
+    size_t write(const u_char *data, size_t len);
+    // Describes the free space as at most two contiguous regions, so it can
+    // be filled in place by readv(). Returns the number of regions, the
+    // data becomes visible after commit().
+    size_t free_regions(iovec regions[2]);
+    void commit(size_t len);
+    // Append the [offset, offset+len) range to the target buffer
+    void copy_to(size_t offset, size_t len, buf_t &target) const;
+    void consume(size_t len);
+};
+
+// Splits the raw AA byte stream into packets, reassembling multi-fragment
+// messages along the way. Once a crypto context is set, encrypted fragments
+// are decrypted as they are parsed and packets carry the plaintext.
+class frame_parser_t {
+    ring_buffer_t ring_;
+    std::shared_ptr<crypto_context_t> crypto_;
+    capture_ptr_t capture_;
+    buf_t scratch_;
+    // Partially reassembled messages, fragments of different channels
+    // can be interleaved with each other
+    packet_ptr_t multi_packets_[AA_MAX_CHANNEL+1];
+    uint32_t multi_sizes_[AA_MAX_CHANNEL+1];
+public:
+    static const size_t default_capacity_ = 131072;
+    // The largest message we agree to reassemble
+    static const uint32_t max_message_size_ = 8*1024*1024;
+
+    explicit frame_parser_t(size_t capacity = default_capacity_) :
+            ring_(capacity), multi_sizes_() {}
+
+    void set_crypto(const std::shared_ptr<crypto_context_t> &crypto) { crypto_ = crypto; }
+    // Records every fragment as it's parsed
+    void set_capture(const capture_ptr_t &capture) { capture_ = capture; }
+
+    size_t feed(const u_char *data, size_t len) { return ring_.write(data, len); }
+    // Lets the stream be read straight into the parser's buffer
+    size_t free_regions(iovec regions[2]) { return ring_.free_regions(regions); }
+    void commit(size_t len) { ring_.commit(len); }
+    size_t free_space() const { return ring_.free_space(); }
+    size_t buffered() const { return ring_.size(); }
+
+    // Returns the next complete packet, or an empty pointer if more data
+    // is needed to finish it.
+    packet_ptr_t next_packet();
+};
+
+// The number of bytes the fragment starting at offset takes on the wire,
+// an upper bound for the encrypted fragments
+size_t fragment_wire_size(const packet_t &packet, size_t offset,
+                          size_t max_fragment = AA_MAX_FRAGMENT_SIZE);
+// The offset of the fragment following the one starting at offset, the
+// same value append_fragment returns
+size_t next_fragment_offset(const packet_t &packet, size_t offset,
+                            size_t max_fragment = AA_MAX_FRAGMENT_SIZE);
+
+// Appends the next fragment of the packet content starting at offset to the
+// target buffer, returns the offset of the following fragment. The result is
+// equal to the content size once the last fragment has been written.
+// Encrypted packets are encrypted straight into the target, right behind
+// the space left for the fragment header.
+size_t append_fragment(const packet_t &packet, size_t offset, buf_t &target,
+                       crypto_context_t *crypto = nullptr,
+                       size_t max_fragment = AA_MAX_FRAGMENT_SIZE);
+
+#endif //AAUTO_FRAMING_H
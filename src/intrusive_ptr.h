@@ -0,0 +1,60 @@
+#ifndef AAUTO_INTRUSIVE_PTR_H
+#define AAUTO_INTRUSIVE_PTR_H
+
+#include <utility>
+
+// Smart pointer for objects that keep their own reference count. The
+// pointee type must provide intrusive_add_ref(T*) and intrusive_release(T*)
+// functions, found by ADL.
+template<class T> class intrusive_ptr_t
+{
+    T *ptr_;
+public:
+    intrusive_ptr_t() : ptr_(nullptr) {}
+
+    explicit intrusive_ptr_t(T *p) : ptr_(p)
+    {
+        if (ptr_) intrusive_add_ref(ptr_);
+    }
+
+    intrusive_ptr_t(const intrusive_ptr_t &other) : ptr_(other.ptr_)
+    {
+        if (ptr_) intrusive_add_ref(ptr_);
+    }
+
+    intrusive_ptr_t(intrusive_ptr_t &&other) : ptr_(other.ptr_)
+    {
+        other.ptr_ = nullptr;
+    }
+
+    ~intrusive_ptr_t()
+    {
+        if (ptr_) intrusive_release(ptr_);
+    }
+
+    intrusive_ptr_t& operator = (intrusive_ptr_t other)
+    {
+        std::swap(ptr_, other.ptr_);
+        return *this;
+    }
+
+    void reset()
+    {
+        intrusive_ptr_t().swap(*this);
+    }
+
+    void swap(intrusive_ptr_t &other)
+    {
+        std::swap(ptr_, other.ptr_);
+    }
+
+    T* get() const { return ptr_; }
+    T& operator *() const { return *ptr_; }
+    T* operator ->() const { return ptr_; }
+    explicit operator bool() const { return ptr_ != nullptr; }
+
+    bool operator == (const intrusive_ptr_t &o) const { return ptr_ == o.ptr_; }
+    bool operator != (const intrusive_ptr_t &o) const { return ptr_ != o.ptr_; }
+};
+
+#endif //AAUTO_INTRUSIVE_PTR_H
@@ -1,29 +1,58 @@
 #include <iostream>
 #include "transport.h"
+#include "socket_transport.h"
+#include "replay_transport.h"
 #include <fstream>
+#include <map>
 #include "crypto.h"
 #include "proto.h"
 #include "decoder.h"
+#include "sdl_audio_output.h"
+#include "sdl_audio_input.h"
 
 #include <SDL2/SDL.h>
 
+struct app_options_t {
+    // Connect over a socket or replay a capture instead of USB if set
+    std::string address_;
+    std::string capture_path_;
+    // Where the SSL sessions are kept across restarts, memory only if empty
+    std::string session_dir_;
+    bool direct_crypto_;
+    // Consume the audio without playing it
+    bool null_audio_;
+    // Raw PCM played in place of the microphone
+    std::string mic_file_;
+};
+
 class AppWindow {
     SDL_Window *window_;
     usb_context_ptr_t usb_ctx_;
     Uint32 new_frame_event_, proto_state_event_;
 
     notifier_t terminator_;
-    std::string cert_, pk_;
+    std::shared_ptr<crypto_factory_t> crypto_factory_;
+    app_options_t options_;
+    capture_ptr_t capture_;
 
     std::thread proto_thread_;
     std::mutex proto_mutex_;
     std::shared_ptr<decoder_t> decoder_;
     std::shared_ptr<proto_t> proto_;
+
+    // Pointer ids of the fingers on the touchscreen, the mouse has its own
+    std::map<SDL_FingerID, uint32_t> finger_ids_;
+    static const uint32_t mouse_pointer_id_ = 0;
 public:
 
-    AppWindow(const std::string &cert, const std::string &pk) :
-        cert_(cert), pk_(pk), window_(0)
+    AppWindow(const std::string &cert, const std::string &pk, const app_options_t &options) :
+        window_(0), options_(options)
     {
+        crypto_factory_ = std::make_shared<crypto_factory_t>(cert, pk, options_.session_dir_,
+                                                             options_.direct_crypto_);
+        if (!options_.capture_path_.empty())
+            capture_.reset(new capture_t(options_.capture_path_));
+
         new_frame_event_ = SDL_RegisterEvents(1);
         proto_state_event_ = SDL_RegisterEvents(1);
 
@@ -62,10 +91,70 @@ public:
         std::unique_lock<std::mutex> l(proto_mutex_);
         decoder_ = std::shared_ptr<decoder_t>(new decoder_t(new_frame_callback));
 
-        std::shared_ptr<crypto_context_t> crypto(new crypto_context_t(cert_, pk_));
-        auto trans = find_usb_transport(usb_ctx_, &terminator_);
+        transport_ptr_t trans = open_transport();
+        if (capture_)
+            trans->set_capture(capture_);
+        auto crypto = crypto_factory_->create_context(trans->get_peer_id());
+
+        bool sdl_audio = init_sdl_audio();
+        proto_ = std::shared_ptr<proto_t>(new proto_t(trans, crypto, &terminator_, decoder_,
+                                                      make_audio_output(sdl_audio),
+                                                      make_mic_input(sdl_audio)));
+    }
+
+    bool init_sdl_audio()
+    {
+        if (options_.null_audio_)
+            return false;
+        if (SDL_InitSubSystem(SDL_INIT_AUDIO) != 0) {
+            std::cerr << "Can't initialize the audio, it won't be played: "
+                      << SDL_GetError() << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    audio_output_factory_t make_audio_output(bool sdl_audio)
+    {
+        return [sdl_audio](const audio_format_t &format,
+                           audio_output_t::render_t render) -> audio_output_ptr_t {
+            if (sdl_audio) {
+                try {
+                    return std::make_shared<sdl_audio_output_t>(format, render);
+                } catch(const std::exception &ex)
+                {
+                    std::cerr << ex.what() << ", the audio won't be played" << std::endl;
+                }
+            }
+            return std::make_shared<null_audio_output_t>(format, render);
+        };
+    }
 
-        proto_ = std::shared_ptr<proto_t>(new proto_t(trans, crypto, &terminator_, decoder_));
+    audio_input_factory_t make_mic_input(bool sdl_audio)
+    {
+        std::string mic_file = options_.mic_file_;
+        return [sdl_audio, mic_file](const audio_format_t &format,
+                                     audio_input_t::capture_t capture) -> audio_input_ptr_t {
+            // Without a sound card the phone hears silence
+            if (sdl_audio && mic_file.empty())
+                return std::make_shared<sdl_audio_input_t>(format, capture);
+            return std::make_shared<file_audio_input_t>(format, capture, mic_file);
+        };
+    }
+
+    transport_ptr_t open_transport()
+    {
+        static const std::string replay = "replay:", replay_fast = "replay-fast:";
+        const std::string &address = options_.address_;
+        if (address.empty())
+            return find_usb_transport(usb_ctx_, &terminator_);
+        if (address.compare(0, replay.size(), replay) == 0)
+            return transport_ptr_t(new replay_transport_t(address.substr(replay.size()),
+                                                          &terminator_, true));
+        if (address.compare(0, replay_fast.size(), replay_fast) == 0)
+            return transport_ptr_t(new replay_transport_t(address.substr(replay_fast.size()),
+                                                          &terminator_, false));
+        return open_socket_transport(address, &terminator_);
     }
 
     void run_event_loop()
@@ -86,9 +175,7 @@ public:
                     render_frame();
                 }
 
-                if (event.type == SDL_MOUSEBUTTONUP ||
-                        event.type == SDL_MOUSEBUTTONDOWN)
-                    notify_mouse(event);
+                notify_touch(event);
             } catch(const std::exception &ex)
             {
                 std::cerr << "Unexpected error: " << ex.what();
@@ -100,10 +187,96 @@ public:
         SDL_HideWindow(window_);
     }
 
-    void notify_mouse(SDL_Event ev)
+    // Forwards the mouse and the touch events to the phone, the mouse is
+    // a single pointer that's down while the left button is pressed
+    void notify_touch(const SDL_Event &ev)
     {
-        std::unique_lock<std::mutex> l(proto_mutex_);
-        proto_->notify_mouse(ev.button.x, ev.button.y, ev.button.state == SDL_PRESSED);
+        int width, height;
+        SDL_GetWindowSize(window_, &width, &height);
+        if (width <= 0 || height <= 0)
+            return;
+
+        switch(ev.type)
+        {
+            case SDL_MOUSEBUTTONDOWN:
+            case SDL_MOUSEBUTTONUP:
+            case SDL_MOUSEMOTION: {
+                // Touches are handled below, not through the emulated mouse
+                Uint32 which = ev.type == SDL_MOUSEMOTION ? ev.motion.which : ev.button.which;
+                if (which == SDL_TOUCH_MOUSEID)
+                    return;
+                int x = ev.type == SDL_MOUSEMOTION ? ev.motion.x : ev.button.x;
+                int y = ev.type == SDL_MOUSEMOTION ? ev.motion.y : ev.button.y;
+                x = x * AA_TOUCHSCREEN_WIDTH / width;
+                y = y * AA_TOUCHSCREEN_HEIGHT / height;
+
+                std::unique_lock<std::mutex> l(proto_mutex_);
+                if (!proto_)
+                    return;
+                touch_input_t &touch = proto_->get_touch();
+                if (ev.type == SDL_MOUSEMOTION) {
+                    if (ev.motion.state & SDL_BUTTON_LMASK)
+                        touch.pointer_move(mouse_pointer_id_, x, y);
+                } else if (ev.button.button == SDL_BUTTON_LEFT) {
+                    if (ev.type == SDL_MOUSEBUTTONDOWN)
+                        touch.pointer_down(mouse_pointer_id_, x, y);
+                    else
+                        touch.pointer_up(mouse_pointer_id_, x, y);
+                }
+                break;
+            }
+            case SDL_FINGERDOWN:
+            case SDL_FINGERUP:
+            case SDL_FINGERMOTION: {
+                int x = int(ev.tfinger.x * AA_TOUCHSCREEN_WIDTH);
+                int y = int(ev.tfinger.y * AA_TOUCHSCREEN_HEIGHT);
+                uint32_t id = finger_pointer_id(ev.tfinger.fingerId, ev.type == SDL_FINGERDOWN);
+
+                std::unique_lock<std::mutex> l(proto_mutex_);
+                if (!proto_)
+                    return;
+                touch_input_t &touch = proto_->get_touch();
+                if (ev.type == SDL_FINGERDOWN)
+                    touch.pointer_down(id, x, y);
+                else if (ev.type == SDL_FINGERMOTION)
+                    touch.pointer_move(id, x, y);
+                else {
+                    touch.pointer_up(id, x, y);
+                    finger_ids_.erase(ev.tfinger.fingerId);
+                }
+                break;
+            }
+            case SDL_WINDOWEVENT:
+                if (ev.window.event == SDL_WINDOWEVENT_FOCUS_LOST) {
+                    std::unique_lock<std::mutex> l(proto_mutex_);
+                    finger_ids_.clear();
+                    if (proto_)
+                        proto_->get_touch().cancel();
+                }
+                break;
+        }
+    }
+
+    // The phone expects small pointer ids, SDL's finger ids are arbitrary
+    uint32_t finger_pointer_id(SDL_FingerID finger, bool allocate)
+    {
+        auto iter = finger_ids_.find(finger);
+        if (iter != finger_ids_.end() || !allocate)
+            return iter != finger_ids_.end() ? iter->second : UINT32_MAX;
+
+        uint32_t id = mouse_pointer_id_ + 1;
+        bool taken = true;
+        while(taken) {
+            taken = false;
+            for(const auto &cur : finger_ids_)
+                if (cur.second == id) {
+                    taken = true;
+                    id++;
+                    break;
+                }
+        }
+        finger_ids_[finger] = id;
+        return id;
     }
 
     void run_proto_loop()
@@ -112,6 +285,14 @@ public:
             try {
                 init_decoder();
                 proto_->run_loop();
+            } catch(const end_of_stream_exception &ex)
+            {
+                // The replay is over, close the window like the user would
+                std::cerr << ex.what() << std::endl;
+                SDL_Event quit = SDL_Event();
+                quit.type = SDL_QUIT;
+                SDL_PushEvent(&quit);
+                break;
             } catch(const std::exception &ex)
             {
                 std::cerr << "Exception: " << ex.what() << std::endl;
@@ -168,8 +349,28 @@ int main(int argc, char **argv) {
         exit(1);
     }
 
+    // Optional transport address, e.g. tcp-listen:5277, unix:/tmp/aa.sock
+    // or replay:session.cap, and the file to capture the session into
+    app_options_t options = {std::string(), std::string(), std::string(), false, false,
+                             std::string()};
+    for(int f=1; f<argc; ++f) {
+        std::string arg(argv[f]);
+        if (arg == "--capture" && f+1 < argc)
+            options.capture_path_ = argv[++f];
+        else if (arg == "--session-dir" && f+1 < argc)
+            options.session_dir_ = argv[++f];
+        else if (arg == "--direct-crypto")
+            options.direct_crypto_ = true;
+        else if (arg == "--null-audio")
+            options.null_audio_ = true;
+        else if (arg == "--mic-file" && f+1 < argc)
+            options.mic_file_ = argv[++f];
+        else
+            options.address_ = arg;
+    }
+
     try {
-        AppWindow window(cert, pk);
+        AppWindow window(cert, pk, options);
         window.run_event_loop();
     } catch(const std::exception &ex)
     {
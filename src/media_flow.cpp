@@ -0,0 +1,58 @@
+#include "media_flow.h"
+
+media_ack_window_t::media_ack_window_t(uint32_t window) : session_(), stats_()
+{
+    stats_.window_ = window;
+}
+
+uint32_t media_ack_window_t::get_window()
+{
+    std::lock_guard<std::mutex> l(mutex_);
+    return stats_.window_;
+}
+
+void media_ack_window_t::set_session(uint32_t session)
+{
+    std::lock_guard<std::mutex> l(mutex_);
+    session_ = session;
+}
+
+uint32_t media_ack_window_t::get_session()
+{
+    std::lock_guard<std::mutex> l(mutex_);
+    return session_;
+}
+
+void media_ack_window_t::reset()
+{
+    std::lock_guard<std::mutex> l(mutex_);
+    stats_.in_flight_ = 0;
+}
+
+void media_ack_window_t::on_received()
+{
+    std::lock_guard<std::mutex> l(mutex_);
+    stats_.received_++;
+    stats_.in_flight_++;
+    stats_.max_in_flight_ = std::max(stats_.max_in_flight_, stats_.in_flight_);
+    if (stats_.in_flight_ == stats_.window_ + 1)
+        TA_INFO() << "The phone has exceeded the media window of " << stats_.window_;
+}
+
+uint32_t media_ack_window_t::on_consumed(uint64_t queue_ns)
+{
+    std::lock_guard<std::mutex> l(mutex_);
+    if (stats_.in_flight_ == 0)
+        return 0;
+    stats_.in_flight_--;
+    stats_.acked_++;
+    stats_.queue_ns_total_ += queue_ns;
+    stats_.max_queue_ns_ = std::max(stats_.max_queue_ns_, queue_ns);
+    return 1;
+}
+
+media_flow_stats_t media_ack_window_t::get_stats()
+{
+    std::lock_guard<std::mutex> l(mutex_);
+    return stats_;
+}
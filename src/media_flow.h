@@ -0,0 +1,47 @@
+#ifndef AAUTO_MEDIA_FLOW_H
+#define AAUTO_MEDIA_FLOW_H
+
+#include "utils.h"
+
+// About a quarter of a second of 30fps video may wait for the decoder
+static const uint32_t VIDEO_MAX_UNACKED = 8;
+// The window bounds the frames waiting for the video worker. A restarted
+// stream can overlap the old one's frames and the codec data isn't
+// counted, the rest is room for them. Anything beyond that is the
+// phone ignoring the window.
+static const size_t VIDEO_QUEUE_CAPACITY = 3 * VIDEO_MAX_UNACKED;
+
+struct media_flow_stats_t {
+    uint32_t window_;
+    // Received but not consumed yet, the phone can't send more than the window
+    uint32_t in_flight_, max_in_flight_;
+    uint64_t received_, acked_;
+    // Time the consumed frames spent waiting in the queue
+    uint64_t queue_ns_total_, max_queue_ns_;
+};
+
+// Credit-based flow control of a media channel. The phone may have at most
+// window frames unacked, and a frame is acked only once its consumer is
+// done with it, so a slow consumer slows the phone down instead of letting
+// the queue grow.
+class media_ack_window_t {
+    std::mutex mutex_;
+    uint32_t session_;
+    media_flow_stats_t stats_;
+public:
+    explicit media_ack_window_t(uint32_t window);
+
+    uint32_t get_window();
+    // The media session the acks refer to, set by the media start request
+    void set_session(uint32_t session);
+    uint32_t get_session();
+
+    // Forgets the frames in flight, when the stream stops
+    void reset();
+    void on_received();
+    // Returns the number of frames to ack
+    uint32_t on_consumed(uint64_t queue_ns);
+    media_flow_stats_t get_stats();
+};
+
+#endif //AAUTO_MEDIA_FLOW_H
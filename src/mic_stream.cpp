@@ -0,0 +1,138 @@
+#include "mic_stream.h"
+
+mic_stream_t::mic_stream_t(audio_input_factory_t input_factory, sender_t send) :
+        input_factory_(input_factory), send_(send), open_(false), session_(),
+        max_unacked_(default_max_unacked_), stats_()
+{
+}
+
+mic_stream_t::~mic_stream_t()
+{
+    close();
+}
+
+bool mic_stream_t::open(uint32_t max_unacked)
+{
+    close();
+    if (!input_) {
+        try {
+            input_ = input_factory_(get_format(), [this](const u_char *data, size_t len) {
+                on_captured(data, len);
+            });
+        } catch(const std::exception &ex)
+        {
+            TA_INFO() << "No microphone: " << ex.what();
+            return false;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> l(mutex_);
+        open_ = true;
+        session_++;
+        max_unacked_ = max_unacked ? max_unacked : default_max_unacked_;
+    }
+    input_->start();
+    return true;
+}
+
+void mic_stream_t::close()
+{
+    {
+        std::lock_guard<std::mutex> l(mutex_);
+        if (!open_)
+            return;
+        open_ = false;
+    }
+    // Without the lock, the capture callback takes it
+    input_->stop();
+
+    std::lock_guard<std::mutex> l(mutex_);
+    // A partial chunk is stale by the next session
+    chunk_.reset();
+    sent_.clear();
+    stats_.in_flight_ = 0;
+}
+
+uint32_t mic_stream_t::get_session()
+{
+    std::lock_guard<std::mutex> l(mutex_);
+    return session_;
+}
+
+void mic_stream_t::on_ack(uint32_t count)
+{
+    auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> l(mutex_);
+    for(; count > 0 && !sent_.empty(); --count)
+    {
+        uint64_t ack_ns = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                now - sent_.front()).count());
+        sent_.pop_front();
+        stats_.acked_++;
+        stats_.ack_ns_total_ += ack_ns;
+        stats_.max_ack_ns_ = std::max(stats_.max_ack_ns_, ack_ns);
+    }
+    stats_.in_flight_ = uint32_t(sent_.size());
+}
+
+mic_stats_t mic_stream_t::get_stats()
+{
+    std::lock_guard<std::mutex> l(mutex_);
+    return stats_;
+}
+
+void mic_stream_t::on_captured(const u_char *data, size_t len)
+{
+    const size_t chunk_bytes = get_format().bytes_for_millis(chunk_millis_);
+    std::unique_lock<std::mutex> l(mutex_);
+    if (!open_)
+        return;
+
+    while(len > 0)
+    {
+        if (!chunk_) {
+            // Media data, unlike the other messages with a one-byte type,
+            // doesn't carry the control flag
+            chunk_ = alloc_packet(AA_MIC_CHANNEL, true, false, 2 + 8 + chunk_bytes);
+            chunk_->content_.push_back(u_char(AA_MEDIA_DATA >> 8));
+            chunk_->content_.push_back(u_char(AA_MEDIA_DATA));
+            // Microseconds, big-endian
+            uint64_t timestamp = uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count());
+            for(int f = 7; f >= 0; --f)
+                chunk_->content_.push_back(u_char(timestamp >> (f * 8)));
+        }
+        size_t filled = chunk_->content_.size() - AA_MEDIA_DATA_OFFSET;
+        size_t part = std::min(chunk_bytes - filled, len);
+        chunk_->content_.insert(chunk_->content_.end(), data, data + part);
+        data += part;
+        len -= part;
+        if (filled + part == chunk_bytes)
+            finish_chunk_locked();
+    }
+    l.unlock();
+
+    // The sender only queues the chunks, they are written by the protocol
+    // thread rather than the capture thread. Only the capture thread gets
+    // here, so ready_ is ours.
+    for(const packet_ptr_t &chunk : ready_)
+        send_(chunk);
+    ready_.clear();
+}
+
+// Must be called with mutex_ held
+void mic_stream_t::finish_chunk_locked()
+{
+    packet_ptr_t chunk = chunk_;
+    chunk_.reset();
+    if (sent_.size() >= max_unacked_) {
+        stats_.chunks_dropped_++;
+        return;
+    }
+    sent_.push_back(std::chrono::steady_clock::now());
+    stats_.chunks_sent_++;
+    stats_.in_flight_ = uint32_t(sent_.size());
+    stats_.max_in_flight_ = std::max(stats_.max_in_flight_, stats_.in_flight_);
+    ready_.push_back(chunk);
+}
@@ -0,0 +1,69 @@
+#ifndef AAUTO_MIC_STREAM_H
+#define AAUTO_MIC_STREAM_H
+
+#include "utils.h"
+#include "aa_helpers.h"
+#include "audio_input.h"
+#include <chrono>
+#include <deque>
+
+struct mic_stats_t {
+    uint64_t chunks_sent_, chunks_dropped_, acked_;
+    uint32_t in_flight_, max_in_flight_;
+    // From sending a chunk to its ack
+    uint64_t ack_ns_total_, max_ack_ns_;
+};
+
+// Streams the microphone to the phone while it has the microphone open.
+// The captured audio goes out in chunks of chunk_millis_, each queued the
+// moment it's full and stamped with the capture time of its first frame.
+// Nothing is queued when the phone falls behind on the acks: a chunk that
+// doesn't fit in the window is dropped, so the voice latency stays at a
+// chunk plus the capture device's period.
+class mic_stream_t {
+public:
+    // Called on the capture thread, it must queue the packet rather than
+    // write it
+    typedef std::function<void(const packet_ptr_t &packet)> sender_t;
+
+private:
+    audio_input_factory_t input_factory_;
+    sender_t send_;
+    // Opened on the first use, only the protocol's worker touches it
+    audio_input_ptr_t input_;
+
+    std::mutex mutex_;
+    bool open_;
+    uint32_t session_, max_unacked_;
+    // The chunk being filled, if any
+    packet_ptr_t chunk_;
+    // Send times of the unacked chunks
+    std::deque<std::chrono::steady_clock::time_point> sent_;
+    mic_stats_t stats_;
+    // Full chunks, handed to the sender once the lock is released
+    std::vector<packet_ptr_t> ready_;
+
+    static const uint32_t chunk_millis_ = 20;
+    static const uint32_t default_max_unacked_ = 4;
+public:
+    // 16kHz mono, what the phone expects for the voice
+    static audio_format_t get_format() { return audio_format_t{16000, 1}; }
+
+    mic_stream_t(audio_input_factory_t input_factory, sender_t send);
+    ~mic_stream_t();
+
+    // Starts the capture for a new session, returns false if there's no
+    // microphone. A max_unacked of zero picks the default window.
+    bool open(uint32_t max_unacked);
+    void close();
+    uint32_t get_session();
+    // Acks the oldest chunks in flight
+    void on_ack(uint32_t count);
+    mic_stats_t get_stats();
+
+private:
+    void on_captured(const u_char *data, size_t len);
+    void finish_chunk_locked();
+};
+
+#endif //AAUTO_MIC_STREAM_H
@@ -0,0 +1,65 @@
+#include "paced_worker.h"
+
+paced_worker_t::paced_worker_t(uint32_t period_millis, handler_t handler) :
+        period_(period_millis), handler_(handler), running_(false), terminating_(false),
+        busy_(false)
+{
+    thread_ = std::thread([](paced_worker_t *that){that->run();}, this);
+}
+
+paced_worker_t::~paced_worker_t()
+{
+    {
+        std::lock_guard<std::mutex> l(mutex_);
+        terminating_ = true;
+        changed_.notify_all();
+    }
+    thread_.join();
+}
+
+void paced_worker_t::start()
+{
+    std::lock_guard<std::mutex> l(mutex_);
+    running_ = true;
+    changed_.notify_all();
+}
+
+void paced_worker_t::stop()
+{
+    std::unique_lock<std::mutex> l(mutex_);
+    running_ = false;
+    changed_.notify_all();
+    while(busy_)
+        changed_.wait(l);
+}
+
+void paced_worker_t::run()
+{
+    auto next = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> l(mutex_);
+    while(true)
+    {
+        if (!running_ && !terminating_) {
+            while(!running_ && !terminating_)
+                changed_.wait(l);
+            next = std::chrono::steady_clock::now();
+        }
+        if (terminating_)
+            break;
+
+        next += period_;
+        while(running_ && !terminating_ && std::chrono::steady_clock::now() < next)
+            changed_.wait_until(l, next);
+        if (terminating_)
+            break;
+        if (!running_)
+            continue;
+
+        busy_ = true;
+        l.unlock();
+        handler_();
+        l.lock();
+        busy_ = false;
+        changed_.notify_all();
+    }
+}
@@ -0,0 +1,38 @@
+#ifndef AAUTO_PACED_WORKER_H
+#define AAUTO_PACED_WORKER_H
+
+#include "utils.h"
+#include <chrono>
+#include <functional>
+#include <thread>
+
+// Calls the handler from its own thread at the end of every period while
+// it's started, at the pace of a sound card. Stands in for the audio
+// devices in the headless sessions.
+class paced_worker_t {
+public:
+    typedef std::function<void()> handler_t;
+
+private:
+    const std::chrono::milliseconds period_;
+    handler_t handler_;
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    bool running_, terminating_;
+    // Set while handler_ runs
+    bool busy_;
+    std::thread thread_;
+
+public:
+    paced_worker_t(uint32_t period_millis, handler_t handler);
+    ~paced_worker_t();
+
+    void start();
+    // The handler isn't running anymore once this returns
+    void stop();
+
+private:
+    void run();
+};
+
+#endif //AAUTO_PACED_WORKER_H
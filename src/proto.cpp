@@ -4,224 +4,594 @@
 
 #include "proto.h"
 #include "aa_helpers.h"
+#include "aa_messages.h"
 #include "decoder.h"
 
-const static std::vector<u_char> discovery_data={
-    // CH 1 Sensors:                      //cq/co[]
-    0x0A, 4 + 4*1,  // co: int, cm/cn[]
-                  0x08, AA_SENSOR_CHANNEL,
-                  0x12, 4*1,
-                            //0x0A, 2, 0x08, 7,   // SENSOR_TYPE_GEAR           6
-                            0x0A, 2, 0x08, 11,  // SENSOR_TYPE_DRIVING_STATUS 12
-    // CH 2 Video Sink:
-    0x0A, 4+4+11, 0x08, AA_VIDEO_CHANNEL,
-                  0x1A, 4+11,  // Sink: Video
-                            0x08, 3,    // int (codec type) 3 = Video
-                            0x22, 11,   // Res        FPS, WidMar, HeiMar, DPI
-                            0x08, 1, 0x10, 1, 0x18, 0, 0x20, 0, 0x28, -96 & 0xFF, 1,   // 800x 480, 30 fps, 0, 0, 160 dpi    0xa0 // Default 160 like 4100NEX
-                            // 0x08, 1, 0x10, 1, 0x18, 0, 0x20, 0, 0x28, -128, 1,   //0x30, 0,     //  800x 480, 30 fps, 0, 0, 128 dpi    0x80 // 160-> 128 Small, phone/music close to outside
-                            // 0x08, 1, 0x10, 1, 0x18, 0, 0x20, 0, 0x28,  -16, 1,   //0x30, 0,     //  800x 480, 30 fps, 0, 0, 240 dpi    0xf0 // 160-> 240 Big, phone/music close to center
-                            // 60 FPS makes little difference:
-                            // 0x08, 1, 0x10, 2, 0x18, 0, 0x20, 0, 0x28,  -96, 1,   //0x30, 0,     //  800x 480, 60 fps, 0, 0, 160 dpi    0xa0
-                            // Higher resolutions don't seem to work as of June 10, 2015 release of AA:
-                            // 0x08, 2, 0x10, 1, 0x18, 0, 0x20, 0, 0x28,  -96, 1,   //0x30, 0,     // 1280x 720, 30 fps, 0, 0, 160 dpi    0xa0
-                            // 0x08, 3, 0x10, 1, 0x18, 0, 0x20, 0, 0x28,  -96, 1,   //0x30, 0,     // 1920x1080, 30 fps, 0, 0, 160 dpi    0xa0
-    // Crashes on null Point reference without:
-    0x0A, 4+2+6,  // CH 3 TouchScreen/Input:
-                0x08, AA_TOUCHSCREEN_CHANNEL,
-                0x22, 2+6,
-                        0x12, 6,
-                        0x08, -96 & 0xFF, 6, 0x10, -32 & 0xFF, 3, // 800x 480
-                        // 0x08, -128, 10,    0x10, -48, 5,       // 1280x 720     0x80, 0x0a   0xd0, 5
-                        // 0x08, -128, 15,    0x10, -72, 8,       // 1920x1080     0x80, 0x0f   0xb8, 8
-
-    0x12, 4, 'T', 'S', 'L', 'A',  // Car Manuf          Part of "remembered car"
-    0x1A, 4, 'M', 'D', 'L', 'S',  // Car Model
-    0x22, 4, '2', '0', '1', '6',  // Car Year           Part of "remembered car"
-    0x2A, 4, '0', '0', '0', '1',  // Car Serial     Not Part of "remembered car" ??     (vehicleId=null)
-    0x30, 1,  // driverPosition
-    0x3A, 4, 'A', 'l', 'e', 'x',  // HU  Make / Manuf
-    0x42, 4, 'T', 'S', 'L', 'A',  // HU  Model
-    0x4A, 4, 'B', 'L', 'D', '1',  // HU  SoftwareBuild
-    0x52, 4, 'V', '0', '0', '1',  // HU  SoftwareVersion
-    0x58, 0,  // ? bool (or int )    canPlayNativeMediaDuringVr
-    0x60, 0,  // mHideProjectedClock     1 = True = Hide
+struct audio_channel_info_t {
+    aa_audio_type_t type_;
+    audio_format_t format_;
+    audio_duck_t duck_;
 };
 
+// The audio sinks, starting from AA_AUDIO0_CHANNEL
+static const audio_channel_info_t audio_channel_info[AA_AUDIO_CHANNEL_COUNT] = {
+    {AA_AUDIO_TYPE_MEDIA, {48000, 2}, AUDIO_DUCK_MEDIA},
+    {AA_AUDIO_TYPE_SPEECH, {16000, 1}, AUDIO_DUCK_GUIDANCE},
+    {AA_AUDIO_TYPE_SYSTEM, {16000, 1}, AUDIO_DUCK_NONE},
+};
+
+// Describes the head unit and the channels it supports
+static void write_discovery_response(wire_writer_t &w)
+{
+    typedef discovery_response_msg_t msg;
+    w.message<msg::service>([&]{
+        w.varint<service_msg_t::id>(AA_SENSOR_CHANNEL);
+        w.message<service_msg_t::sensor_source>([&]{
+            w.message<sensor_source_msg_t::sensor>([&]{
+                w.varint<sensor_source_msg_t::sensor_type>(AA_SENSOR_TYPE_DRIVING_STATUS);
+            });
+        });
+    });
+    w.message<msg::service>([&]{
+        w.varint<service_msg_t::id>(AA_VIDEO_CHANNEL);
+        w.message<service_msg_t::media_sink>([&]{
+            w.varint<media_sink_msg_t::codec_type>(AA_CODEC_VIDEO_H264);
+            w.message<media_sink_msg_t::video_config>([&]{
+                w.varint<video_config_msg_t::resolution>(AA_VIDEO_800x480);
+                w.varint<video_config_msg_t::frame_rate>(AA_VIDEO_FPS_30);
+                w.varint<video_config_msg_t::width_margin>(0);
+                w.varint<video_config_msg_t::height_margin>(0);
+                // 160 like 4100NEX. 128 is small, phone/music close to
+                // the outside. 240 is big, phone/music close to the center.
+                w.varint<video_config_msg_t::dpi>(160);
+            });
+        });
+    });
+    for(int f=0; f<AA_AUDIO_CHANNEL_COUNT; ++f) {
+        const audio_channel_info_t &info = audio_channel_info[f];
+        w.message<msg::service>([&]{
+            w.varint<service_msg_t::id>(AA_AUDIO0_CHANNEL + f);
+            w.message<service_msg_t::media_sink>([&]{
+                w.varint<media_sink_msg_t::codec_type>(AA_CODEC_AUDIO_PCM);
+                w.varint<media_sink_msg_t::audio_type>(info.type_);
+                w.message<media_sink_msg_t::audio_config>([&]{
+                    w.varint<audio_config_msg_t::sample_rate>(info.format_.sample_rate_);
+                    w.varint<audio_config_msg_t::bits>(16);
+                    w.varint<audio_config_msg_t::channels>(info.format_.channels_);
+                });
+            });
+        });
+    }
+    w.message<msg::service>([&]{
+        w.varint<service_msg_t::id>(AA_MIC_CHANNEL);
+        w.message<service_msg_t::media_source>([&]{
+            w.varint<media_source_msg_t::codec_type>(AA_CODEC_AUDIO_PCM);
+            w.message<media_source_msg_t::audio_config>([&]{
+                w.varint<audio_config_msg_t::sample_rate>(mic_stream_t::get_format().sample_rate_);
+                w.varint<audio_config_msg_t::bits>(16);
+                w.varint<audio_config_msg_t::channels>(mic_stream_t::get_format().channels_);
+            });
+        });
+    });
+    // Crashes on null Point reference without
+    w.message<msg::service>([&]{
+        w.varint<service_msg_t::id>(AA_TOUCHSCREEN_CHANNEL);
+        w.message<service_msg_t::input_source>([&]{
+            w.message<input_source_msg_t::touchscreen>([&]{
+                w.varint<input_source_msg_t::width>(AA_TOUCHSCREEN_WIDTH);
+                w.varint<input_source_msg_t::height>(AA_TOUCHSCREEN_HEIGHT);
+            });
+        });
+    });
+
+    w.string<msg::car_make>("TSLA");    // Part of "remembered car"
+    w.string<msg::car_model>("MDLS");
+    w.string<msg::car_year>("2016");    // Part of "remembered car"
+    w.string<msg::car_serial>("0001");  // Not part of "remembered car" ?? (vehicleId=null)
+    w.varint<msg::driver_position>(1);
+    w.string<msg::hu_make>("Alex");
+    w.string<msg::hu_model>("TSLA");
+    w.string<msg::hu_build>("BLD1");
+    w.string<msg::hu_version>("V001");
+    w.boolean<msg::native_media_during_vr>(false);
+    w.boolean<msg::hide_clock>(false);
+}
+
+proto_t::~proto_t()
+{
+    // The decoder might outlive us
+    this->decoder_->set_consumed_callback(nullptr);
+    // So might the transport's reactor. Whatever is sent from now on is
+    // dropped, nobody is going to flush it.
+    std::lock_guard<std::mutex> l(outbox_mutex_);
+    outbox_closed_ = true;
+    outbox_.clear();
+    if (outbox_timer_)
+        this->trans_->get_reactor().cancel_timer(outbox_timer_);
+}
+
 void proto_t::run_loop() {
+    schedule_stats();
+    // A failed handler wakes us up, so the error isn't stuck until the
+    // next packet arrives
+    reactor_t &reactor = this->trans_->get_reactor();
+    dispatcher_.set_error_callback([&reactor]{reactor.wakeup();});
+    dispatcher_.start();
+    if (!this->trans_->needs_handshake())
+        transit_to(READY);
     while(terminator_->check_termination())
     {
+        dispatcher_.check_for_errors();
         // Run the protocol state machine
-        if (phase_ == INIT) {
-            transit_to(VERSION_NEGO);
-            TA_DEBUG() << "Sending version negotiation";
-            this->trans_->write_packet(make_packet(0, AA_VERSION_REQ, false, {0, 1, 0, 1}));
-            continue;
-        }
-        
-        if (phase_ == VERSION_NEGO && (this->phase_start_+VERSION_NEGO) < time(NULL))
+        if (phase_ == INIT)
+            start_version_nego();
+
+        // Sleep until there's data, a timer fires or we're terminated.
+        // Then process everything we got from one read in a single pass.
+        this->trans_->handle_events(batch_);
+        for(const packet_ptr_t &packet : batch_)
         {
-            // It's taking too long to get the reply, retry it
-            transit_to(INIT);
-            TA_DEBUG() << "Version reply timeout";
-            continue;
+            if (phase_ == INIT)
+                start_version_nego();
+            handle_packet(packet);
         }
+        batch_.clear();
+    }
+}
+
+void proto_t::transit_to(proto_phase_t p)
+{
+    if (nego_timer_) {
+        this->trans_->get_reactor().cancel_timer(nego_timer_);
+        nego_timer_ = 0;
+    }
+    phase_ = p;
+    phase_start_ = time(NULL);
+}
+
+void proto_t::schedule_stats()
+{
+    this->trans_->get_reactor().add_timer(STATS_PERIOD_SEC * 1000, [this]{
+        report_stats();
+        schedule_stats();
+    });
+}
 
-        packet_ptr_t packet = this->trans_->handle_events();
-        if (!packet)
+void proto_t::report_stats()
+{
+    time_t now = time(NULL);
+    if (now <= stats_start_)
+        return;
+
+    packet_pool_stats_t pool = packet_pool_t::instance().get_stats();
+    double elapsed = now - stats_start_;
+    TA_DEBUG() << "Packet pool: "
+               << (pool.allocations_ - last_pool_stats_.allocations_) / elapsed
+               << " allocations/s, "
+               << (pool.reuses_ - last_pool_stats_.reuses_) / elapsed << " reuses/s";
+    last_pool_stats_ = pool;
+
+    crypto_stats_t crypto = crypto_->get_stats();
+    report_crypto_stats("Encrypt", crypto.encrypt_, last_crypto_stats_.encrypt_);
+    report_crypto_stats("Decrypt", crypto.decrypt_, last_crypto_stats_.decrypt_);
+    last_crypto_stats_ = crypto;
+
+    touch_stats_t touch = touch_.get_stats();
+    if (touch.events_sent_ != last_touch_stats_.events_sent_)
+        TA_DEBUG() << "Touch: " << touch.events_sent_ - last_touch_stats_.events_sent_
+                   << " events sent, " << touch.moves_received_ - last_touch_stats_.moves_received_
+                   << " moves coalesced into " << touch.moves_sent_ - last_touch_stats_.moves_sent_;
+    last_touch_stats_ = touch;
+
+    media_flow_stats_t video = video_window_.get_stats();
+    uint64_t acked = video.acked_ - last_video_stats_.acked_;
+    if (video.received_ != last_video_stats_.received_ || video.in_flight_ != 0)
+        TA_DEBUG() << "Video flow: window " << video.window_ << ", " << video.in_flight_
+                   << " in flight (max " << video.max_in_flight_ << "), " << acked
+                   << " acked, queue latency avg "
+                   << (acked ? (video.queue_ns_total_ - last_video_stats_.queue_ns_total_)
+                               / acked / 1000000.0 : 0)
+                   << "ms, max " << video.max_queue_ns_ / 1000000.0 << "ms";
+    last_video_stats_ = video;
+    report_audio_stats();
+    report_mic_stats();
+
+    dispatch_stats_t dispatch = dispatcher_.get_stats();
+    for(int f=0; f<WORK_CLASS_COUNT; ++f) {
+        if (dispatch.handled_[f] == 0 && dispatch.queue_depth_[f] == 0)
             continue;
-        if (!packet->encrypted_)
-            TA_TRACE() << "Received: " << desc(packet);
+        TA_DEBUG() << "Dispatch " << work_class_name(work_class_t(f)) << ": "
+                   << dispatch.handled_[f] << " handled, queue depth "
+                   << dispatch.queue_depth_[f] << " (max " << dispatch.max_queue_depth_[f]
+                   << "), " << dispatch.full_waits_[f] << " full waits for "
+                   << dispatch.full_wait_ns_[f] / 1000000 << "ms";
+    }
+    stats_start_ = now;
+}
 
-        if (phase_ == VERSION_NEGO)
-        {
-            if (get_msg_type(packet->content_) != AA_VERSION_RESPONSE) {
-                transit_to(INIT);
-                TA_INFO() << "Received wrong response to version request " << desc(packet);
-                continue;
-            }
-            
-            //Write the nego packet
-            buf_t data = crypto_->do_handshake(buf_t(), 0);
-            this->trans_->write_packet(make_packet(AA_CONTROL_CHANNEL, AA_SSL_HANDSHAKE_DATA,
-                                                   false, data));
-            transit_to(SSL_HANDSHAKE);
+void proto_t::report_crypto_stats(const char *op, const crypto_op_stats_t *cur,
+                                  const crypto_op_stats_t *last)
+{
+    static const char *class_names[CRYPTO_SIZE_CLASSES] = {"<=256B", "<=4K", ">4K"};
+    for(int f=0; f<CRYPTO_SIZE_CLASSES; ++f) {
+        crypto_op_stats_t period = cur[f].since(last[f]);
+        if (period.ops_ == 0)
             continue;
+        // The throughput is over the time actually spent in the cipher
+        double busy_sec = period.busy_ns_ / 1e9;
+        TA_DEBUG() << op << " " << class_names[f] << ": " << period.ops_ << " ops, "
+                   << (busy_sec > 0 ? period.bytes_ / busy_sec / (1024*1024) : 0) << " MB/s, "
+                   << "p50 <=" << period.latency_percentile(0.5) / 1000.0 << "us, "
+                   << "p99 <=" << period.latency_percentile(0.99) / 1000.0 << "us, "
+                   << "lock wait " << period.lock_wait_ns_ / period.ops_ << "ns/op";
+    }
+}
+
+void proto_t::start_version_nego()
+{
+    transit_to(VERSION_NEGO);
+    TA_DEBUG() << "Sending version negotiation";
+    this->trans_->write_packet(make_packet(0, AA_VERSION_REQ, false, {0, 1, 0, 1}));
+
+    nego_timer_ = this->trans_->get_reactor().add_timer(VERSION_NEGO_TIMEOUT_SEC * 1000, [this]{
+        // It's taking too long to get the reply, retry it
+        nego_timer_ = 0;
+        transit_to(INIT);
+        TA_DEBUG() << "Version reply timeout";
+    });
+}
+
+void proto_t::handle_packet(packet_ptr_t packet)
+{
+    if (!packet->encrypted_)
+        TA_TRACE() << "Received: " << desc(packet);
+
+    if (phase_ == VERSION_NEGO)
+    {
+        if (get_msg_type(packet->content_) != AA_VERSION_RESPONSE) {
+            transit_to(INIT);
+            TA_INFO() << "Received wrong response to version request " << desc(packet);
+            return;
+        }
+
+        //Write the nego packet
+        buf_t data = crypto_->do_handshake(buf_t(), 0);
+        this->trans_->write_packet(make_packet(AA_CONTROL_CHANNEL, AA_SSL_HANDSHAKE_DATA,
+                                               false, data));
+        transit_to(SSL_HANDSHAKE);
+        return;
+    }
+
+    if (phase_ == SSL_HANDSHAKE)
+    {
+        if (get_msg_type(packet->content_) != AA_SSL_HANDSHAKE_DATA) {
+            TA_INFO() << "Unexpected packet received during SSL nego: " << desc(packet);
+            transit_to(INIT);
+            return;
         }
 
-        if (phase_ == SSL_HANDSHAKE)
+        buf_t response = this->crypto_->do_handshake(packet->content_, 2);
+        if (response.empty())
         {
-            if (get_msg_type(packet->content_) != AA_SSL_HANDSHAKE_DATA) {
+            if (!this->crypto_->is_handshake_finished())
+            {
                 TA_INFO() << "Unexpected packet received during SSL nego: " << desc(packet);
                 transit_to(INIT);
-                continue;
+                return;
             }
 
-            buf_t response = this->crypto_->do_handshake(packet->content_, 2);
-            if (response.empty())
-            {
-                if (!this->crypto_->is_handshake_finished())
-                {
-                    TA_INFO() << "Unexpected packet received during SSL nego: " << desc(packet);
-                    transit_to(INIT);
-                    continue;
-                }
-
-                this->trans_->write_packet(make_packet(AA_CONTROL_CHANNEL, AA_SSL_COMPLETE,
-                                                       false, {0x08, 0}));
-                transit_to(READY);
-                continue;
-            } else {
-                this->trans_->write_packet(make_packet(AA_CONTROL_CHANNEL, AA_SSL_HANDSHAKE_DATA,
-                                                       false, response));
-                continue;
-            }
+            this->trans_->write_packet(make_packet(AA_CONTROL_CHANNEL, AA_SSL_COMPLETE,
+                                                   false, {0x08, 0}));
+            transit_to(READY);
+        } else {
+            this->trans_->write_packet(make_packet(AA_CONTROL_CHANNEL, AA_SSL_HANDSHAKE_DATA,
+                                                   false, response));
         }
-        
-        if (phase_ == READY)
-        {
-            //Decrypt the packet
-            buf_t plain = this->crypto_->decrypt(packet->content_, 0);
-            packet->content_.swap(plain);
-            TA_TRACE() << "Decrypted packet: " << desc(packet);
+        return;
+    }
 
-            dispatch_in_established(packet);
-        }
+    if (phase_ == READY)
+    {
+        // The transport has already decrypted the packet
+        TA_TRACE() << "Decrypted packet: " << desc(packet);
+        if (!dispatcher_.dispatch(packet))
+            TA_INFO() << "Unknown packet: " << desc(packet);
     }
 }
 
 void proto_t::encrypt_and_send(packet_ptr_t pack)
 {
-    packet_ptr_t enc_packet(new packet_t());
-    enc_packet->chan_ = pack->chan_;
-    enc_packet->control_ = pack->control_;
-    enc_packet->encrypted_ = true;
+    // The writer encrypts the packet as it's framed, straight into the USB
+    // transfer. That also keeps the TLS records in the order they're sent.
+    pack->encrypted_ = true;
+    this->trans_->write_packet(pack);
+}
 
-    buf_t enc = this->crypto_->encrypt(pack->content_, 0);
-    enc_packet->content_.swap(enc);
-    this->trans_->write_packet(enc_packet);
+void proto_t::send_later(packet_ptr_t pack)
+{
+    std::lock_guard<std::mutex> l(outbox_mutex_);
+    if (outbox_closed_)
+        return;
+    outbox_.push_back(pack);
+    if (!outbox_timer_) {
+        reactor_t &reactor = this->trans_->get_reactor();
+        outbox_timer_ = reactor.add_timer(0, [this]{ flush_outbox(); });
+        reactor.wakeup();
+    }
 }
 
-void proto_t::dispatch_in_established(packet_ptr_t pack)
+// Runs on the protocol thread
+void proto_t::flush_outbox()
 {
-    uint16_t msg_type = get_msg_type(pack->content_);
-    switch (msg_type)
     {
-        case AA_DISCOVERY_REQUEST:
-            encrypt_and_send(make_packet(AA_CONTROL_CHANNEL, AA_DISCOVERY_RESPONSE, true,
-                                         discovery_data));
-        break;
-        case AA_CHANNEL_OPEN_REQUEST:
-            encrypt_and_send(make_packet(pack->chan_, AA_CHANNEL_OPEN_RESPONSE, true, {8, 0}));
-            // We're parked!!!
-            if (pack->chan_ == AA_SENSOR_CHANNEL)
-                encrypt_and_send(make_packet(pack->chan_, AA_SENSOR_DATA, true, {0x6a, 2, 8, 0}));
-        break;
-        case AA_MEDIA_SETUP:
-            encrypt_and_send(make_packet(pack->chan_, AA_SENSOR_DATA, true,
-                                         {0x08, 2, 0x10, 48, 0x18, 0}));
-            if (pack->chan_ == AA_VIDEO_CHANNEL)
-                encrypt_and_send(make_packet(pack->chan_, AA_VIDEO_FOCUS_GAINED, true,
-                                             {0x08, 1, 0x10, 1}));
-        break;
-        case AA_SENSOR_START:
-            encrypt_and_send(make_packet(pack->chan_, AA_SENSOR_DATA, true, {8, 0}));
-        break;
-        case AA_MEDIA_START_REQUEST:
-            if (pack->chan_ == AA_SENSOR_CHANNEL) {
-                encrypt_and_send(make_packet(pack->chan_, AA_CHANNEL_OPEN_RESPONSE, true, {8, 0}));
-                encrypt_and_send(make_packet(pack->chan_, AA_SENSOR_DATA, true, {0x6a, 2, 8, 0}));
-            }
-        break;
-        case AA_MEDIA_DATA:
-            if (pack->chan_ == AA_VIDEO_CHANNEL)
-                encrypt_and_send(make_packet(pack->chan_, AA_VID_ACK, true, {0x08, 0, 0x10,  1}));
-            //Fall-through
-        case AA_CODEC_DATA:
-            if (pack->chan_ == AA_VIDEO_CHANNEL) {
-                decoder_->check_for_errors();
-                decoder_->submit_packet(pack);
-            }
-        break;
-        case AA_NAV_FOCUS_REQUEST:
-            encrypt_and_send(make_packet(pack->chan_, AA_NAV_FOCUS_NOTIFY, true, {0x08, 2}));
-        break;
-        default:
-            TA_INFO() << "Unknown packet: " << desc(pack);
+        std::lock_guard<std::mutex> l(outbox_mutex_);
+        outbox_timer_ = 0;
+        // Both vectors keep their capacity
+        outbox_.swap(outbox_sending_);
     }
+    for(const packet_ptr_t &pack : outbox_sending_)
+        encrypt_and_send(pack);
+    outbox_sending_.clear();
 }
 
-void proto_t::notify_mouse(int x, int y, bool mouse_down)
+void proto_t::register_handlers()
 {
-    buf_t coords;
-    coords.push_back(0x08);  // Value 1
-    encode_varint_to(x, coords);
-    coords.push_back(0x10); // Value 2
-    encode_varint_to(y, coords);
-    coords.push_back(0x18);  // Value 3
-    coords.push_back(0);  // Encode Z ?
+    // Everything that the phone waits for goes to the control worker, so
+    // the replies are never stuck behind the media
+    dispatcher_.add_handler(AA_CONTROL_CHANNEL, AA_DISCOVERY_REQUEST, WORK_CONTROL,
+                            [this](const packet_ptr_t &) {
+        packet_ptr_t res = make_packet_common(AA_CONTROL_CHANNEL, AA_DISCOVERY_RESPONSE,
+                                              true, 256);
+        wire_writer_t w(res->content_);
+        write_discovery_response(w);
+        encrypt_and_send(res);
+    });
+    dispatcher_.add_handler(AA_CONTROL_CHANNEL, AA_NAV_FOCUS_REQUEST, WORK_CONTROL,
+                            [this](const packet_ptr_t &pack) {
+        nav_focus_request_t req = parse_nav_focus_request(*pack);
+        TA_DEBUG() << "Navigation focus requested: " << req.focus_type_;
+        // The projected navigation always has the focus
+        packet_ptr_t res = make_packet_common(pack->chan_, AA_NAV_FOCUS_NOTIFY, true, 2);
+        wire_writer_t w(res->content_);
+        w.varint<nav_focus_msg_t::focus_type>(AA_NAV_FOCUS_PROJECTED);
+        encrypt_and_send(res);
+    });
+    dispatcher_.add_handler(AA_CONTROL_CHANNEL, AA_AUDIO_FOCUS_REQUEST, WORK_CONTROL,
+                            [this](const packet_ptr_t &pack) {
+        audio_focus_request_t req = parse_audio_focus_request(*pack);
+        TA_DEBUG() << "Audio focus requested: " << req.focus_type_;
+        // Nothing else plays here, the phone gets whatever it asks for
+        aa_audio_focus_state_t state = AA_AUDIO_FOCUS_STATE_GAIN;
+        if (req.focus_type_ == AA_AUDIO_FOCUS_REQUEST_RELEASE)
+            state = AA_AUDIO_FOCUS_STATE_LOSS;
+        else if (req.focus_type_ == AA_AUDIO_FOCUS_REQUEST_GAIN_TRANSIENT)
+            state = AA_AUDIO_FOCUS_STATE_GAIN_TRANSIENT;
+        packet_ptr_t res = make_packet_common(pack->chan_, AA_AUDIO_FOCUS_NOTIFY, true, 2);
+        wire_writer_t w(res->content_);
+        w.varint<audio_focus_msg_t::focus_type>(state);
+        encrypt_and_send(res);
+    });
+    for(u_char chan = 0; chan <= AA_MAX_CHANNEL; ++chan) {
+        dispatcher_.add_handler(chan, AA_CHANNEL_OPEN_REQUEST, WORK_CONTROL,
+                                [this](const packet_ptr_t &pack) { handle_channel_open(pack); });
+        dispatcher_.add_handler(chan, AA_MEDIA_SETUP, WORK_CONTROL,
+                                [this](const packet_ptr_t &pack) { handle_media_setup(pack); });
+    }
 
-    buf_t tevent;
-    tevent.push_back(0x0a);  // Value 3 array
-    tevent.push_back((u_char) coords.size());
-    tevent.insert(tevent.end(), coords.begin(), coords.end());
+    dispatcher_.add_handler(AA_SENSOR_CHANNEL, AA_SENSOR_START, WORK_SENSORS,
+                            [this](const packet_ptr_t &pack) {
+        encrypt_and_send(make_packet(pack->chan_, AA_SENSOR_DATA, true, {8, 0}));
+    });
+    dispatcher_.add_handler(AA_SENSOR_CHANNEL, AA_MEDIA_START_REQUEST, WORK_SENSORS,
+                            [this](const packet_ptr_t &pack) {
+        encrypt_and_send(make_packet(pack->chan_, AA_CHANNEL_OPEN_RESPONSE, true, {8, 0}));
+        encrypt_and_send(make_packet(pack->chan_, AA_SENSOR_DATA, true, {0x6a, 2, 8, 0}));
+    });
 
-    tevent.push_back(0x10);
-    tevent.push_back(0x00);
-    tevent.push_back(0x18);
-    tevent.push_back(mouse_down?AA_INPUT_ACTION_MOUSEDOWN:AA_INPUT_ACTION_MOUSEUP);
+    dispatcher_.add_handler(AA_VIDEO_CHANNEL, AA_MEDIA_START_REQUEST, WORK_CONTROL,
+                            [this](const packet_ptr_t &pack) {
+        media_start_request_t req = parse_media_start_request(*pack);
+        TA_DEBUG() << "Video session " << req.session_ << " starts, config "
+                   << req.config_index_;
+        video_window_.set_session(req.session_);
+    });
 
-    buf_t ba_touch;
-    //  Encode timestamp
-    // Timestamp is in nanoseconds
-    uint64_t ts = 0;
-    ba_touch.push_back(0x08);  // Integer
-    encode_varint_to(ts, ba_touch);
+    for(int f=0; f<AA_AUDIO_CHANNEL_COUNT; ++f)
+        register_audio_handlers(u_char(AA_AUDIO0_CHANNEL + f));
+    register_mic_handlers();
+
+    this->decoder_->set_consumed_callback([this](const packet_ptr_t &pack, uint64_t queue_ns) {
+        on_video_consumed(pack, queue_ns);
+    });
+    // The ack window bounds the frames in flight, so a full queue is a
+    // protocol error. Stalling the reader would hold back the control
+    // channel, e.g. the navigation focus requests.
+    dispatcher_.set_queue_capacity(WORK_VIDEO, VIDEO_QUEUE_CAPACITY, true);
+    dispatcher_.add_handler(AA_VIDEO_CHANNEL, AA_MEDIA_DATA, WORK_VIDEO,
+                            [this](const packet_ptr_t &pack) { handle_video_data(pack); });
+    dispatcher_.add_handler(AA_VIDEO_CHANNEL, AA_CODEC_DATA, WORK_VIDEO,
+                            [this](const packet_ptr_t &pack) { handle_video_data(pack); });
+}
+
+void proto_t::register_audio_handlers(u_char chan)
+{
+    audio_channel_t &audio = audio_[chan - AA_AUDIO0_CHANNEL];
+    const audio_channel_info_t &info = audio_channel_info[chan - AA_AUDIO0_CHANNEL];
+    // Runs on the audio output's thread under the mixer lock, the ack is
+    // only queued
+    audio.sink_ = mixer_.add_input(info.format_, info.duck_,
+                                   [this, chan](const packet_ptr_t &pack, uint64_t queue_ns) {
+        audio_channel_t &audio = audio_[chan - AA_AUDIO0_CHANNEL];
+        uint32_t acks = audio.window_.on_consumed(queue_ns);
+        if (acks == 0)
+            return;
+        packet_ptr_t ack = make_packet_common(chan, AA_VID_ACK, true, 8);
+        wire_writer_t w(ack->content_);
+        w.varint<media_ack_msg_t::session>(audio.window_.get_session());
+        w.varint<media_ack_msg_t::ack_count>(acks);
+        send_later(ack);
+    });
+
+    // The stream control goes through the audio worker too, so it stays in
+    // order with the data
+    dispatcher_.add_handler(chan, AA_MEDIA_START_REQUEST, WORK_AUDIO,
+                            [this, &audio](const packet_ptr_t &pack) {
+        media_start_request_t req = parse_media_start_request(*pack);
+        TA_DEBUG() << "Audio session " << req.session_ << " starts on channel "
+                   << (uint)pack->chan_;
+        audio.window_.set_session(req.session_);
+        mixer_.start_input(audio.sink_);
+    });
+    dispatcher_.add_handler(chan, AA_MEDIA_STOP_REQUEST, WORK_AUDIO,
+                            [this, &audio](const packet_ptr_t &pack) {
+        TA_DEBUG() << "Audio stops on channel " << (uint)pack->chan_;
+        mixer_.stop_input(audio.sink_);
+        audio.window_.reset();
+    });
+    dispatcher_.add_handler(chan, AA_MEDIA_DATA, WORK_AUDIO,
+                            [&audio](const packet_ptr_t &pack) {
+        audio.window_.on_received();
+        audio.sink_->submit(pack, AA_MEDIA_DATA_OFFSET);
+    });
+}
 
-    ba_touch.push_back(0x1a);  // Contents = 1 array
-    ba_touch.push_back((u_char) tevent.size());
-    ba_touch.insert(ba_touch.end(), tevent.begin(), tevent.end());
+void proto_t::report_audio_stats()
+{
+    bool playing = false;
+    for(int f=0; f<AA_AUDIO_CHANNEL_COUNT; ++f) {
+        audio_channel_t &audio = audio_[f];
+        media_flow_stats_t flow = audio.window_.get_stats();
+        uint64_t acked = flow.acked_ - audio.last_stats_.acked_;
+        if (flow.received_ == audio.last_stats_.received_ && flow.in_flight_ == 0)
+            continue;
+        playing = true;
+        audio_sink_stats_t sink = audio.sink_->get_stats();
+        TA_DEBUG() << "Audio " << AA_AUDIO0_CHANNEL + f << ": " << acked << " acked, "
+                   << flow.in_flight_ << " in flight, buffer " << sink.buffered_millis_
+                   << "ms (target " << sink.target_millis_ << "ms, max "
+                   << sink.max_buffered_millis_ << "ms), " << sink.underruns_ << " underruns, "
+                   << sink.bytes_dropped_ << " bytes dropped, queue latency avg "
+                   << (acked ? (flow.queue_ns_total_ - audio.last_stats_.queue_ns_total_)
+                               / acked / 1000000.0 : 0) << "ms";
+        audio.last_stats_ = flow;
+    }
+
+    audio_mixer_stats_t mixer = mixer_.get_stats();
+    uint64_t blocks = mixer.blocks_ - last_mixer_stats_.blocks_;
+    uint64_t frames = mixer.frames_ - last_mixer_stats_.frames_;
+    uint64_t mix_ns = mixer.mix_ns_total_ - last_mixer_stats_.mix_ns_total_;
+    if (playing && blocks != 0)
+        TA_DEBUG() << "Audio mixer (" << mixer_.get_kernels_name() << "): " << blocks
+                   << " blocks, mixing avg " << mix_ns / blocks / 1000.0 << "us, max "
+                   << mixer.max_mix_ns_ / 1000.0 << "us, "
+                   << (frames ? mix_ns / 10.0 / (frames * 1000000.0 / mixer_.get_format().sample_rate_) : 0)
+                   << "% of the playback time, media ducked for "
+                   << (mixer.ducked_blocks_ - last_mixer_stats_.ducked_blocks_) * 100 / blocks
+                   << "% of it";
+    last_mixer_stats_ = mixer;
+}
+
+void proto_t::register_mic_handlers()
+{
+    // The phone waits for the reply before it starts the voice session
+    dispatcher_.add_handler(AA_MIC_CHANNEL, AA_MIC_REQUEST, WORK_CONTROL,
+                            [this](const packet_ptr_t &pack) {
+        mic_request_t req = parse_mic_request(*pack);
+        bool opened = true;
+        if (req.open_) {
+            opened = mic_.open(req.max_unacked_);
+            TA_DEBUG() << "Microphone session " << mic_.get_session()
+                       << (opened ? " starts" : " can't start") << ", window "
+                       << req.max_unacked_;
+        } else {
+            TA_DEBUG() << "Microphone session " << mic_.get_session() << " stops";
+            mic_.close();
+        }
+        packet_ptr_t res = make_packet_common(AA_MIC_CHANNEL, AA_MIC_RESPONSE, true, 8);
+        wire_writer_t w(res->content_);
+        w.varint<mic_response_msg_t::session>(mic_.get_session());
+        w.varint<mic_response_msg_t::status>(opened ? 0 : 1);
+        encrypt_and_send(res);
+    });
+    dispatcher_.add_handler(AA_MIC_CHANNEL, AA_VID_ACK, WORK_CONTROL,
+                            [this](const packet_ptr_t &pack) {
+        mic_.on_ack(parse_media_ack(*pack).ack_count_);
+    });
+}
+
+void proto_t::report_mic_stats()
+{
+    mic_stats_t mic = mic_.get_stats();
+    uint64_t sent = mic.chunks_sent_ - last_mic_stats_.chunks_sent_;
+    uint64_t dropped = mic.chunks_dropped_ - last_mic_stats_.chunks_dropped_;
+    uint64_t acked = mic.acked_ - last_mic_stats_.acked_;
+    if (sent != 0 || dropped != 0)
+        TA_DEBUG() << "Microphone: " << sent << " chunks sent, " << dropped << " dropped, "
+                   << acked << " acked, " << mic.in_flight_ << " in flight (max "
+                   << mic.max_in_flight_ << "), ack latency avg "
+                   << (acked ? (mic.ack_ns_total_ - last_mic_stats_.ack_ns_total_)
+                               / acked / 1000000.0 : 0)
+                   << "ms, max " << mic.max_ack_ns_ / 1000000.0 << "ms";
+    last_mic_stats_ = mic;
+}
+
+void proto_t::handle_channel_open(const packet_ptr_t &pack)
+{
+    channel_open_request_t req = parse_channel_open_request(*pack);
+    TA_DEBUG() << "Opening channel " << (uint)pack->chan_ << ", service " << req.service_id_
+               << ", priority " << req.priority_;
+    encrypt_and_send(make_packet(pack->chan_, AA_CHANNEL_OPEN_RESPONSE, true, {8, 0}));
+    // We're parked!!!
+    if (pack->chan_ == AA_SENSOR_CHANNEL)
+        encrypt_and_send(make_packet(pack->chan_, AA_SENSOR_DATA, true, {0x6a, 2, 8, 0}));
+}
+
+void proto_t::handle_media_setup(const packet_ptr_t &pack)
+{
+    media_setup_request_t req = parse_media_setup_request(*pack);
+    TA_DEBUG() << "Media setup on channel " << (uint)pack->chan_ << ", codec "
+               << req.codec_type_;
+
+    // The media is acked as it's consumed, the window bounds the backlog of
+    // the decoder or the audio sink
+    uint32_t max_unacked = 48;
+    if (pack->chan_ == AA_VIDEO_CHANNEL)
+        max_unacked = video_window_.get_window();
+    else if (pack->chan_ >= AA_AUDIO0_CHANNEL && pack->chan_ <= AA_AUDIO2_CHANNEL)
+        max_unacked = audio_[pack->chan_ - AA_AUDIO0_CHANNEL].window_.get_window();
+    packet_ptr_t config = make_packet_common(pack->chan_, AA_MEDIA_CONFIG, true, 8);
+    wire_writer_t w(config->content_);
+    w.varint<media_config_msg_t::status>(AA_MEDIA_CONFIG_READY);
+    w.varint<media_config_msg_t::max_unacked>(max_unacked);
+    w.varint<media_config_msg_t::config_index>(0);
+    encrypt_and_send(config);
+    if (pack->chan_ == AA_VIDEO_CHANNEL)
+        encrypt_and_send(make_packet(pack->chan_, AA_VIDEO_FOCUS_GAINED, true,
+                                     {0x08, 1, 0x10, 1}));
+}
+
+void proto_t::handle_video_data(const packet_ptr_t &pack)
+{
+    // The frame is acked once it's decoded, see on_video_consumed
+    if (get_msg_type(pack->content_) == AA_MEDIA_DATA)
+        video_window_.on_received();
+    decoder_->check_for_errors();
+    decoder_->submit_packet(pack);
+}
+
+// Called on the decoder's thread with its callback lock held, the ack is
+// only queued
+void proto_t::on_video_consumed(const packet_ptr_t &pack, uint64_t queue_ns)
+{
+    if (get_msg_type(pack->content_) != AA_MEDIA_DATA)
+        return;
+    uint32_t acks = video_window_.on_consumed(queue_ns);
+    if (acks == 0)
+        return;
 
-    encrypt_and_send(make_packet(AA_TOUCHSCREEN_CHANNEL, AA_TOUCHSCREEN_INPUT, true,
-                                 ba_touch));
+    packet_ptr_t ack = make_packet_common(pack->chan_, AA_VID_ACK, true, 8);
+    wire_writer_t w(ack->content_);
+    w.varint<media_ack_msg_t::session>(video_window_.get_session());
+    w.varint<media_ack_msg_t::ack_count>(acks);
+    send_later(ack);
 }
@@ -5,8 +5,14 @@
 #ifndef AAUTO_PROTO_H
 #define AAUTO_PROTO_H
 
-#include "transport.h"
+#include "transport_base.h"
 #include "crypto.h"
+#include "dispatcher.h"
+#include "touch.h"
+#include "media_flow.h"
+#include "audio_mixer.h"
+#include "mic_stream.h"
+#include "aa_helpers.h"
 
 class decoder_t;
 
@@ -21,26 +27,93 @@ class proto_t {
     };
     proto_phase_t phase_;
     time_t phase_start_;
+    uint64_t nego_timer_;
+    std::vector<packet_ptr_t> batch_;
+
+    time_t stats_start_;
+    packet_pool_stats_t last_pool_stats_;
+    crypto_stats_t last_crypto_stats_;
+    touch_stats_t last_touch_stats_;
+    media_ack_window_t video_window_;
+    media_flow_stats_t last_video_stats_;
+    static const int STATS_PERIOD_SEC = 10;
     static const int VERSION_NEGO_TIMEOUT_SEC = 2;
+
+    // A few packets are enough to keep the jitter buffer fed
+    static const uint32_t AUDIO_MAX_UNACKED = 4;
+    struct audio_channel_t {
+        media_ack_window_t window_;
+        media_flow_stats_t last_stats_;
+        audio_sink_ptr_t sink_;
+        audio_channel_t() : window_(AUDIO_MAX_UNACKED), last_stats_() {}
+    };
+    audio_mixer_stats_t last_mixer_stats_;
+    mic_stats_t last_mic_stats_;
+
+    // Packets from the threads that must not wait for the transport: the UI
+    // and the audio callbacks. A reactor timer sends them from the protocol
+    // thread.
+    std::mutex outbox_mutex_;
+    std::vector<packet_ptr_t> outbox_, outbox_sending_;
+    uint64_t outbox_timer_;
+    bool outbox_closed_;
+
+    touch_input_t touch_;
+    audio_channel_t audio_[AA_AUDIO_CHANNEL_COUNT];
+    // Stopped before the channels it plays
+    audio_mixer_t mixer_;
+    mic_stream_t mic_;
+    // Destroyed first, its workers use everything above
+    dispatcher_t dispatcher_;
 public:
     proto_t(const transport_ptr_t &trans_,
             const std::shared_ptr<crypto_context_t> &crypto_,
             notifier_t *terminator,
-            std::shared_ptr<decoder_t> decoder) :
-            trans_(trans_), crypto_(crypto_), phase_(INIT),
-            terminator_(terminator), decoder_(decoder) {}
+            std::shared_ptr<decoder_t> decoder,
+            audio_output_factory_t audio_output,
+            audio_input_factory_t mic_input) :
+            trans_(trans_), crypto_(crypto_), decoder_(decoder), terminator_(terminator),
+            phase_(INIT), phase_start_(), nego_timer_(), stats_start_(time(NULL)),
+            last_pool_stats_(packet_pool_t::instance().get_stats()),
+            last_crypto_stats_(crypto_->get_stats()), last_touch_stats_(),
+            video_window_(VIDEO_MAX_UNACKED), last_video_stats_(),
+            last_mixer_stats_(), last_mic_stats_(), outbox_timer_(), outbox_closed_(false),
+            touch_(trans_->get_reactor(), [this](const packet_ptr_t &p) { send_later(p); }),
+            mixer_(audio_output),
+            mic_(mic_input, [this](const packet_ptr_t &p) { send_later(p); }),
+            dispatcher_(terminator)
+    {
+        this->trans_->set_crypto(this->crypto_);
+        register_handlers();
+    }
+    ~proto_t();
 
     void run_loop();
-    void notify_mouse(int x, int y, bool mouse_down);
+    // Touch events in the touchscreen coordinates, may be used from any thread
+    touch_input_t &get_touch() { return touch_; }
 private:
-    void transit_to(proto_phase_t p)
-    {
-        phase_ = p;
-        phase_start_ = time(NULL);
-    }
+    void transit_to(proto_phase_t p);
 
-    void dispatch_in_established(packet_ptr_t pack);
+    void schedule_stats();
+    void report_stats();
+    void report_crypto_stats(const char *op, const crypto_op_stats_t *cur,
+                             const crypto_op_stats_t *last);
+    void start_version_nego();
+    void handle_packet(packet_ptr_t packet);
+    void register_handlers();
+    void handle_channel_open(const packet_ptr_t &pack);
+    void handle_media_setup(const packet_ptr_t &pack);
+    void handle_video_data(const packet_ptr_t &pack);
+    void on_video_consumed(const packet_ptr_t &pack, uint64_t queue_ns);
+    void register_audio_handlers(u_char chan);
+    void on_audio_consumed(u_char chan, const packet_ptr_t &pack);
+    void report_audio_stats();
+    void register_mic_handlers();
+    void report_mic_stats();
     void encrypt_and_send(packet_ptr_t pack);
+    // Queues the packet for the protocol thread, may be used from any thread
+    void send_later(packet_ptr_t pack);
+    void flush_outbox();
 };
 
 #endif //AAUTO_PROTO_H
@@ -0,0 +1,122 @@
+#include "reactor.h"
+#include <poll.h>
+#include <errno.h>
+#include <fcntl.h>
+
+reactor_t::reactor_t() : last_timer_id_()
+{
+    int desc[2] = {0};
+    if (pipe(desc) != 0)
+        throw std::runtime_error("Can't create a pipe");
+    wake_r_ = desc[0];
+    wake_w_ = desc[1];
+    fcntl(wake_r_, F_SETFL, O_NONBLOCK);
+    fcntl(wake_w_, F_SETFL, O_NONBLOCK);
+}
+
+reactor_t::~reactor_t()
+{
+    close(wake_r_);
+    close(wake_w_);
+}
+
+void reactor_t::wakeup()
+{
+    // A full pipe already guarantees the wake up
+    write(wake_w_, "W", 1);
+}
+
+void reactor_t::watch(int fd, short events, fd_handler_t handler)
+{
+    std::lock_guard<std::mutex> l(mutex_);
+    for(watch_t &w : watches_) {
+        if (w.fd_ == fd) {
+            w.events_ = events;
+            w.handler_ = handler;
+            return;
+        }
+    }
+    watches_.push_back(watch_t{fd, events, handler});
+}
+
+void reactor_t::unwatch(int fd)
+{
+    std::lock_guard<std::mutex> l(mutex_);
+    for(auto i = watches_.begin(); i != watches_.end(); ++i) {
+        if (i->fd_ == fd) {
+            watches_.erase(i);
+            return;
+        }
+    }
+}
+
+uint64_t reactor_t::add_timer(uint32_t millis, timer_handler_t handler)
+{
+    std::lock_guard<std::mutex> l(mutex_);
+    uint64_t id = ++last_timer_id_;
+    timers_.insert(std::make_pair(clock_t::now() + std::chrono::milliseconds(millis),
+                                  std::make_pair(id, handler)));
+    return id;
+}
+
+void reactor_t::cancel_timer(uint64_t id)
+{
+    std::lock_guard<std::mutex> l(mutex_);
+    for(auto i = timers_.begin(); i != timers_.end(); ++i) {
+        if (i->second.first == id) {
+            timers_.erase(i);
+            return;
+        }
+    }
+}
+
+void reactor_t::run_once(int timeout_millis)
+{
+    std::vector<pollfd> fds;
+    std::vector<fd_handler_t> handlers;
+    fds.push_back(pollfd{wake_r_, POLLIN, 0});
+    handlers.push_back([this](short){
+        char buf[64];
+        while(read(wake_r_, buf, sizeof(buf)) > 0) {}
+    });
+    {
+        std::lock_guard<std::mutex> l(mutex_);
+        for(const watch_t &w : watches_) {
+            fds.push_back(pollfd{w.fd_, w.events_, 0});
+            handlers.push_back(w.handler_);
+        }
+
+        // Wake up in time for the nearest timer
+        if (!timers_.empty()) {
+            // Round up, waking up early would just cost another iteration
+            auto left = std::chrono::duration_cast<std::chrono::microseconds>(
+                    timers_.begin()->first - clock_t::now()).count();
+            left = std::max<decltype(left)>((left + 999) / 1000, 0);
+            if (timeout_millis < 0 || left < timeout_millis)
+                timeout_millis = safe_cast<int>(left);
+        }
+    }
+
+    int res = poll(&fds[0], fds.size(), timeout_millis);
+    if (res < 0 && errno != EINTR)
+        throw std::runtime_error("Failed to poll file descriptors");
+
+    for(size_t f=0; res > 0 && f<fds.size(); ++f) {
+        if (fds[f].revents && handlers[f])
+            handlers[f](fds[f].revents);
+    }
+
+    // Run the expired timers, they might schedule new ones
+    while(true)
+    {
+        timer_handler_t handler;
+        {
+            std::lock_guard<std::mutex> l(mutex_);
+            if (timers_.empty() || timers_.begin()->first > clock_t::now())
+                break;
+            handler = timers_.begin()->second.second;
+            timers_.erase(timers_.begin());
+        }
+        handler();
+    }
+}
@@ -0,0 +1,52 @@
+#ifndef AAUTO_REACTOR_H
+#define AAUTO_REACTOR_H
+
+#include "utils.h"
+#include <functional>
+#include <chrono>
+#include <map>
+
+// Single-threaded event loop over a set of file descriptors and one-shot
+// timers. Handlers run on the thread that calls run_once(); watches may be
+// added or removed from any thread.
+class reactor_t {
+public:
+    typedef std::function<void(short revents)> fd_handler_t;
+    typedef std::function<void()> timer_handler_t;
+    typedef std::chrono::steady_clock clock_t;
+
+private:
+    struct watch_t {
+        int fd_;
+        short events_;
+        fd_handler_t handler_;
+    };
+
+    std::mutex mutex_;
+    std::vector<watch_t> watches_;
+    std::multimap<clock_t::time_point, std::pair<uint64_t, timer_handler_t>> timers_;
+    uint64_t last_timer_id_;
+    int wake_r_, wake_w_;
+
+public:
+    reactor_t();
+    ~reactor_t();
+
+    // An empty handler is fine if the caller only needs to be woken up
+    void watch(int fd, short events, fd_handler_t handler);
+    void unwatch(int fd);
+
+    uint64_t add_timer(uint32_t millis, timer_handler_t handler);
+    void cancel_timer(uint64_t id);
+
+    // Interrupts the wait in run_once, lets other threads make a changed
+    // watch take effect right away
+    void wakeup();
+
+    // Waits for at most timeout_millis (forever if negative) for the fds
+    // or timers and dispatches whatever is ready. Exceptions thrown by the
+    // handlers are propagated to the caller.
+    void run_once(int timeout_millis);
+};
+
+#endif //AAUTO_REACTOR_H
@@ -0,0 +1,181 @@
+#include "replay_transport.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+replay_transport_t::replay_transport_t(const std::string &path, const notifier_t *terminator,
+                                       bool realtime) :
+        transport_base_t(terminator), data_(), size_(), pos_(sizeof(CAPTURE_MAGIC)),
+        msg_offset_(), realtime_(realtime), started_(false), anchored_(false),
+        anchor_timestamp_ns_(), messages_(), bytes_(), sessions_(), max_lag_ns_()
+{
+    fd_ = open(path.c_str(), O_RDONLY);
+    if (fd_ < 0) {
+        str_out_t p;
+        p << "Can't open the capture " << path << ": " << strerror(errno);
+        throw std::runtime_error(p);
+    }
+    scope_guard_t close_guard([=]{close(fd_);});
+
+    struct stat st;
+    if (fstat(fd_, &st) != 0)
+        throw std::runtime_error("Can't get the capture size");
+    size_ = size_t(st.st_size);
+    if (size_ < sizeof(CAPTURE_MAGIC))
+        throw std::runtime_error("The capture is too short");
+
+    void *data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+    if (data == MAP_FAILED)
+        throw std::runtime_error("Can't map the capture");
+    data_ = static_cast<const u_char*>(data);
+    // The file is read front to back exactly once
+    madvise(data, size_, MADV_SEQUENTIAL);
+
+    if (memcmp(data_, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) != 0) {
+        munmap(data, size_);
+        throw std::runtime_error("Not an AA capture");
+    }
+
+    reactor_.watch(terminator_->get_pipe_fd(), POLLIN,
+                   [terminator](short){terminator->check_termination();});
+    close_guard.dismiss();
+    TA_INFO() << "Replaying " << path << (realtime_ ? " at the recorded pace" : "");
+}
+
+replay_transport_t::~replay_transport_t()
+{
+    munmap(const_cast<u_char*>(data_), size_);
+    close(fd_);
+}
+
+void replay_transport_t::on_packet_queued()
+{
+    // Nobody is listening, but the writer stats still count the replies
+    std::unique_lock<std::mutex> l(this->queue_mutex_);
+    for(int f=0; f<WRITE_LANE_COUNT; ++f) {
+        writer_stats_.packets_sent_[f] += write_queues_[f].size();
+        std::queue<packet_ptr_t>().swap(write_queues_[f]);
+    }
+}
+
+// Positions pos_ at the next replayed message, skipping the rest
+bool replay_transport_t::next_message(capture_record_t &rec)
+{
+    while(pos_ < size_)
+    {
+        if (size_ - pos_ < sizeof(rec))
+            throw std::runtime_error("Truncated capture record");
+        memcpy(&rec, data_ + pos_, sizeof(rec));
+        if (size_ - pos_ - sizeof(rec) < rec.size_)
+            throw std::runtime_error("Truncated capture record");
+
+        if (rec.kind_ == CAPTURE_PLAIN_IN && (rec.flags_ & AA_ENCRYPTED)) {
+            if (rec.chan_ > AA_MAX_CHANNEL)
+                throw std::runtime_error("Bad channel in the capture");
+            return true;
+        }
+        if (rec.kind_ == CAPTURE_SESSION) {
+            anchored_ = false;
+            sessions_++;
+        }
+        pos_ += sizeof(rec) + rec.size_;
+    }
+    return false;
+}
+
+// Nanoseconds until the message is due, negative if it's late
+int64_t replay_transport_t::time_until(const capture_record_t &rec)
+{
+    auto now = std::chrono::steady_clock::now();
+    if (!started_) {
+        started_ = true;
+        start_ = now;
+    }
+    // The captures written before the session records existed can still
+    // jump backwards, a new session starts there too
+    if (!anchored_ || rec.timestamp_ns_ < anchor_timestamp_ns_) {
+        anchored_ = true;
+        anchor_time_ = now;
+        anchor_timestamp_ns_ = rec.timestamp_ns_;
+    }
+    int64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            now - anchor_time_).count();
+    return int64_t(rec.timestamp_ns_ - anchor_timestamp_ns_) - elapsed;
+}
+
+bool replay_transport_t::read_more(int timeout_millis)
+{
+    // Keep the timers and the termination going, without waiting
+    reactor_.run_once(0);
+
+    bool fed = false;
+    capture_record_t rec;
+    while(next_message(rec))
+    {
+        if (msg_offset_ == 0) {
+            int64_t wait_ns = time_until(rec);
+            if (realtime_ && wait_ns > 0) {
+                // Deliver what we have, or sleep until the message is due
+                if (fed)
+                    return true;
+                int wait_millis = safe_cast<int>((wait_ns + 999999) / 1000000);
+                if (timeout_millis >= 0)
+                    wait_millis = std::min(wait_millis, timeout_millis);
+                reactor_.run_once(wait_millis);
+                return false;
+            }
+            if (realtime_)
+                max_lag_ns_ = std::max(max_lag_ns_, -wait_ns);
+        }
+
+        // Frame the message the same way the phone does, straight from
+        // the mapped file into the parser
+        const u_char *payload = data_ + pos_ + sizeof(rec);
+        size_t len = std::min<size_t>(rec.size_ - msg_offset_, AA_MAX_FRAGMENT_SIZE);
+        bool first = msg_offset_ == 0, last = msg_offset_ + len == rec.size_;
+        size_t header_size = first && !last ? 8 : 4;
+        if (parser_.free_space() < header_size + len)
+            break;
+
+        u_char flags = rec.flags_ & AA_CONTROL_FLAG;
+        if (first)
+            flags |= AA_FIRST_FRAG;
+        if (last)
+            flags |= AA_LAST_FRAG;
+        u_char header[8] = {rec.chan_, flags, u_char(len >> 8), u_char(len),
+                            u_char(rec.size_ >> 24), u_char(rec.size_ >> 16),
+                            u_char(rec.size_ >> 8), u_char(rec.size_)};
+        parser_.feed(header, header_size);
+        parser_.feed(payload + msg_offset_, len);
+        fed = true;
+
+        msg_offset_ += len;
+        if (last) {
+            msg_offset_ = 0;
+            pos_ += sizeof(rec) + rec.size_;
+            messages_++;
+            bytes_ += rec.size_;
+        }
+    }
+
+    if (!fed && pos_ >= size_) {
+        report_stats();
+        throw end_of_stream_exception("End of the capture");
+    }
+    return fed;
+}
+
+void replay_transport_t::report_stats()
+{
+    double elapsed = started_ ? std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start_).count() : 0;
+    TA_INFO() << "Replayed " << messages_ << " messages, " << bytes_ << " bytes of "
+              << sessions_ << " sessions in " << elapsed << "s";
+    if (elapsed > 0)
+        TA_INFO() << "Replay rate: " << messages_ / elapsed << " messages/s, "
+                  << bytes_ / elapsed / (1024*1024) << " MB/s";
+    if (realtime_)
+        TA_INFO() << "Replay max lag: " << max_lag_ns_ / 1000 << " us";
+}
@@ -0,0 +1,46 @@
+#ifndef AAUTO_REPLAY_TRANSPORT_H
+#define AAUTO_REPLAY_TRANSPORT_H
+
+#include "transport_base.h"
+#include "capture.h"
+
+// Plays the incoming messages of a capture back, so a session can be
+// profiled without a phone. The file is mapped into memory and the
+// messages go through the parser, proto_t and the decoder as usual. Only
+// the messages that arrived encrypted are replayed, the session starts
+// right after the handshake. Everything written to it is discarded.
+class replay_transport_t : public transport_base_t {
+    int fd_;
+    const u_char *data_;
+    size_t size_, pos_;
+    // The part of the current message that has been fed to the parser
+    size_t msg_offset_;
+
+    // Keep the recorded intervals between the messages
+    bool realtime_;
+    bool started_;
+    std::chrono::steady_clock::time_point start_;
+    // The recorded timestamp that is due at anchor_time_. Every session in
+    // the capture counts from zero, so the replay re-anchors at each one.
+    bool anchored_;
+    std::chrono::steady_clock::time_point anchor_time_;
+    uint64_t anchor_timestamp_ns_;
+
+    uint64_t messages_, bytes_, sessions_;
+    int64_t max_lag_ns_;
+public:
+    replay_transport_t(const std::string &path, const notifier_t *terminator, bool realtime);
+    virtual ~replay_transport_t();
+
+    bool needs_handshake() const override { return false; }
+
+private:
+    bool read_more(int timeout_millis) override;
+    void on_packet_queued() override;
+
+    bool next_message(capture_record_t &rec);
+    int64_t time_until(const capture_record_t &rec);
+    void report_stats();
+};
+
+#endif //AAUTO_REPLAY_TRANSPORT_H
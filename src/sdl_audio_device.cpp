@@ -0,0 +1,54 @@
+#include "sdl_audio_device.h"
+#include <SDL2/SDL.h>
+
+sdl_audio_device_t::sdl_audio_device_t(const audio_format_t &format, bool capture,
+                                       callback_t callback) :
+        callback_(callback), device_()
+{
+    // About 5ms per callback, rounded down to a power of two
+    uint32_t samples = 64;
+    while(samples * 2 <= format.sample_rate_ / 200)
+        samples *= 2;
+
+    SDL_AudioSpec want = SDL_AudioSpec(), have;
+    want.freq = int(format.sample_rate_);
+    want.format = AUDIO_S16LSB;
+    want.channels = Uint8(format.channels_);
+    want.samples = Uint16(samples);
+    want.callback = &sdl_audio_device_t::on_audio;
+    want.userdata = this;
+
+    // SDL converts the format if the device can't handle it as is
+    const char *kind = capture ? "capture" : "audio";
+    device_ = SDL_OpenAudioDevice(NULL, capture ? 1 : 0, &want, &have, 0);
+    if (device_ == 0) {
+        str_out_t p;
+        p << "Can't open the " << kind << " device: " << SDL_GetError();
+        throw std::runtime_error(p);
+    }
+    TA_DEBUG() << "Opened the " << kind << " device for " << format.sample_rate_ << "Hz, "
+               << format.channels_ << " channels, " << have.samples << " samples per callback";
+}
+
+sdl_audio_device_t::~sdl_audio_device_t()
+{
+    SDL_CloseAudioDevice(device_);
+}
+
+void sdl_audio_device_t::start()
+{
+    SDL_PauseAudioDevice(device_, 0);
+}
+
+void sdl_audio_device_t::stop()
+{
+    SDL_PauseAudioDevice(device_, 1);
+    // Make sure the callback isn't running anymore
+    SDL_LockAudioDevice(device_);
+    SDL_UnlockAudioDevice(device_);
+}
+
+void sdl_audio_device_t::on_audio(void *userdata, u_char *stream, int len)
+{
+    static_cast<sdl_audio_device_t*>(userdata)->callback_(stream, size_t(len));
+}
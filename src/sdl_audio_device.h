@@ -0,0 +1,30 @@
+#ifndef AAUTO_SDL_AUDIO_DEVICE_H
+#define AAUTO_SDL_AUDIO_DEVICE_H
+
+#include "audio_output.h"
+
+// An SDL playback or capture device. The callback gets the device's buffer
+// every few milliseconds, the buffer is kept small so most of the latency
+// budget is left to the jitter buffers and the microphone chunks.
+class sdl_audio_device_t {
+public:
+    typedef std::function<void(u_char *stream, size_t len)> callback_t;
+
+private:
+    callback_t callback_;
+    uint32_t device_;
+
+public:
+    // Throws if the device can't be opened
+    sdl_audio_device_t(const audio_format_t &format, bool capture, callback_t callback);
+    ~sdl_audio_device_t();
+
+    void start();
+    // The callback isn't running anymore once this returns
+    void stop();
+
+private:
+    static void on_audio(void *userdata, u_char *stream, int len);
+};
+
+#endif //AAUTO_SDL_AUDIO_DEVICE_H
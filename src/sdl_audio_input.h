@@ -0,0 +1,21 @@
+#ifndef AAUTO_SDL_AUDIO_INPUT_H
+#define AAUTO_SDL_AUDIO_INPUT_H
+
+#include "audio_input.h"
+#include "sdl_audio_device.h"
+
+// Captures the audio through an SDL capture device
+class sdl_audio_input_t : public audio_input_t {
+    capture_t capture_;
+    sdl_audio_device_t device_;
+public:
+    // Throws if the device can't be opened
+    sdl_audio_input_t(const audio_format_t &format, capture_t capture) :
+            capture_(capture),
+            device_(format, true, [this](u_char *stream, size_t len) { capture_(stream, len); }) {}
+
+    void start() override { device_.start(); }
+    void stop() override { device_.stop(); }
+};
+
+#endif //AAUTO_SDL_AUDIO_INPUT_H
@@ -0,0 +1,18 @@
+#ifndef AAUTO_SDL_AUDIO_OUTPUT_H
+#define AAUTO_SDL_AUDIO_OUTPUT_H
+
+#include "sdl_audio_device.h"
+
+// Plays the audio through an SDL audio device
+class sdl_audio_output_t : public audio_output_t {
+    sdl_audio_device_t device_;
+public:
+    // Throws if the device can't be opened
+    sdl_audio_output_t(const audio_format_t &format, render_t render) :
+            device_(format, false, render) {}
+
+    void start() override { device_.start(); }
+    void stop() override { device_.stop(); }
+};
+
+#endif //AAUTO_SDL_AUDIO_OUTPUT_H
@@ -0,0 +1,328 @@
+#include "socket_transport.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+static std::runtime_error socket_error(const char *what)
+{
+    str_out_t p;
+    p << what << ": " << strerror(errno);
+    return std::runtime_error(p);
+}
+
+socket_transport_t::socket_transport_t(int fd, const std::string &peer_id,
+                                       const notifier_t *terminator) :
+        transport_base_t(terminator), fd_(fd), bytes_read_(), flush_requested_(false),
+        want_write_(false), out_offset_()
+{
+    peer_id_ = peer_id;
+    scope_guard_t close_guard([=]{close(fd);});
+
+    if (fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) | O_NONBLOCK) != 0)
+        throw socket_error("Can't make the socket non-blocking");
+
+    // Large buffers let the kernel absorb the video bursts
+    int buf_size = socket_buffer_size_;
+    setsockopt(fd_, SOL_SOCKET, SO_SNDBUF, &buf_size, sizeof(buf_size));
+    setsockopt(fd_, SOL_SOCKET, SO_RCVBUF, &buf_size, sizeof(buf_size));
+    // Input events are small and must not wait for Nagle. This fails
+    // harmlessly for Unix sockets.
+    int nodelay = 1;
+    setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    reactor_.watch(terminator_->get_pipe_fd(), POLLIN,
+                   [terminator](short){terminator->check_termination();});
+    reactor_.watch(fd_, POLLIN, [this](short revents){on_socket_ready(revents);});
+    close_guard.dismiss();
+}
+
+socket_transport_t::~socket_transport_t()
+{
+    reactor_.unwatch(fd_);
+    close(fd_);
+}
+
+bool socket_transport_t::read_more(int timeout_millis)
+{
+    check_stored_exception();
+
+    uint64_t prev_read = bytes_read_;
+    reactor_.run_once(timeout_millis);
+    check_stored_exception();
+    return bytes_read_ != prev_read;
+}
+
+void socket_transport_t::on_packet_queued()
+{
+    // Try to send it right away, the reactor takes over if the socket is full
+    flush_requested_ = true;
+    flush_pending(false);
+}
+
+void socket_transport_t::on_socket_ready(short revents)
+{
+    if (revents & POLLOUT) {
+        flush_requested_ = true;
+        flush_pending(true);
+    }
+    if (revents & (POLLIN | POLLHUP | POLLERR))
+        read_available();
+}
+
+void socket_transport_t::flush_pending(bool writable)
+{
+    while(flush_requested_)
+    {
+        // If another thread is flushing, it sees the request once it's done
+        std::unique_lock<std::mutex> fl(this->frame_mutex_, std::try_to_lock);
+        if (!fl.owns_lock())
+            return;
+        flush_requested_ = false;
+        // The poll is level triggered, POLLOUT comes again if we skip it
+        if (want_write_ && !writable)
+            return;
+        writable = false;
+        flush_writes();
+    }
+}
+
+void socket_transport_t::read_available()
+{
+    iovec regions[2];
+    size_t count = parser_.free_regions(regions);
+    if (count == 0)
+        return;
+
+    ssize_t res = readv(fd_, regions, safe_cast<int>(count));
+    if (res < 0) {
+        if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+            return;
+        throw socket_error("Failed to read from the socket");
+    }
+    if (res == 0)
+        throw std::runtime_error("The peer has closed the connection");
+
+    parser_.commit(size_t(res));
+    bytes_read_ += res;
+}
+
+// Must be called with frame_mutex_ held
+void socket_transport_t::flush_writes()
+{
+    while(true)
+    {
+        while(out_bufs_.size() < max_gather_buffers_)
+        {
+            {
+                std::unique_lock<std::mutex> l(this->queue_mutex_);
+                if (!stored_exception_.empty())
+                    return;
+                if (take_fragments(fragments_, out_buffer_size_) == 0)
+                    break;
+            }
+            buf_t buf;
+            if (!spare_bufs_.empty()) {
+                buf.swap(spare_bufs_.back());
+                spare_bufs_.pop_back();
+            }
+            frame_fragments(fragments_, buf);
+            fragments_.clear();
+            out_bufs_.push_back(std::move(buf));
+        }
+        if (out_bufs_.empty())
+            break;
+
+        iovec iov[max_gather_buffers_];
+        size_t count = 0;
+        for(const buf_t &buf : out_bufs_) {
+            size_t offset = count == 0 ? out_offset_ : 0;
+            iov[count].iov_base = const_cast<u_char*>(&buf[offset]);
+            iov[count].iov_len = buf.size() - offset;
+            count++;
+        }
+
+        ssize_t res = writev(fd_, iov, safe_cast<int>(count));
+        if (res < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                set_want_write(true);
+                return;
+            }
+            // Reported to the reader, the same way as USB transfer errors
+            str_out_t p;
+            p << "Failed to write to the socket: " << strerror(errno);
+            std::unique_lock<std::mutex> l(this->queue_mutex_);
+            stored_exception_ = p;
+            reactor_.wakeup();
+            return;
+        }
+
+        {
+            std::unique_lock<std::mutex> l(this->queue_mutex_);
+            writer_stats_.transfers_++;
+            writer_stats_.bytes_written_ += res;
+        }
+
+        size_t left = size_t(res);
+        while(left != 0)
+        {
+            size_t avail = out_bufs_.front().size() - out_offset_;
+            if (left < avail) {
+                out_offset_ += left;
+                break;
+            }
+            left -= avail;
+            out_offset_ = 0;
+            spare_bufs_.push_back(std::move(out_bufs_.front()));
+            out_bufs_.pop_front();
+        }
+    }
+
+    set_want_write(false);
+}
+
+void socket_transport_t::set_want_write(bool want_write)
+{
+    if (want_write == want_write_)
+        return;
+    want_write_ = want_write;
+    reactor_.watch(fd_, want_write ? POLLIN | POLLOUT : POLLIN,
+                   [this](short revents){on_socket_ready(revents);});
+    // The reactor might be sleeping without POLLOUT on another thread
+    if (want_write)
+        reactor_.wakeup();
+}
+
+static int connect_tcp(const std::string &host, const std::string &port)
+{
+    addrinfo hints = addrinfo();
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *addrs = nullptr;
+    int res = getaddrinfo(host.c_str(), port.c_str(), &hints, &addrs);
+    if (res != 0) {
+        str_out_t p;
+        p << "Can't resolve " << host << ": " << gai_strerror(res);
+        throw std::runtime_error(p);
+    }
+    ON_BLOCK_EXIT([=]{freeaddrinfo(addrs);});
+
+    for(addrinfo *cur = addrs; cur; cur = cur->ai_next)
+    {
+        int fd = socket(cur->ai_family, cur->ai_socktype, cur->ai_protocol);
+        if (fd < 0)
+            continue;
+        if (connect(fd, cur->ai_addr, cur->ai_addrlen) == 0)
+            return fd;
+        close(fd);
+    }
+    throw socket_error("Failed to connect to the phone");
+}
+
+static int connect_unix(const std::string &path)
+{
+    sockaddr_un addr = sockaddr_un();
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path))
+        throw std::invalid_argument("Unix socket path is too long");
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        throw socket_error("Can't create a socket");
+    if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        close(fd);
+        throw socket_error("Failed to connect to the Unix socket");
+    }
+    return fd;
+}
+
+// Waits for a single incoming connection, keeps an eye on the termination.
+// Sets the peer to the phone's address.
+static int accept_tcp(const std::string &port, const notifier_t *notifier, std::string &peer)
+{
+    addrinfo hints = addrinfo();
+    hints.ai_family = AF_INET6;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    addrinfo *addrs = nullptr;
+    int res = getaddrinfo(nullptr, port.c_str(), &hints, &addrs);
+    if (res != 0) {
+        str_out_t p;
+        p << "Bad port " << port << ": " << gai_strerror(res);
+        throw std::runtime_error(p);
+    }
+    ON_BLOCK_EXIT([=]{freeaddrinfo(addrs);});
+
+    int listen_fd = socket(addrs->ai_family, addrs->ai_socktype, addrs->ai_protocol);
+    if (listen_fd < 0)
+        throw socket_error("Can't create a socket");
+    ON_BLOCK_EXIT([=]{close(listen_fd);});
+
+    // Accept IPv4 phones as well
+    int opt = 0;
+    setsockopt(listen_fd, IPPROTO_IPV6, IPV6_V6ONLY, &opt, sizeof(opt));
+    opt = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (bind(listen_fd, addrs->ai_addr, addrs->ai_addrlen) != 0 || listen(listen_fd, 1) != 0)
+        throw socket_error("Can't listen for the phone");
+    fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+
+    TA_INFO() << "Waiting for the phone on port " << port;
+    reactor_t reactor;
+    reactor.watch(notifier->get_pipe_fd(), POLLIN,
+                  [notifier](short){notifier->check_termination();});
+    reactor.watch(listen_fd, POLLIN, reactor_t::fd_handler_t());
+    while(notifier->check_termination())
+    {
+        sockaddr_storage addr;
+        socklen_t addr_len = sizeof(addr);
+        int fd = accept(listen_fd, reinterpret_cast<sockaddr*>(&addr), &addr_len);
+        if (fd >= 0) {
+            char host[NI_MAXHOST];
+            if (getnameinfo(reinterpret_cast<sockaddr*>(&addr), addr_len, host, sizeof(host),
+                            nullptr, 0, NI_NUMERICHOST) == 0)
+                peer = std::string("tcp:") + host;
+            return fd;
+        }
+        if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+            throw socket_error("Failed to accept the connection");
+        reactor.run_once(-1);
+    }
+    return -1;
+}
+
+transport_ptr_t open_socket_transport(const std::string &address, const notifier_t *notifier)
+{
+    size_t sep = address.find(':');
+    std::string kind = address.substr(0, sep);
+    std::string rest = sep == std::string::npos ? std::string() : address.substr(sep + 1);
+
+    int fd;
+    std::string peer;
+    if (kind == "tcp") {
+        size_t port_sep = rest.rfind(':');
+        if (port_sep == std::string::npos)
+            throw std::invalid_argument("Expected tcp:HOST:PORT");
+        fd = connect_tcp(rest.substr(0, port_sep), rest.substr(port_sep + 1));
+        peer = "tcp:" + rest.substr(0, port_sep);
+    } else if (kind == "tcp-listen") {
+        fd = accept_tcp(rest, notifier, peer);
+    } else if (kind == "unix") {
+        fd = connect_unix(rest);
+        peer = address;
+    } else {
+        str_out_t p;
+        p << "Unknown transport address: " << address;
+        throw std::invalid_argument(p);
+    }
+
+    TA_INFO() << "Connected to " << address;
+    return transport_ptr_t(new socket_transport_t(fd, peer, notifier));
+}
@@ -0,0 +1,54 @@
+#ifndef AAUTO_SOCKET_TRANSPORT_H
+#define AAUTO_SOCKET_TRANSPORT_H
+
+#include "transport_base.h"
+#include <deque>
+#include <atomic>
+
+// Stream socket backend, for the wireless sessions over TCP and for local
+// testing over Unix sockets. The socket is non-blocking and driven by the
+// reactor: reads go straight into the parser's ring and the framed writes
+// are flushed with one writev() per batch.
+class socket_transport_t : public transport_base_t {
+    int fd_;
+    uint64_t bytes_read_;
+    // Set by the producers, whoever holds frame_mutex_ flushes until it's
+    // clear, so the producers never wait for another thread's writev()
+    std::atomic<bool> flush_requested_;
+
+    // Guarded by frame_mutex_. Framed data waiting for the socket, the first
+    // buffer might have been partially written already.
+    bool want_write_;
+    std::deque<buf_t> out_bufs_;
+    size_t out_offset_;
+    std::vector<buf_t> spare_bufs_;
+    std::vector<out_fragment_t> fragments_;
+
+    static const int socket_buffer_size_ = 1024*1024;
+    // Each buffer is filled up to this size. Only a few of them are framed
+    // ahead, so the lane priorities still apply while the socket is busy.
+    static const size_t out_buffer_size_ = 32768;
+    static const size_t max_gather_buffers_ = 8;
+public:
+    // Takes the ownership of a connected stream socket
+    socket_transport_t(int fd, const std::string &peer_id, const notifier_t *terminator);
+    virtual ~socket_transport_t();
+
+private:
+    bool read_more(int timeout_millis) override;
+    void on_packet_queued() override;
+
+    void on_socket_ready(short revents);
+    void read_available();
+    void flush_pending(bool writable);
+    void flush_writes();
+    void set_want_write(bool want_write);
+};
+
+// Connects to the address, one of:
+//  tcp:HOST:PORT - connect to the phone over TCP
+//  tcp-listen:PORT - wait for the phone to connect
+//  unix:PATH - connect to a Unix socket
+transport_ptr_t open_socket_transport(const std::string &address, const notifier_t *notifier);
+
+#endif //AAUTO_SOCKET_TRANSPORT_H
@@ -0,0 +1,141 @@
+#include "touch.h"
+#include "aa_messages.h"
+#include <chrono>
+
+touch_input_t::touch_input_t(reactor_t &reactor, sender_t send) :
+        reactor_(reactor), send_(send), moved_(false), move_timestamp_ns_(),
+        flush_timer_(), stats_()
+{
+    pointers_.reserve(max_pointers_);
+}
+
+touch_input_t::~touch_input_t()
+{
+    std::lock_guard<std::mutex> l(mutex_);
+    if (flush_timer_)
+        reactor_.cancel_timer(flush_timer_);
+}
+
+uint64_t touch_input_t::now_ns()
+{
+    return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+int touch_input_t::find_pointer(uint32_t id)
+{
+    for(size_t f=0; f<pointers_.size(); ++f)
+        if (pointers_[f].id_ == id)
+            return int(f);
+    return -1;
+}
+
+void touch_input_t::pointer_down(uint32_t id, int x, int y)
+{
+    uint64_t ts = now_ns();
+    std::lock_guard<std::mutex> l(mutex_);
+    int idx = find_pointer(id);
+    if (idx >= 0) {
+        // We've missed the release, treat it as a move
+        pointers_[idx].x_ = x;
+        pointers_[idx].y_ = y;
+        send_locked(ts, AA_INPUT_ACTION_MOVE, size_t(idx));
+        return;
+    }
+    if (pointers_.size() >= max_pointers_)
+        return;
+
+    pointers_.push_back(pointer_t{id, x, y});
+    send_locked(ts, pointers_.size() == 1 ? AA_INPUT_ACTION_MOUSEDOWN :
+                    AA_INPUT_ACTION_POINTER_DOWN, pointers_.size() - 1);
+}
+
+void touch_input_t::pointer_move(uint32_t id, int x, int y)
+{
+    uint64_t ts = now_ns();
+    std::lock_guard<std::mutex> l(mutex_);
+    int idx = find_pointer(id);
+    if (idx < 0)
+        return;
+    stats_.moves_received_++;
+    if (pointers_[idx].x_ == x && pointers_[idx].y_ == y)
+        return;
+
+    pointers_[idx].x_ = x;
+    pointers_[idx].y_ = y;
+    moved_ = true;
+    move_timestamp_ns_ = ts;
+    if (!flush_timer_) {
+        flush_timer_ = reactor_.add_timer(move_period_millis_, [this]{ flush_moves(); });
+        // The reactor might be sleeping with a longer timeout
+        reactor_.wakeup();
+    }
+}
+
+void touch_input_t::pointer_up(uint32_t id, int x, int y)
+{
+    uint64_t ts = now_ns();
+    std::lock_guard<std::mutex> l(mutex_);
+    int idx = find_pointer(id);
+    if (idx < 0)
+        return;
+
+    pointers_[idx].x_ = x;
+    pointers_[idx].y_ = y;
+    send_locked(ts, pointers_.size() == 1 ? AA_INPUT_ACTION_MOUSEUP :
+                    AA_INPUT_ACTION_POINTER_UP, size_t(idx));
+    pointers_.erase(pointers_.begin() + idx);
+}
+
+void touch_input_t::cancel()
+{
+    uint64_t ts = now_ns();
+    std::lock_guard<std::mutex> l(mutex_);
+    if (pointers_.empty())
+        return;
+    // A single cancel ends the gesture for all the pointers
+    send_locked(ts, AA_INPUT_ACTION_CANCEL, 0);
+    pointers_.clear();
+}
+
+void touch_input_t::flush_moves()
+{
+    std::lock_guard<std::mutex> l(mutex_);
+    flush_timer_ = 0;
+    if (moved_ && !pointers_.empty())
+        send_locked(move_timestamp_ns_, AA_INPUT_ACTION_MOVE, 0);
+}
+
+// Must be called with mutex_ held. The message carries the current position
+// of every pointer, so it also delivers any pending moves. The sender only
+// queues the message, so the events stay in order without blocking the UI.
+void touch_input_t::send_locked(uint64_t timestamp_ns, uint32_t action, size_t action_index)
+{
+    typedef touch_event_msg_t msg;
+    packet_ptr_t pack = make_packet_common(AA_TOUCHSCREEN_CHANNEL, AA_TOUCHSCREEN_INPUT,
+                                           true, 16 + 16 * pointers_.size());
+    wire_writer_t w(pack->content_);
+    w.varint<msg::timestamp_ns>(timestamp_ns);
+    w.message<msg::touch>([&]{
+        for(const pointer_t &p : pointers_)
+            w.message<msg::pointer>([&]{
+                w.varint<msg::x>(uint32_t(std::max(p.x_, 0)));
+                w.varint<msg::y>(uint32_t(std::max(p.y_, 0)));
+                w.varint<msg::pointer_id>(p.id_);
+            });
+        w.varint<msg::action_index>(action_index);
+        w.varint<msg::action>(action);
+    });
+
+    if (moved_)
+        stats_.moves_sent_++;
+    moved_ = false;
+    stats_.events_sent_++;
+    send_(pack);
+}
+
+touch_stats_t touch_input_t::get_stats()
+{
+    std::lock_guard<std::mutex> l(mutex_);
+    return stats_;
+}
@@ -0,0 +1,71 @@
+#ifndef AAUTO_TOUCH_H
+#define AAUTO_TOUCH_H
+
+#include "utils.h"
+#include "aa_helpers.h"
+#include "reactor.h"
+#include <functional>
+
+// The touchscreen advertised to the phone, the events are in its coordinates
+static const int AA_TOUCHSCREEN_WIDTH = 800;
+static const int AA_TOUCHSCREEN_HEIGHT = 480;
+
+struct touch_stats_t {
+    uint64_t events_sent_;
+    // Moves reported by the UI and the messages that carried them
+    uint64_t moves_received_, moves_sent_;
+};
+
+// Tracks the pointers on the touchscreen and sends their state to the
+// phone. Like Android's MotionEvent, every message carries all the pointers
+// that are down. Presses and releases are handed to the sender right away,
+// moves are coalesced and sent at most once per display frame, so a drag
+// can't flood the writer. May be used from any thread.
+class touch_input_t {
+public:
+    // Called with the touch lock held, it must queue the packet rather than
+    // write it
+    typedef std::function<void(const packet_ptr_t &packet)> sender_t;
+
+private:
+    struct pointer_t {
+        uint32_t id_;
+        int x_, y_;
+    };
+
+    reactor_t &reactor_;
+    sender_t send_;
+
+    std::mutex mutex_;
+    std::vector<pointer_t> pointers_;
+    // Moves that haven't been sent yet, and the time of the latest one
+    bool moved_;
+    uint64_t move_timestamp_ns_;
+    uint64_t flush_timer_;
+    touch_stats_t stats_;
+
+    static const size_t max_pointers_ = 10;
+    // About one 60Hz display frame
+    static const uint32_t move_period_millis_ = 16;
+public:
+    // The pending moves are sent from the reactor's timers
+    touch_input_t(reactor_t &reactor, sender_t send);
+    ~touch_input_t();
+
+    void pointer_down(uint32_t id, int x, int y);
+    void pointer_move(uint32_t id, int x, int y);
+    void pointer_up(uint32_t id, int x, int y);
+    // Aborts the gesture and forgets all the pointers
+    void cancel();
+
+    touch_stats_t get_stats();
+    // Nanoseconds of the monotonic clock, the touch events are stamped with it
+    static uint64_t now_ns();
+
+private:
+    int find_pointer(uint32_t id);
+    void flush_moves();
+    void send_locked(uint64_t timestamp_ns, uint32_t action, size_t action_index);
+};
+
+#endif //AAUTO_TOUCH_H
@@ -5,10 +5,17 @@
 #include "transport.h"
 #include <libusb.h>
 #include <assert.h>
+#include <chrono>
+#include <map>
+#include <set>
+#include <algorithm>
+#include <poll.h>
 #include "aa_helpers.h"
 
 static const int GOOGLE_VENDOR_ID = 0x18d1;
-static const int GOOGLE_ACCESSORY_PID = 0x2d00;
+// Accessory, accessory+ADB and their audio variants
+static const int GOOGLE_ACCESSORY_PID_FIRST = 0x2d00;
+static const int GOOGLE_ACCESSORY_PID_LAST = 0x2d05;
 static const int DEFAULT_TIMEOUT_MS = 1000;
 
 // OAP Control requests
@@ -23,13 +30,6 @@ enum acc_control_indexes {
     ACC_IDX_MOD = 1
 };
 
-enum aa_packet_flags {
-    AA_ENCRYPTED = 0b1000,
-    AA_LAST_FRAG = 0b0010,
-    AA_FIRST_FRAG = 0b0001,
-    AA_CONTROL_FLAG = 0b0100,
-};
-
 static const char *ACC_MANUFACTURER = "Android";
 static const char *ACC_MODEL = "Android Auto";
 
@@ -45,6 +45,148 @@ usb_context_ptr_t get_usb_lib()
     return usb_ctx;
 }
 
+// Devices that we've switched into the accessory mode before, by VID/PID.
+// They are probed first after a reconnect.
+static std::set<uint32_t> known_phones;
+// Devices that didn't speak the accessory protocol, so we don't probe
+// every device on the bus again after a reconnect. They are keyed by the
+// bus address as well, so a re-plugged device is probed again, and the
+// entries expire in case a phone only refused for a moment.
+static std::map<uint64_t, std::chrono::steady_clock::time_point> non_phones;
+static const int NON_PHONE_EXPIRY_SEC = 60;
+
+enum device_priority_e {
+    DEV_ACCESSORY, DEV_KNOWN_PHONE, DEV_UNKNOWN, DEV_NOT_A_PHONE
+};
+
+static uint32_t device_key(const libusb_device_descriptor &desc)
+{
+    return (uint32_t(desc.idVendor) << 16) | desc.idProduct;
+}
+
+static uint64_t device_instance_key(libusb_device *device, const libusb_device_descriptor &desc)
+{
+    return (uint64_t(libusb_get_bus_number(device)) << 40) |
+           (uint64_t(libusb_get_device_address(device)) << 32) | device_key(desc);
+}
+
+static bool is_non_phone(libusb_device *device, const libusb_device_descriptor &desc)
+{
+    auto found = non_phones.find(device_instance_key(device, desc));
+    if (found == non_phones.end())
+        return false;
+    if (std::chrono::steady_clock::now() < found->second)
+        return true;
+    non_phones.erase(found);
+    return false;
+}
+
+static void forget_non_phone(libusb_device *device)
+{
+    libusb_device_descriptor desc;
+    if (libusb_get_device_descriptor(device, &desc) == 0)
+        non_phones.erase(device_instance_key(device, desc));
+}
+
+static device_priority_e device_priority(libusb_device *device)
+{
+    libusb_device_descriptor desc;
+    if (libusb_get_device_descriptor(device, &desc) < 0)
+        return DEV_NOT_A_PHONE;
+    if (desc.idVendor == GOOGLE_VENDOR_ID && desc.idProduct >= GOOGLE_ACCESSORY_PID_FIRST
+            && desc.idProduct <= GOOGLE_ACCESSORY_PID_LAST)
+        return DEV_ACCESSORY;
+    if (known_phones.count(device_key(desc)))
+        return DEV_KNOWN_PHONE;
+    if (is_non_phone(device, desc))
+        return DEV_NOT_A_PHONE;
+    return DEV_UNKNOWN;
+}
+
+static void sort_by_priority(std::vector<libusb_device*> &devices)
+{
+    std::stable_sort(devices.begin(), devices.end(), [](libusb_device *a, libusb_device *b) {
+        return device_priority(a) < device_priority(b);
+    });
+}
+
+// Returns the opened device if it's already an accessory, otherwise tries to
+// switch it into the accessory mode. The device will then re-enumerate
+// itself and appear later.
+device_ptr_t probe_device(libusb_device *device)
+{
+    device_priority_e prio = device_priority(device);
+    if (prio == DEV_NOT_A_PHONE)
+        return device_ptr_t();
+
+    libusb_device_descriptor desc;
+    if (libusb_get_device_descriptor(device, &desc) < 0)
+        return device_ptr_t();
+
+    libusb_device_handle *hndl;
+    if (libusb_open(device, &hndl) < 0) {
+        TA_TRACE() << "Failed to open vid=" << desc.idVendor
+                    << ", pid=" << desc.idProduct;
+        return device_ptr_t();
+    }
+
+    device_ptr_t dev(hndl, [](libusb_device_handle *d) {libusb_close(d);});
+    // Found our accessory device!
+    if (prio == DEV_ACCESSORY)
+        return dev;
+
+    // Try to switch device into the accessory mode
+    u_char buf[512];
+    int res = libusb_control_transfer(dev.get(), LIBUSB_ENDPOINT_IN|LIBUSB_REQUEST_TYPE_VENDOR,
+        ACC_REQ_GET_PROTOCOL, 0, 0, buf, 512, DEFAULT_TIMEOUT_MS);
+    if (res != 2) {
+        TA_TRACE() << "Failed to send control ouput to vid=" << desc.idVendor
+                << ", pid=" << desc.idProduct;
+        non_phones[device_instance_key(device, desc)] = std::chrono::steady_clock::now() +
+                std::chrono::seconds(NON_PHONE_EXPIRY_SEC);
+        return device_ptr_t();
+    }
+
+    TA_DEBUG() << "Found device vid=" << desc.idVendor
+                  << ", pid=" << desc.idProduct << " supporting ACC version "
+                  << (int)buf[0] << "." << (int)buf[1];
+
+    res = libusb_control_transfer(dev.get(), LIBUSB_ENDPOINT_OUT|LIBUSB_REQUEST_TYPE_VENDOR,
+                                  ACC_REQ_SEND_STRING, 0, ACC_IDX_MAN,
+                                  (u_char *)ACC_MANUFACTURER,
+                                  (uint16_t) strlen(ACC_MANUFACTURER)+1, DEFAULT_TIMEOUT_MS);
+    if (res != strlen(ACC_MANUFACTURER)+1)
+    {
+        TA_DEBUG() << "Device vid=" << desc.idVendor
+            << ", pid=" << desc.idProduct << " couldn't handle ACC request";
+        return device_ptr_t();
+    }
+
+    res = libusb_control_transfer(dev.get(), LIBUSB_ENDPOINT_OUT|LIBUSB_REQUEST_TYPE_VENDOR,
+                                  ACC_REQ_SEND_STRING, 0, ACC_IDX_MOD,
+                                  (u_char *)ACC_MODEL,
+                                  (uint16_t) strlen(ACC_MODEL)+1, DEFAULT_TIMEOUT_MS);
+    if (res != strlen(ACC_MODEL)+1)
+    {
+        TA_DEBUG() << "Device vid=" << desc.idVendor
+            << ", pid=" << desc.idProduct << " couldn't handle ACC request";
+        return device_ptr_t();
+    }
+
+    res = libusb_control_transfer(dev.get(), LIBUSB_ENDPOINT_OUT|LIBUSB_REQUEST_TYPE_VENDOR,
+                                  ACC_REQ_START, 0, 0,
+                                  NULL, 0, DEFAULT_TIMEOUT_MS);
+    if (res != 0)
+    {
+        TA_DEBUG() << "Device vid=" << desc.idVendor
+            << ", pid=" << desc.idProduct << " failed to start ACC";
+        return device_ptr_t();
+    }
+
+    known_phones.insert(device_key(desc));
+    return device_ptr_t();
+}
+
 device_ptr_t enumerate_devices(const usb_context_ptr_t &ctx)
 {
     libusb_device **devices = nullptr;
@@ -54,85 +196,170 @@ device_ptr_t enumerate_devices(const usb_context_ptr_t &ctx)
     if(cnt < 0)
         throw std::runtime_error("Failed to enumerate USB devices");
 
-    for(int f=0;f<cnt; ++f)
+    std::vector<libusb_device*> sorted(devices, devices+cnt);
+    sort_by_priority(sorted);
+    for(libusb_device *device : sorted)
     {
-        libusb_device_descriptor desc;
-        if (libusb_get_device_descriptor(devices[f], &desc) < 0)
-            continue;
-
-        libusb_device_handle *hndl;
-        if (libusb_open(devices[f], &hndl) < 0) {
-            TA_TRACE() << "Failed to open vid=" << desc.idVendor
-                        << ", pid=" << desc.idProduct;
-            continue;
-        }
-
-        device_ptr_t dev(hndl, [](libusb_device_handle *d) {libusb_close(d);});
-        // Found our accessory device!
-        if (desc.idVendor == GOOGLE_VENDOR_ID && desc.idProduct == GOOGLE_ACCESSORY_PID)
+        device_ptr_t dev = probe_device(device);
+        if (dev)
             return dev;
+    }
 
-        // Try to switch device into the accessory mode
-        u_char buf[512];
-        int res = libusb_control_transfer(dev.get(), LIBUSB_ENDPOINT_IN|LIBUSB_REQUEST_TYPE_VENDOR,
-            ACC_REQ_GET_PROTOCOL, 0, 0, buf, 512, DEFAULT_TIMEOUT_MS);
-        if (res != 2) {
-            TA_TRACE() << "Failed to send control ouput to vid=" << desc.idVendor
-                    << ", pid=" << desc.idProduct;
-            continue;
-        }
+    return device_ptr_t();
+}
 
-        TA_DEBUG() << "Found device vid=" << desc.idVendor
-                      << ", pid=" << desc.idProduct << " supporting ACC version "
-                      << (int)buf[0] << "." << (int)buf[1];
+static void LIBUSB_CALL on_pollfd_added(int fd, short events, void *user_data)
+{
+    static_cast<reactor_t*>(user_data)->watch(fd, events, reactor_t::fd_handler_t());
+}
 
-        res = libusb_control_transfer(dev.get(), LIBUSB_ENDPOINT_OUT|LIBUSB_REQUEST_TYPE_VENDOR,
-                                      ACC_REQ_SEND_STRING, 0, ACC_IDX_MAN,
-                                      (u_char *)ACC_MANUFACTURER,
-                                      (uint16_t) strlen(ACC_MANUFACTURER)+1, DEFAULT_TIMEOUT_MS);
-        if (res != strlen(ACC_MANUFACTURER)+1)
-        {
-            TA_DEBUG() << "Device vid=" << desc.idVendor
-                << ", pid=" << desc.idProduct << " couldn't handle ACC request";
-            continue;
-        }
+static void LIBUSB_CALL on_pollfd_removed(int fd, void *user_data)
+{
+    static_cast<reactor_t*>(user_data)->unwatch(fd);
+}
 
-        res = libusb_control_transfer(dev.get(), LIBUSB_ENDPOINT_OUT|LIBUSB_REQUEST_TYPE_VENDOR,
-                                      ACC_REQ_SEND_STRING, 0, ACC_IDX_MOD,
-                                      (u_char *)ACC_MODEL,
-                                      (uint16_t) strlen(ACC_MODEL)+1, DEFAULT_TIMEOUT_MS);
-        if (res != strlen(ACC_MODEL)+1)
-        {
-            TA_DEBUG() << "Device vid=" << desc.idVendor
-                << ", pid=" << desc.idProduct << " couldn't handle ACC request";
-            continue;
-        }
+// Registers the libusb file descriptors with the reactor and keeps them in
+// sync. We only need to be woken up by them, the events are dispatched by
+// run_usb_reactor afterwards.
+void watch_usb_fds(libusb_context *ctx, reactor_t *reactor)
+{
+    const libusb_pollfd **fds = libusb_get_pollfds(ctx);
+    if (!fds)
+        throw std::runtime_error("libusb can't export its file descriptors");
+    ON_BLOCK_EXIT([=]{libusb_free_pollfds(fds);});
+
+    for(const libusb_pollfd **cur = fds; *cur; ++cur)
+        reactor->watch((*cur)->fd, (*cur)->events, reactor_t::fd_handler_t());
+    libusb_set_pollfd_notifiers(ctx, &on_pollfd_added, &on_pollfd_removed, reactor);
+}
 
-        res = libusb_control_transfer(dev.get(), LIBUSB_ENDPOINT_OUT|LIBUSB_REQUEST_TYPE_VENDOR,
-                                      ACC_REQ_START, 0, 0,
-                                      NULL, 0, DEFAULT_TIMEOUT_MS);
-        if (res != 0)
+void unwatch_usb_fds(libusb_context *ctx, reactor_t *reactor)
+{
+    libusb_set_pollfd_notifiers(ctx, NULL, NULL, NULL);
+
+    const libusb_pollfd **fds = libusb_get_pollfds(ctx);
+    if (!fds)
+        return;
+    for(const libusb_pollfd **cur = fds; *cur; ++cur)
+        reactor->unwatch((*cur)->fd);
+    libusb_free_pollfds(fds);
+}
+
+// Runs one reactor iteration and lets libusb process whatever became ready
+void run_usb_reactor(libusb_context *ctx, reactor_t &reactor, int timeout_millis)
+{
+    // Older platforms need libusb to be called for its internal timeouts
+    timeval tv = {0, 0};
+    if (!libusb_pollfds_handle_timeouts(ctx) && libusb_get_next_timeout(ctx, &tv) == 1) {
+        int usb_timeout = safe_cast<int>(tv.tv_sec * 1000 + tv.tv_usec / 1000);
+        if (timeout_millis < 0 || usb_timeout < timeout_millis)
+            timeout_millis = usb_timeout;
+    }
+
+    reactor.run_once(timeout_millis);
+
+    timeval zero = {0, 0};
+    int res = libusb_handle_events_timeout_completed(ctx, &zero, nullptr);
+    if (res < 0 && res != LIBUSB_ERROR_INTERRUPTED)
+        throw std::runtime_error(libusb_error_name(res));
+}
+
+struct hotplug_events_t {
+    std::vector<libusb_device*> arrived_, left_;
+};
+
+static int LIBUSB_CALL on_hotplug(libusb_context *ctx, libusb_device *device,
+                                  libusb_hotplug_event event, void *user_data)
+{
+    // Opening devices from inside the callback isn't safe, just queue it
+    auto events = static_cast<hotplug_events_t*>(user_data);
+    if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)
+        events->arrived_.push_back(libusb_ref_device(device));
+    else
+        events->left_.push_back(libusb_ref_device(device));
+    return 0; //Stay registered
+}
+
+// Waits for the accessory device using the hotplug notifications, so the
+// devices are probed once when they appear instead of on every poll
+device_ptr_t wait_for_accessory(const usb_context_ptr_t &ctx, const notifier_t *notifier)
+{
+    hotplug_events_t events;
+    libusb_hotplug_callback_handle handle;
+    // Existing devices are reported right away thanks to the ENUMERATE flag
+    int res = libusb_hotplug_register_callback(ctx.get(), libusb_hotplug_event(
+                                                   LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+                                                   LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT),
+                                               LIBUSB_HOTPLUG_ENUMERATE,
+                                               LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+                                               LIBUSB_HOTPLUG_MATCH_ANY,
+                                               &on_hotplug, &events, &handle);
+    if (res != LIBUSB_SUCCESS)
+        throw std::runtime_error(libusb_error_name(res));
+    ON_BLOCK_EXIT([&]{
+        libusb_hotplug_deregister_callback(ctx.get(), handle);
+        for(libusb_device *d : events.arrived_)
+            libusb_unref_device(d);
+        for(libusb_device *d : events.left_)
+            libusb_unref_device(d);
+    });
+
+    // Sleep until a device arrives or we're asked to quit
+    reactor_t reactor;
+    reactor.watch(notifier->get_pipe_fd(), POLLIN,
+                  [notifier](short){notifier->check_termination();});
+    watch_usb_fds(ctx.get(), &reactor);
+    ON_BLOCK_EXIT([&]{unwatch_usb_fds(ctx.get(), &reactor);});
+
+    while(notifier->check_termination())
+    {
+        std::vector<libusb_device*> pending, left;
+        pending.swap(events.arrived_);
+        left.swap(events.left_);
+        ON_BLOCK_EXIT([&]{
+            for(libusb_device *d : pending)
+                libusb_unref_device(d);
+            for(libusb_device *d : left)
+                libusb_unref_device(d);
+        });
+
+        // Whatever shows up at this address next is a new device
+        for(libusb_device *device : left)
+            forget_non_phone(device);
+
+        // Accessories and the phones we've seen before go first
+        sort_by_priority(pending);
+        for(libusb_device *device : pending)
         {
-            TA_DEBUG() << "Device vid=" << desc.idVendor
-                << ", pid=" << desc.idProduct << " failed to start ACC";
+            device_ptr_t dev = probe_device(device);
+            if (dev && libusb_reset_device(dev.get()) == LIBUSB_SUCCESS)
+                return dev;
         }
 
-        //Don't do anything, device will re-enumerate itself and appear later
+        run_usb_reactor(ctx.get(), reactor, -1);
     }
-
     return device_ptr_t();
 }
 
 transport_ptr_t find_usb_transport(const usb_context_ptr_t &ctx, const notifier_t *notifier)
 {
     device_ptr_t dev;
-    TA_INFO() << "Enumerating USB devices";
-    while (!dev)
-    {
-        dev = enumerate_devices(ctx);
-        if (!dev || libusb_reset_device(dev.get()) != LIBUSB_SUCCESS)
-            notifier->sleep(1000);
-        TA_TRACE() << "ACC device not found, retrying";
+    if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+        TA_INFO() << "Waiting for USB devices";
+        dev = wait_for_accessory(ctx, notifier);
+    } else {
+        TA_INFO() << "Enumerating USB devices";
+        while (!dev)
+        {
+            notifier->check_termination();
+            dev = enumerate_devices(ctx);
+            if (dev && libusb_reset_device(dev.get()) != LIBUSB_SUCCESS)
+                dev.reset();
+            if (!dev) {
+                TA_TRACE() << "ACC device not found, retrying";
+                notifier->sleep(1000);
+            }
+        }
     }
     TA_INFO() << "Found an ACC device.";
     // Always detach the kernel first
@@ -146,16 +373,27 @@ std::ostream &transport_t::operator<<(std::ostream &ost) {
 }
 
 transport_t::transport_t(const usb_context_ptr_t &ctx_, const device_ptr_t &dev,
-                         const notifier_t *terminator) :
-        ctx_(ctx_), dev_(dev), terminator_(terminator), claimed_interface_(false),
-        writer_termination_requested_(false), cur_consumed_(), read_window_size_()
+                         const notifier_t *terminator, size_t in_transfers) :
+        transport_base_t(terminator), ctx_(ctx_), dev_(dev), claimed_interface_(false),
+        out_transfer_size_(), out_in_flight_(), writer_termination_requested_(false),
+        in_transfer_size_(), reader_(in_transfers, [this](const std::string &error) {
+            std::unique_lock<std::mutex> l(this->queue_mutex_);
+            if (this->stored_exception_.empty())
+                this->stored_exception_ = error;
+        })
 {
-    stream_buffer_.resize(stream_buffer_size_);
-
     std::shared_ptr<libusb_device> dev_info(libusb_get_device(dev_.get()),
         [](libusb_device* d){libusb_unref_device(d);});
     assert(dev_info);
 
+    // The serial number tells the phones apart, the accessory mode VID/PID don't
+    libusb_device_descriptor desc;
+    unsigned char serial[256];
+    if (libusb_get_device_descriptor(dev_info.get(), &desc) == 0 && desc.iSerialNumber &&
+            libusb_get_string_descriptor_ascii(dev_.get(), desc.iSerialNumber,
+                                               serial, sizeof(serial)) > 0)
+        peer_id_ = std::string("usb:") + reinterpret_cast<const char*>(serial);
+
     TA_TRACE() << "Retrieving USB configuration";
     libusb_config_descriptor *config = 0;
     //We're always using the first configuration
@@ -186,11 +424,16 @@ transport_t::transport_t(const usb_context_ptr_t &ctx_, const device_ptr_t &dev,
                     endpoint_in_found = true;
                     //The read buffer size must be a multiply of wMaxPacketSize
                     //to avoid buffer overruns.
-                    read_window_size_ = (stream_buffer_size_ - AA_PACKET_HEADER_SIZE);
-                    read_window_size_ -= (read_window_size_ % epdesc->wMaxPacketSize);
+                    in_transfer_size_ = in_transfer_buffer_size_;
+                    in_transfer_size_ -= (in_transfer_size_ % epdesc->wMaxPacketSize);
                 } else {
                     endpoint_out = epdesc->bEndpointAddress;
                     endpoint_out_found = true;
+                    //Room for the largest fragment, rounded up to wMaxPacketSize
+                    out_transfer_size_ = AA_MAX_FRAGMENT_SIZE + AA_MAX_RECORD_OVERHEAD + 8;
+                    if (out_transfer_size_ % epdesc->wMaxPacketSize)
+                        out_transfer_size_ += epdesc->wMaxPacketSize -
+                                out_transfer_size_ % epdesc->wMaxPacketSize;
                 }
             }
 
@@ -233,13 +476,32 @@ transport_t::transport_t(const usb_context_ptr_t &ctx_, const device_ptr_t &dev,
 
     TA_INFO() << "USB interface ready";
 
-    assert(read_window_size_);
+    assert(in_transfer_size_);
+    assert(out_transfer_size_);
 
     this->claimed_interface_ = true;
     this->endpoint_in_ = endpoint_in;
     this->endpoint_out_ = endpoint_out;
     this->interface_id_ = interface_id;
 
+    for(size_t f=0; f<out_transfer_count_; ++f)
+    {
+        std::shared_ptr<out_transfer_t> transfer(new out_transfer_t(),
+            [](out_transfer_t *t){libusb_free_transfer(t->xfer_); delete t;});
+        transfer->owner_ = this;
+        transfer->xfer_ = libusb_alloc_transfer(0);
+        if (!transfer->xfer_)
+            throw std::runtime_error("Failed to allocate an OUT transfer");
+        transfer->buf_.reserve(out_transfer_size_);
+        out_transfers_.push_back(transfer);
+        free_out_transfers_.push_back(transfer.get());
+    }
+
+    // Both the USB transfers and the termination requests wake up the reader
+    reactor_.watch(terminator_->get_pipe_fd(), POLLIN,
+                   [terminator](short){terminator->check_termination();});
+    watch_usb_fds(this->ctx_.get(), &reactor_);
+
     this->writer_thread_ = std::thread([](transport_t *t){t->writer_loop();}, this);
 }
 
@@ -253,162 +515,150 @@ transport_t::~transport_t() {
     if (this->writer_thread_.joinable())
         this->writer_thread_.join();
 
+    unwatch_usb_fds(this->ctx_.get(), &reactor_);
+    cancel_transfers();
+
     if (claimed_interface_)
         libusb_release_interface(this->dev_.get(), interface_id_); //No error checking
 }
 
-bool transport_t::read_more(unsigned int timeout_millis)
+void transport_t::cancel_transfers()
 {
+    //Cancellation fails harmlessly for idle transfers
+    reader_.cancel();
+    for(const auto &transfer : out_transfers_)
+        libusb_cancel_transfer(transfer->xfer_);
+
+    // Wait for the cancellations to be delivered, the transfers can't be
+    // freed while libusb still owns them
+    while(true)
     {
-        std::unique_lock<std::mutex> l(this->queue_mutex_);
-        if (!stored_exception_.empty())
-            throw std::runtime_error(stored_exception_);
-    }
-
-    int read = 0;
-    int remaining_len = safe_cast<int>(std::min(read_window_size_,
-                                                stream_buffer_.size() - cur_consumed_));
-    int res = libusb_bulk_transfer(this->dev_.get(), endpoint_in_,
-                                   &stream_buffer_.at(cur_consumed_),
-                                   remaining_len,
-                                   &read, timeout_millis);
-    if (res == LIBUSB_ERROR_TIMEOUT) {
-        this->terminator_->check_termination();
-        return false;
+        if (reader_.get_in_flight() == 0) {
+            std::unique_lock<std::mutex> ql(this->queue_mutex_);
+            if (out_in_flight_ == 0)
+                break;
+        }
+        timeval tv = {0, 100000};
+        libusb_handle_events_timeout_completed(this->ctx_.get(), &tv, nullptr);
     }
-    if (res < 0)
-        throw std::runtime_error(libusb_error_name(res));
-
-    cur_consumed_ += read;
-    return true;
+    reader_.free_transfers();
 }
 
-packet_ptr_t transport_t::handle_events(unsigned int timeout_millis) {
-
-    //Check if we have a header
-    if (cur_consumed_ < AA_PACKET_HEADER_SIZE) {
-        read_more(timeout_millis);
-        if (cur_consumed_ < AA_PACKET_HEADER_SIZE)
-            return packet_ptr_t();
-    }
+bool transport_t::read_more(int timeout_millis)
+{
+    check_stored_exception();
 
-    // Read the header
-    u_char chan = stream_buffer_.at(0);
-    u_char flags = stream_buffer_.at(1);
-    uint16_t packet_size = (uint16_t) (stream_buffer_.at(2) * 256 + stream_buffer_.at(3));
-    //Check if we need more data for this packet
-    if (cur_consumed_ < packet_size+4) {
-        read_more(timeout_millis);
-        return packet_ptr_t();
-    }
+    if (!reader_.is_started())
+        reader_.start(this->dev_.get(), endpoint_in_, in_transfer_size_);
 
-    packet_ptr_t cur_packet;
-    size_t header_size = 4;
+    if (reader_.drain(parser_) != 0)
+        return true;
 
-    // This is the first packet of multi-packet series
-    if ((flags & AA_LAST_FRAG) == 0 && (flags & AA_FIRST_FRAG))
-    {
-        if (this->mutli_packet_)
-            throw std::runtime_error("Interleaved multi-packet: first fragment");
-
-        packet_ptr_t multi_first(new packet_t());
-        multi_first->chan_ = chan;
-        multi_first->encrypted_ = flags & AA_ENCRYPTED;
-        multi_first->control_ = flags & AA_CONTROL_FLAG;
-
-        uint32_t full_size = safe_cast<uint32_t>(stream_buffer_.at(4)*(256*256*256) +
-                stream_buffer_.at(5)*(256*256) + stream_buffer_.at(6)*256 + stream_buffer_.at(7));
-
-        //Insert the initial content
-        multi_first->content_.reserve(full_size);
-        this->mutli_packet_ = multi_first;
-        cur_packet = multi_first;
-        header_size = 8;
-    } else if (this->mutli_packet_)
-    {
-        cur_packet = this->mutli_packet_;
-        if (chan != cur_packet->chan_)
-            throw std::runtime_error("Interleaved packet stream: middle fragment");
-    } else {
-        cur_packet = packet_ptr_t(new packet_t());
-        cur_packet->chan_ = chan;
-        cur_packet->encrypted_ = flags & AA_ENCRYPTED;
-        cur_packet->control_ = flags & AA_CONTROL_FLAG;
-        cur_packet->content_.reserve(packet_size);
-    }
+    // Wakes up on USB completions, termination or the reactor's timers
+    run_usb_reactor(this->ctx_.get(), reactor_, timeout_millis);
+    return reader_.drain(parser_) != 0;
+}
 
-    cur_packet->content_.insert(cur_packet->content_.end(),
-                                stream_buffer_.begin()+header_size,
-                                stream_buffer_.begin()+header_size+packet_size);
-    std::copy(stream_buffer_.begin()+packet_size+header_size, stream_buffer_.end(),
-              stream_buffer_.begin());
-    cur_consumed_ -= packet_size+header_size;
+void transport_t::on_packet_queued()
+{
+    this->have_pending_.notify_all();
+}
 
-    if (flags & AA_LAST_FRAG) {
-        this->mutli_packet_ = packet_ptr_t();
-        return cur_packet;
+void transport_t::submit_write(out_transfer_t *transfer)
+{
+    libusb_fill_bulk_transfer(transfer->xfer_, this->dev_.get(), this->endpoint_out_,
+                              &transfer->buf_[0], safe_cast<int>(transfer->buf_.size()),
+                              &transport_t::on_write_complete, transfer, poll_timeout_millis_);
+    int res = libusb_submit_transfer(transfer->xfer_);
+    if (res < 0) {
+        std::unique_lock<std::mutex> l(this->queue_mutex_);
+        out_in_flight_--;
+        free_out_transfers_.push_back(transfer);
+        throw std::runtime_error(libusb_error_name(res));
     }
-
-    return packet_ptr_t();
 }
 
-void transport_t::write_packet(packet_ptr_t packet) {
-    if (packet->content_.size()-4 > 65536)
-        throw std::out_of_range("USB packet out of range");
-    std::unique_lock<std::mutex> l(this->queue_mutex_);
-    this->write_queue_.push(packet);
-    this->have_pending_.notify_all();
+void transport_t::on_write_complete(libusb_transfer *xfer)
+{
+    // Called from the event handling in run_usb_reactor on the reading
+    // thread, the writer thread never handles the events
+    out_transfer_t *transfer = static_cast<out_transfer_t*>(xfer->user_data);
+    transport_t *self = transfer->owner_;
+    TA_TRACE() << "Written: " << xfer->actual_length;
+
+    std::unique_lock<std::mutex> l(self->queue_mutex_);
+    self->out_in_flight_--;
+    self->free_out_transfers_.push_back(transfer);
+    self->have_pending_.notify_all();
+
+    if (xfer->status == LIBUSB_TRANSFER_COMPLETED && xfer->actual_length == xfer->length) {
+        self->writer_stats_.transfers_++;
+        self->writer_stats_.bytes_written_ += xfer->actual_length;
+        return;
+    }
+
+    if (xfer->status != LIBUSB_TRANSFER_CANCELLED && self->stored_exception_.empty()) {
+        str_out_t p;
+        p << "Failed to write a buffer, OUT transfer status " << xfer->status;
+        self->stored_exception_ = p;
+    }
 }
 
 void transport_t::writer_loop() {
     try {
         TA_DEBUG() << "USB writer thread starts";
+        auto period_start = std::chrono::steady_clock::now();
+        uint64_t period_transfers = 0, period_bytes = 0;
+        std::vector<out_fragment_t> fragments;
         while(true)
         {
-            packet_ptr_t cur_packet;
+            out_transfer_t *transfer;
+            std::unique_lock<std::mutex> fl(this->frame_mutex_);
             {
                 std::unique_lock<std::mutex> l(this->queue_mutex_);
-                if (writer_termination_requested_)
+                if (writer_termination_requested_ || !stored_exception_.empty())
                     break;
 
-                if (!this->write_queue_.empty())
-                {
-                    cur_packet = this->write_queue_.front();
-                    this->write_queue_.pop();
-                } else
+                auto now = std::chrono::steady_clock::now();
+                double elapsed = std::chrono::duration<double>(now - period_start).count();
+                if (elapsed >= writer_stats_period_sec_) {
+                    uint64_t transfers = writer_stats_.transfers_ - period_transfers;
+                    uint64_t bytes = writer_stats_.bytes_written_ - period_bytes;
+                    if (transfers)
+                        TA_DEBUG() << "USB writer: " << transfers / elapsed << " transfers/s, "
+                                   << bytes / transfers << " bytes/transfer";
+                    period_start = now;
+                    period_transfers = writer_stats_.transfers_;
+                    period_bytes = writer_stats_.bytes_written_;
+                }
+
+                // Take whatever is queued for a free transfer. We go back to
+                // the lanes for each transfer, so a large media message
+                // doesn't hold back input and acks.
+                if (free_out_transfers_.empty() ||
+                        take_fragments(fragments, out_transfer_size_) == 0) {
+                    fl.unlock();
                     this->have_pending_.wait(l);
+                    continue;
+                }
+                transfer = free_out_transfers_.back();
+                free_out_transfers_.pop_back();
+                out_in_flight_++;
+            }
+
+            // Encrypt outside queue_mutex_, the producers and the write
+            // completions don't wait for it
+            try {
+                frame_fragments(fragments, transfer->buf_);
+            } catch(...) {
+                std::unique_lock<std::mutex> l(this->queue_mutex_);
+                out_in_flight_--;
+                free_out_transfers_.push_back(transfer);
+                throw;
             }
-            if (!cur_packet)
-                continue;
-
-            // Start the write request
-            std::vector<u_char> out_buf_;
-            out_buf_.reserve(cur_packet->content_.size()+4);
-            out_buf_.push_back(cur_packet->chan_);
-
-            u_char flags = AA_LAST_FRAG | AA_FIRST_FRAG;
-            if (cur_packet->encrypted_)
-                flags |= AA_ENCRYPTED;
-            if (cur_packet->control_)
-                flags |= AA_CONTROL_FLAG;
-            out_buf_.push_back(flags);
-
-            // Write the content length (big endian)
-            out_buf_.push_back(safe_cast<u_char>(cur_packet->content_.size() / 256));
-            out_buf_.push_back(safe_cast<u_char>(cur_packet->content_.size() % 256));
-
-            // Write the content data
-            out_buf_.insert(out_buf_.end(),
-                            cur_packet->content_.begin(), cur_packet->content_.end());
-
-            int actual = 0;
-            TA_TRACE() << "Writing packet: " << desc(cur_packet);
-            libusb_bulk_transfer(this->dev_.get(), this->endpoint_out_, &out_buf_[0],
-                                 safe_cast<int>(out_buf_.size()), &actual, poll_timeout_millis_);
-            TA_TRACE() << "Written: " << actual;
-
-            if (actual != out_buf_.size())
-                throw std::runtime_error("Failed to write a buffer");
+            fl.unlock();
+            fragments.clear();
+            submit_write(transfer);
         }
     } catch(const std::exception &ex)
     {
@@ -5,61 +5,70 @@
 #ifndef AAUTO_TRANSPORT_H
 #define AAUTO_TRANSPORT_H
 
-#include "utils.h"
+#include "transport_base.h"
+#include "usb_reader.h"
 #include <thread>
-#include <queue>
 
 struct libusb_context;
 struct libusb_device_handle;
+struct libusb_transfer;
 
 typedef std::shared_ptr<libusb_context> usb_context_ptr_t;
 typedef std::shared_ptr<libusb_device_handle> device_ptr_t;
 
-struct packet_t;
-typedef std::shared_ptr<packet_t> packet_ptr_t;
-
-class transport_t {
+// The USB accessory backend
+class transport_t : public transport_base_t {
     usb_context_ptr_t ctx_;
     device_ptr_t dev_;
-    const notifier_t *terminator_;
 
     uint8_t endpoint_in_, endpoint_out_, interface_id_;
     bool claimed_interface_;
 
     // Writer subinterface
     std::thread writer_thread_;
-    std::queue<packet_ptr_t> write_queue_;
-    std::mutex queue_mutex_;
+    // Several fragments are packed into one OUT transfer of at most this size
+    size_t out_transfer_size_;
+    // Asynchronous writer, completions are delivered by the same libusb
+    // event handling that drives the reader
+    struct out_transfer_t {
+        transport_t *owner_;
+        libusb_transfer *xfer_;
+        buf_t buf_;
+    };
+    std::vector<std::shared_ptr<out_transfer_t>> out_transfers_;
+    std::vector<out_transfer_t*> free_out_transfers_;
+    int out_in_flight_;
     std::condition_variable have_pending_;
     bool writer_termination_requested_;
-    std::string stored_exception_;
-
-    //Reader packet
-    buf_t stream_buffer_;
-    size_t read_window_size_, cur_consumed_;
-    packet_ptr_t mutli_packet_;
-    enum state_e {
-        READING_HEADER, READING_BODY
-    };
+
+    // Asynchronous reader, its completions come from the same event handling
+    size_t in_transfer_size_;
+    usb_reader_t reader_;
 
     static const int poll_timeout_millis_ = 1000;
-    static const size_t stream_buffer_size_ = 128000;
+    static const size_t in_transfer_buffer_size_ = 16384;
+    static const int writer_stats_period_sec_ = 10;
 public:
+    static const size_t default_in_transfers_ = 4;
+    static const size_t out_transfer_count_ = 4;
+
     transport_t(const usb_context_ptr_t &ctx_, const device_ptr_t &dev_,
-                const notifier_t *terminator);
+                const notifier_t *terminator,
+                size_t in_transfers = default_in_transfers_);
     virtual ~transport_t();
 
-    packet_ptr_t handle_events(unsigned int timeout_millis=poll_timeout_millis_);
-    void write_packet(packet_ptr_t packet);
-
     std::ostream& operator<<(std::ostream&);
 
 private:
+    bool read_more(int timeout_millis) override;
+    void on_packet_queued() override;
+
     void writer_loop();
-    bool read_more(unsigned int timeout_millis);
-};
+    void submit_write(out_transfer_t *transfer);
+    static void on_write_complete(libusb_transfer *xfer);
 
-typedef std::shared_ptr<transport_t> transport_ptr_t;
+    void cancel_transfers();
+};
 
 usb_context_ptr_t get_usb_lib();
 transport_ptr_t find_usb_transport(const usb_context_ptr_t &ctx, const notifier_t *notifier);
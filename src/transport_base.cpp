@@ -0,0 +1,171 @@
+#include "transport_base.h"
+
+transport_base_t::transport_base_t(const notifier_t *terminator) :
+        terminator_(terminator), lane_offsets_(), lane_skipped_(), writer_stats_()
+{
+}
+
+void transport_base_t::check_stored_exception()
+{
+    std::unique_lock<std::mutex> l(this->queue_mutex_);
+    if (!stored_exception_.empty())
+        throw std::runtime_error(stored_exception_);
+}
+
+void transport_base_t::collect_packets(std::vector<packet_ptr_t> &batch)
+{
+    while(true)
+    {
+        packet_ptr_t packet = parser_.next_packet();
+        if (!packet)
+            break;
+        if (capture_)
+            capture_->record_packet(CAPTURE_PLAIN_IN, *packet);
+        batch.push_back(packet);
+    }
+}
+
+size_t transport_base_t::handle_events(std::vector<packet_ptr_t> &batch,
+                                       int timeout_millis) {
+    batch.clear();
+    collect_packets(batch);
+    if (batch.empty()) {
+        read_more(timeout_millis);
+        collect_packets(batch);
+    }
+    return batch.size();
+}
+
+write_lane_t transport_base_t::lane_for(const packet_t &packet)
+{
+    switch(packet.chan_)
+    {
+        case AA_MIC_CHANNEL:
+            return WRITE_LANE_MEDIA;
+        case AA_TOUCHSCREEN_CHANNEL:
+        case AA_SENSOR_CHANNEL:
+            return WRITE_LANE_INPUT;
+        default:
+            return WRITE_LANE_CONTROL;
+    }
+}
+
+void transport_base_t::set_crypto(const std::shared_ptr<crypto_context_t> &crypto)
+{
+    parser_.set_crypto(crypto);
+    std::unique_lock<std::mutex> l(this->frame_mutex_);
+    crypto_ = crypto;
+}
+
+void transport_base_t::set_capture(const capture_ptr_t &capture)
+{
+    parser_.set_capture(capture);
+    std::unique_lock<std::mutex> fl(this->frame_mutex_);
+    std::unique_lock<std::mutex> l(this->queue_mutex_);
+    capture_ = capture;
+}
+
+void transport_base_t::write_packet(packet_ptr_t packet) {
+    if (packet->content_.size() > UINT32_MAX)
+        throw std::out_of_range("Packet out of range");
+    write_lane_t lane = lane_for(*packet);
+
+    {
+        std::unique_lock<std::mutex> l(this->queue_mutex_);
+        if (capture_)
+            capture_->record_packet(CAPTURE_PLAIN_OUT, *packet);
+        this->write_queues_[lane].push(packet);
+        writer_stats_.max_queue_depth_[lane] = std::max(writer_stats_.max_queue_depth_[lane],
+                                                        write_queues_[lane].size());
+    }
+    on_packet_queued();
+}
+
+writer_stats_t transport_base_t::get_writer_stats()
+{
+    std::unique_lock<std::mutex> l(this->queue_mutex_);
+    writer_stats_t res = writer_stats_;
+    for(int f=0; f<WRITE_LANE_COUNT; ++f)
+        res.queue_depth_[f] = write_queues_[f].size() + (lane_packets_[f] ? 1 : 0);
+    return res;
+}
+
+// Must be called with queue_mutex_ held
+int transport_base_t::pick_write_lane()
+{
+    int lane = -1;
+    for(int f=0; f<WRITE_LANE_COUNT; ++f) {
+        if (!lane_packets_[f] && write_queues_[f].empty())
+            continue;
+        if (lane < 0)
+            lane = f;
+        else if (lane_skipped_[f] >= lane_starvation_limit_) {
+            // Don't let a busy higher priority lane starve this one
+            lane = f;
+            break;
+        }
+    }
+    if (lane < 0)
+        return lane;
+
+    for(int f=0; f<WRITE_LANE_COUNT; ++f) {
+        if (f == lane)
+            lane_skipped_[f] = 0;
+        else if (lane_packets_[f] || !write_queues_[f].empty())
+            lane_skipped_[f]++;
+    }
+
+    if (!lane_packets_[lane]) {
+        lane_packets_[lane] = write_queues_[lane].front();
+        lane_offsets_[lane] = 0;
+        write_queues_[lane].pop();
+    }
+    return lane;
+}
+
+size_t transport_base_t::take_fragments(std::vector<out_fragment_t> &fragments, size_t budget)
+{
+    fragments.clear();
+    size_t wire_size = 0;
+    while(true)
+    {
+        int lane = pick_write_lane();
+        if (lane < 0)
+            break;
+
+        const packet_ptr_t &cur_packet = lane_packets_[lane];
+        size_t offset = lane_offsets_[lane];
+        // The first fragment always goes in, even if it exceeds the budget
+        size_t fragment_size = fragment_wire_size(*cur_packet, offset);
+        if (!fragments.empty() && wire_size + fragment_size > budget)
+            break;
+
+        if (offset == 0)
+            TA_TRACE() << "Writing packet: " << desc(cur_packet);
+        out_fragment_t fragment = {cur_packet, offset};
+        fragments.push_back(fragment);
+        wire_size += fragment_size;
+
+        offset = next_fragment_offset(*cur_packet, offset);
+        lane_offsets_[lane] = offset;
+        if (offset == cur_packet->content_.size()) {
+            lane_packets_[lane].reset();
+            writer_stats_.packets_sent_[lane]++;
+        }
+    }
+    return fragments.size();
+}
+
+void transport_base_t::frame_fragments(const std::vector<out_fragment_t> &fragments,
+                                       buf_t &out_buf)
+{
+    out_buf.clear();
+    for(const out_fragment_t &fragment : fragments)
+    {
+        size_t fragment_start = out_buf.size();
+        append_fragment(*fragment.packet_, fragment.offset_, out_buf, crypto_.get());
+        if (capture_)
+            capture_->record(CAPTURE_RAW_OUT, out_buf[fragment_start], out_buf[fragment_start+1],
+                             &out_buf[fragment_start], out_buf.size() - fragment_start);
+    }
+}
@@ -0,0 +1,122 @@
+#ifndef AAUTO_TRANSPORT_BASE_H
+#define AAUTO_TRANSPORT_BASE_H
+
+#include "utils.h"
+#include "framing.h"
+#include "reactor.h"
+#include <queue>
+
+// Outgoing packets are scheduled by lanes, lower lanes go first. The lane
+// is derived from the channel, so the messages of one channel are never
+// reordered.
+enum write_lane_t {
+    WRITE_LANE_CONTROL, // Control channel, media acks and focus replies
+    WRITE_LANE_INPUT,   // Touch events and sensors
+    WRITE_LANE_MEDIA,   // Outgoing media (microphone)
+    WRITE_LANE_COUNT
+};
+
+// Thrown by the transports that run out of data, like a replayed capture.
+// There's nothing to reconnect to, the session is over for good.
+class end_of_stream_exception : public std::runtime_error
+{
+public:
+    explicit end_of_stream_exception(const std::string &s) : runtime_error(s) {}
+};
+
+// A fragment taken off a write lane, waiting to be framed
+struct out_fragment_t
+{
+    packet_ptr_t packet_;
+    size_t offset_;
+};
+
+struct writer_stats_t
+{
+    size_t queue_depth_[WRITE_LANE_COUNT];
+    size_t max_queue_depth_[WRITE_LANE_COUNT];
+    uint64_t packets_sent_[WRITE_LANE_COUNT];
+    uint64_t transfers_, bytes_written_;
+};
+
+// A bidirectional AA byte stream. Implements the framing, the write lanes
+// and the packet batching, the backends only move the bytes.
+class transport_base_t {
+protected:
+    const notifier_t *terminator_;
+    // Identifies the phone across the reconnects, empty if unknown
+    std::string peer_id_;
+    reactor_t reactor_;
+    frame_parser_t parser_;
+
+    std::queue<packet_ptr_t> write_queues_[WRITE_LANE_COUNT];
+    // Messages are sent fragment by fragment, so each lane can have one
+    // partially written packet
+    packet_ptr_t lane_packets_[WRITE_LANE_COUNT];
+    size_t lane_offsets_[WRITE_LANE_COUNT];
+    unsigned lane_skipped_[WRITE_LANE_COUNT];
+    writer_stats_t writer_stats_;
+    std::mutex queue_mutex_;
+    std::string stored_exception_;
+
+    // Serializes the writers, so the fragments are encrypted in the order
+    // they're taken off the lanes. Taken before queue_mutex_, the producers
+    // never wait for it.
+    std::mutex frame_mutex_;
+    std::shared_ptr<crypto_context_t> crypto_;
+    // Set under both locks
+    capture_ptr_t capture_;
+
+    // A ready lane is served after being passed over this many times
+    static const unsigned lane_starvation_limit_ = 8;
+public:
+    explicit transport_base_t(const notifier_t *terminator);
+    virtual ~transport_base_t() {}
+
+    // Fills the batch with every complete packet available after at most
+    // one wait for events, returns the number of packets. Waits forever if
+    // the timeout is negative, the reactor's timers and the termination
+    // still wake it up.
+    size_t handle_events(std::vector<packet_ptr_t> &batch, int timeout_millis=-1);
+
+    // The reactor that drives this transport, its timers run on the thread
+    // calling handle_events
+    reactor_t &get_reactor() { return reactor_; }
+    const std::string &get_peer_id() const { return peer_id_; }
+    void write_packet(packet_ptr_t packet);
+    // Encrypted packets are encrypted by the writer with this context as
+    // they're framed, and incoming encrypted fragments are decrypted with it
+    void set_crypto(const std::shared_ptr<crypto_context_t> &crypto);
+    writer_stats_t get_writer_stats();
+    // Records the raw fragments and the plaintext messages in both
+    // directions. Must be set before the transport is used.
+    void set_capture(const capture_ptr_t &capture);
+    // The replayed sessions are already past the handshake
+    virtual bool needs_handshake() const { return true; }
+
+protected:
+    // Waits for at most timeout_millis for more incoming data and feeds
+    // it to the parser, returns true if anything has been read
+    virtual bool read_more(int timeout_millis) = 0;
+    // A packet has been queued for writing, called on the producer's thread
+    // after queue_mutex_ is released
+    virtual void on_packet_queued() = 0;
+
+    // Must be called with frame_mutex_ and queue_mutex_ held. Takes as many
+    // fragments as fit into the budget off the lanes, returns their number.
+    size_t take_fragments(std::vector<out_fragment_t> &fragments, size_t budget);
+    // Must be called with frame_mutex_ held, but not queue_mutex_. Frames
+    // and encrypts the taken fragments into the buffer, which is the slow
+    // part, so it stays out of the producers' way.
+    void frame_fragments(const std::vector<out_fragment_t> &fragments, buf_t &out_buf);
+    void check_stored_exception();
+
+private:
+    static write_lane_t lane_for(const packet_t &packet);
+    int pick_write_lane();
+    void collect_packets(std::vector<packet_ptr_t> &batch);
+};
+
+typedef std::shared_ptr<transport_base_t> transport_ptr_t;
+
+#endif //AAUTO_TRANSPORT_BASE_H
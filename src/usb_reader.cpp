@@ -0,0 +1,121 @@
+#include "usb_reader.h"
+#include <libusb.h>
+
+usb_reader_t::usb_reader_t(size_t transfer_count, error_handler_t on_error) :
+        transfer_count_(transfer_count), on_error_(on_error), completed_offset_(), in_flight_()
+{
+    if (transfer_count_ == 0)
+        throw std::invalid_argument("At least one IN transfer is required");
+}
+
+usb_reader_t::~usb_reader_t()
+{
+    free_transfers();
+}
+
+void usb_reader_t::start(libusb_device_handle *dev, uint8_t endpoint, size_t transfer_size)
+{
+    TA_DEBUG() << "Starting " << transfer_count_ << " IN transfers of "
+               << transfer_size << " bytes";
+
+    buffers_.resize(transfer_count_);
+    for(size_t f=0; f<transfer_count_; ++f)
+    {
+        libusb_transfer *xfer = libusb_alloc_transfer(0);
+        if (!xfer)
+            throw std::runtime_error("Failed to allocate an IN transfer");
+        transfers_.push_back(xfer);
+
+        buffers_.at(f).resize(transfer_size);
+        libusb_fill_bulk_transfer(xfer, dev, endpoint,
+                                  &buffers_.at(f).at(0), safe_cast<int>(transfer_size),
+                                  &usb_reader_t::on_complete, this, 0);
+        submit(xfer);
+    }
+}
+
+void usb_reader_t::cancel()
+{
+    //Cancellation fails harmlessly for idle transfers
+    for(libusb_transfer *xfer : transfers_)
+        libusb_cancel_transfer(xfer);
+}
+
+int usb_reader_t::get_in_flight()
+{
+    std::unique_lock<std::mutex> l(this->mutex_);
+    return in_flight_;
+}
+
+void usb_reader_t::free_transfers()
+{
+    for(libusb_transfer *xfer : transfers_)
+        libusb_free_transfer(xfer);
+    transfers_.clear();
+    completed_.clear();
+    completed_offset_ = 0;
+}
+
+void usb_reader_t::submit(libusb_transfer *xfer)
+{
+    std::unique_lock<std::mutex> l(this->mutex_);
+    int res = libusb_submit_transfer(xfer);
+    if (res < 0)
+        throw std::runtime_error(libusb_error_name(res));
+    in_flight_++;
+}
+
+void usb_reader_t::on_complete(libusb_transfer *xfer)
+{
+    // Called from the libusb event handling, on the thread calling
+    // handle_events
+    usb_reader_t *self = static_cast<usb_reader_t*>(xfer->user_data);
+    {
+        std::unique_lock<std::mutex> l(self->mutex_);
+        self->in_flight_--;
+        if (xfer->status == LIBUSB_TRANSFER_COMPLETED) {
+            self->completed_.push_back(xfer);
+            return;
+        }
+    }
+
+    if (xfer->status == LIBUSB_TRANSFER_CANCELLED)
+        return;
+
+    str_out_t p;
+    p << "IN transfer failed with status " << xfer->status;
+    self->on_error_(p);
+}
+
+size_t usb_reader_t::drain(frame_parser_t &parser)
+{
+    size_t total = 0;
+    while(true)
+    {
+        libusb_transfer *xfer;
+        {
+            std::unique_lock<std::mutex> l(this->mutex_);
+            if (completed_.empty())
+                break;
+            xfer = completed_.front();
+        }
+
+        size_t avail = xfer->actual_length - completed_offset_;
+        size_t len = parser.feed(xfer->buffer + completed_offset_, avail);
+        completed_offset_ += len;
+        total += len;
+
+        // The stream buffer is full, the rest will be picked up once the
+        // parser frees some space
+        if (len != avail)
+            break;
+
+        {
+            std::unique_lock<std::mutex> l(this->mutex_);
+            completed_.pop_front();
+        }
+        completed_offset_ = 0;
+        submit(xfer);
+    }
+    return total;
+}
@@ -0,0 +1,53 @@
+#ifndef AAUTO_USB_READER_H
+#define AAUTO_USB_READER_H
+
+#include "framing.h"
+#include <deque>
+#include <functional>
+
+struct libusb_device_handle;
+struct libusb_transfer;
+
+// Reads an IN endpoint with several transfers in flight, so the pipe is
+// never idle while the data is being parsed. The completions are delivered
+// by the libusb event handling on the reading thread, and a transfer is
+// resubmitted once the parser has taken all of its data.
+class usb_reader_t {
+public:
+    // Called from the event handling when a transfer fails
+    typedef std::function<void(const std::string &error)> error_handler_t;
+
+private:
+    const size_t transfer_count_;
+    error_handler_t on_error_;
+    std::vector<libusb_transfer*> transfers_;
+    std::vector<buf_t> buffers_;
+    std::mutex mutex_;
+    std::deque<libusb_transfer*> completed_;
+    // The part of the front completed transfer the parser has taken
+    size_t completed_offset_;
+    int in_flight_;
+
+public:
+    usb_reader_t(size_t transfer_count, error_handler_t on_error);
+    // The transfers must not be in flight anymore, see cancel()
+    ~usb_reader_t();
+
+    bool is_started() const { return !transfers_.empty(); }
+    void start(libusb_device_handle *dev, uint8_t endpoint, size_t transfer_size);
+    // Feeds the completed transfers to the parser in order, returns the
+    // number of bytes fed
+    size_t drain(frame_parser_t &parser);
+
+    // The cancellations are delivered by the event handling, the transfers
+    // can be freed once none is in flight
+    void cancel();
+    int get_in_flight();
+    void free_transfers();
+
+private:
+    void submit(libusb_transfer *xfer);
+    static void on_complete(libusb_transfer *xfer);
+};
+
+#endif //AAUTO_USB_READER_H
@@ -4,7 +4,7 @@
 #include <assert.h>
 #include <iostream>
 #include "utils.h"
-#include <sys/select.h>
+#include <poll.h>
 
 debug_level debug_stream_t::the_debug_level_ = DEBUG_OUTPUT;
 std::mutex debug_stream_t::out_mutex_;
@@ -14,9 +14,10 @@ void notifier_t::sleep(uint32_t millis) const
     if (is_terminating())
         return;
 
-    assert(millis >= 0);
-    timeval tm={(int)millis/1000, (int)(millis%1000) * 10000};
-    select(0, NULL, NULL, NULL, &tm);
+    // Wait on the termination pipe, so that we wake up as soon as we're
+    // asked to quit
+    pollfd pfd = {pipe_r_, POLLIN, 0};
+    poll(&pfd, 1, safe_cast<int>(millis));
 }
 
 debug_stream_t::~debug_stream_t() {
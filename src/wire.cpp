@@ -0,0 +1,117 @@
+#include "wire.h"
+
+void wire_writer_t::end_message(size_t start)
+{
+    size_t len = buf_.size() - start;
+    if (len < 0x80) {
+        buf_[start - 1] = u_char(len);
+        return;
+    }
+
+    // Make room for the longer length, the buffer usually has the capacity
+    size_t extra = varint_size(len) - 1;
+    buf_.insert(buf_.begin() + start, extra, 0);
+    encode_varint(len, &buf_[start - 1]);
+}
+
+wire_reader_t::wire_reader_t(const packet_t &packet) : key_()
+{
+    const buf_t &content = packet.content_;
+    if (content.size() < 2)
+        throw std::runtime_error("The packet has no message type");
+    pos_ = content.data() + 2;
+    end_ = content.data() + content.size();
+}
+
+bool wire_reader_t::next()
+{
+    if (pos_ == end_)
+        return false;
+    uint64_t key = read_varint();
+    if (key > UINT32_MAX || (key >> 3) == 0)
+        throw std::runtime_error("Malformed message: bad field key");
+    key_ = uint32_t(key);
+    return true;
+}
+
+uint64_t wire_reader_t::read_varint()
+{
+    uint64_t res = 0;
+    for(int shift = 0; shift < 64; shift += 7) {
+        if (pos_ == end_)
+            throw std::runtime_error("Malformed message: truncated varint");
+        u_char cur = *pos_++;
+        res |= uint64_t(cur & 0x7f) << shift;
+        if (!(cur & 0x80))
+            return res;
+    }
+    throw std::runtime_error("Malformed message: varint is too long");
+}
+
+const u_char *wire_reader_t::take(size_t len)
+{
+    if (size_t(end_ - pos_) < len)
+        throw std::runtime_error("Malformed message: truncated field");
+    const u_char *res = pos_;
+    pos_ += len;
+    return res;
+}
+
+void wire_reader_t::expect(wire_type_t type)
+{
+    if (this->type() != type) {
+        str_out_t p;
+        p << "Malformed message: field " << field() << " has wire type " << this->type()
+          << ", expected " << type;
+        throw std::runtime_error(p);
+    }
+}
+
+uint64_t wire_reader_t::varint()
+{
+    expect(WIRE_VARINT);
+    return read_varint();
+}
+
+const u_char *wire_reader_t::bytes(size_t &len)
+{
+    expect(WIRE_BYTES);
+    uint64_t size = read_varint();
+    if (size > uint64_t(end_ - pos_))
+        throw std::runtime_error("Malformed message: truncated field");
+    len = size_t(size);
+    return take(len);
+}
+
+wire_reader_t wire_reader_t::message()
+{
+    size_t len;
+    const u_char *data = bytes(len);
+    return wire_reader_t(data, len);
+}
+
+void wire_reader_t::skip()
+{
+    switch(type())
+    {
+        case WIRE_VARINT:
+            read_varint();
+            break;
+        case WIRE_FIXED64:
+            take(8);
+            break;
+        case WIRE_BYTES: {
+            size_t len;
+            bytes(len);
+            break;
+        }
+        case WIRE_FIXED32:
+            take(4);
+            break;
+        default: {
+            str_out_t p;
+            p << "Malformed message: unsupported wire type " << type();
+            throw std::runtime_error(p);
+        }
+    }
+}
@@ -0,0 +1,121 @@
+#ifndef AAUTO_WIRE_H
+#define AAUTO_WIRE_H
+
+#include "utils.h"
+#include "aa_helpers.h"
+
+// The subset of the protobuf wire format used by the AA messages
+enum wire_type_t {
+    WIRE_VARINT = 0,
+    WIRE_FIXED64 = 1,
+    WIRE_BYTES = 2, // Strings and nested messages
+    WIRE_FIXED32 = 5,
+};
+
+// Compile-time field descriptor, the key is known when the message is built
+// and can be used as a case label when it's parsed
+template<uint32_t Number, wire_type_t Type> struct wire_field_t {
+    static const uint32_t number_ = Number;
+    static const wire_type_t type_ = Type;
+    static const uint32_t key_ = (Number << 3) | Type;
+};
+
+// Appends the fields to a buffer, normally the content of the packet being
+// built. Nested messages are written in place: the length is patched in
+// once the message is complete, so there are no intermediate buffers.
+class wire_writer_t {
+    buf_t &buf_;
+public:
+    explicit wire_writer_t(buf_t &buf) : buf_(buf) {}
+
+    template<class F> void varint(uint64_t val) {
+        static_assert(F::type_ == WIRE_VARINT, "Not a varint field");
+        put_key<F>();
+        put_varint(val);
+    }
+
+    template<class F> void boolean(bool val) {
+        varint<F>(val ? 1 : 0);
+    }
+
+    template<class F> void bytes(const void *data, size_t len) {
+        static_assert(F::type_ == WIRE_BYTES, "Not a length-delimited field");
+        put_key<F>();
+        put_varint(len);
+        const u_char *start = static_cast<const u_char*>(data);
+        buf_.insert(buf_.end(), start, start + len);
+    }
+
+    template<class F> void string(const char *str) {
+        bytes<F>(str, strlen(str));
+    }
+
+    // Writes the nested message produced by the body
+    template<class F, class Body> void message(Body body) {
+        size_t start = begin_message<F>();
+        body();
+        end_message(start);
+    }
+
+    template<class F> size_t begin_message() {
+        static_assert(F::type_ == WIRE_BYTES, "Not a length-delimited field");
+        put_key<F>();
+        // Most of the nested messages are short, a one byte length is
+        // reserved and moved out of the way only if it's not enough
+        buf_.push_back(0);
+        return buf_.size();
+    }
+    void end_message(size_t start);
+
+private:
+    template<class F> void put_key() {
+        if (F::key_ < 0x80)
+            buf_.push_back(u_char(F::key_));
+        else
+            put_varint(F::key_);
+    }
+
+    void put_varint(uint64_t val) {
+        if (val < 0x80) {
+            buf_.push_back(u_char(val));
+            return;
+        }
+        size_t pos = buf_.size();
+        buf_.resize(pos + AA_MAX_VARINT_SIZE);
+        buf_.resize(pos + encode_varint(val, &buf_[pos]));
+    }
+};
+
+// Walks the fields of a message in place. Nested messages are read with
+// their own readers over the same memory, nothing is copied or allocated.
+// Throws on malformed input.
+class wire_reader_t {
+    const u_char *pos_, *end_;
+    uint32_t key_;
+public:
+    wire_reader_t(const u_char *data, size_t len) : pos_(data), end_(data + len), key_() {}
+    // Reads the message of a packet, past the message type
+    explicit wire_reader_t(const packet_t &packet);
+
+    // Moves to the next field, returns false at the end of the message.
+    // The value of the current field must be read or skipped first.
+    bool next();
+
+    uint32_t key() const { return key_; }
+    uint32_t field() const { return key_ >> 3; }
+    wire_type_t type() const { return wire_type_t(key_ & 7); }
+
+    uint64_t varint();
+    bool boolean() { return varint() != 0; }
+    // Returns the pointer to the value, valid as long as the message is
+    const u_char *bytes(size_t &len);
+    wire_reader_t message();
+    void skip();
+
+private:
+    uint64_t read_varint();
+    const u_char *take(size_t len);
+    void expect(wire_type_t type);
+};
+
+#endif //AAUTO_WIRE_H